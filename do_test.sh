@@ -36,7 +36,7 @@ function file_deleted {
 function usage {
 	echo "usage: $0 [--uidgid xxx:xxx] some test names"
 	echo "Avaiable tests:"
-	echo "create_read, dedup, fstest, crashresistant"
+	echo "create_read, dedup, fstest, crashresistant, recovery"
 	cd /tests/ 
 	echo "Available tests in fstest:"
 	ls -d */ 
@@ -59,7 +59,7 @@ function remount {
 		cp /srv/log.txt $OUTPUT
 		chown -R $UIDGID /output
 		check_for_crash
-		/cloudCryptFS.docker -osrc=/srv/ -onegative_timeout=0 -ohard_remove -onoauto_cache -odirect_io,use_ino -oattr_timeout=0 -oentry_timeout=0 -opass=menne -o allow_other mnt > /output/remount_$1.txt  || quit
+		/cloudCryptFS.docker -osrc=/srv/ -onegative_timeout=0 -ohard_remove -onoauto_cache -odirect_io,use_ino -oattr_timeout=0 -oentry_timeout=0 -opass=menne -o allow_other mnt "${@:2}" > /output/remount_$1.txt  || quit
 }
 
 function checkstat {
@@ -140,6 +140,18 @@ if [[ "$1" == "crashresistant" ]]; then
 		cp -r /srv/journal /output
 		rm -f /srv/._lock
 		touch /output/crashresistant
+elif [[ "$1" == "recovery" ]]; then
+		#Several GB of writes in the journal & a crash: the next mount replays them, its log has the time it took.
+		#A cache that holds every dirty bucket: nothing is stored, so no checkpoint retires the journal before the kill.
+		remount "recovery" -ocache_mb=4096
+		for i in $(seq -f "%02g" 1 14); do
+			#The prefix shifts the chunks, the copies do not dedup.
+			{ echo $i; cat /bigfile; } > /mnt/big$i
+		done
+		kill -9 `pidof cloudCryptFS.docker`
+		du -sb /srv/journal > /output/recovery_journal_size
+		rm -f /srv/._lock
+		touch /output/recovery
 elif [[ "$1" == "create_read" ]]; then
 		cp /cloudCryptFS.docker /mnt/ccfstestfile -v
 		cp /testfile1 /mnt -v
@@ -214,6 +226,20 @@ if [[ -f "/output/crashresistant" ]]; then
 	checkstat /mnt/tf5 "%s" "123"
 fi
 
+if [[ -f "/output/recovery" ]]; then
+	JOURNAL_BYTES=`cut -f1 /output/recovery_journal_size`
+	echo "RECOVERY: journal bytes: $JOURNAL_BYTES"
+	if (( JOURNAL_BYTES >= 1024*1024*1024 )); then
+		echo "PASS: the journal that was replayed is $((JOURNAL_BYTES/1024/1024)) MB"
+	else
+		echo "FAIL! the journal that was replayed is $((JOURNAL_BYTES/1024/1024)) MB, expected GBs"
+	fi
+	echo "RECOVERY: `grep -h "Replayed" /output/remount_step2.txt /srv/log.txt 2>/dev/null | tail -n 1`"
+	echo "RECOVERY: peak memory of the mount that replayed: `grep VmHWM /proc/$(pidof cloudCryptFS.docker)/status`"
+	compare_files /mnt/big01 <(echo 01; cat /bigfile)
+	compare_files /mnt/big14 <(echo 14; cat /bigfile)
+fi
+
 if [[ -f "/output/create_read" ]]; then
 	compare_files /mnt/testfile1 /testfile1
 	compare_files /mnt/testfile2 /testfile2
@@ -146,7 +146,7 @@ static int getattr_callback(const char *path, MYSTAT *stbuf) {
 #endif
 		//stbuf->st_ino = 0;
 		stbuf->st_blocks = stbuf->st_size / 4096;
-		stbuf->st_blksize = 4096;
+		stbuf->st_blksize = filesystem::chunkSize;
 		//if(str(path)!="/")CLOG("getattr_callback ",path," ",stbuf->st_size," mode: ",stbuf->st_mode);
 		return 0;
 	}
@@ -175,14 +175,14 @@ static int readdir_callback(const char *path, void *buf, fuse_fill_dir_t filler,
 	if(D->valid() && D->type()==fileType::DIR) {
 		filler(buf, ".", NULL, 0);
 		filler(buf, "..", NULL, 0);
-		auto meta = script::make_json();
-		if(!D->readDirectoryContent(meta)) {
-			return -ENOENT;
-		}
-		for(auto & it: *meta) {
-			if (it.second.get<script::SLT::I>(0,1) > 0) {
-				filler(buf, it.first.c_str(), nullptr, 0);
+		const bool ok = D->listNodes([&](const str & name,uint64_t id) {
+			if ((script::int_t)id > 0) {
+				filler(buf, name.c_str(), nullptr, 0);
 			}
+			return true;
+		});
+		if(!ok) {
+			return -ENOENT;
 		}
 	}
 	//filler(buf, filename, NULL, 0);
@@ -241,7 +241,7 @@ static int read_callback(const char *path, char *buf, my_size_t size, my_off_t o
 	auto D = FS->get(path,nullptr,fi->fh);
 	if(D->valid() && D->type()==fileType::FILE) {
 		_ASSERT(buf != nullptr);
-		auto ret =  (int)D->read((unsigned char *)buf,size,offset);
+		auto ret =  (int)D->read((unsigned char *)buf,size,offset,FS->getReadAhead(fi->fh));
 		//CLOG("read returns: ",ret);
 		return ret;
 	}
@@ -450,12 +450,31 @@ static struct fuse_opt myfs_opts[] = {
 	
 	MYFS_OPT("--loglevel %s",      loglevel, 0),
 	MYFS_OPT("loglevel=%s",        loglevel, 0),
+	MYFS_OPT("--writeback_threads %s", writeback_threads, 0),
+	MYFS_OPT("writeback_threads=%s",   writeback_threads, 0),
+	MYFS_OPT("--cache_mb %s",      cache_mb, 0),
+	MYFS_OPT("cache_mb=%s",        cache_mb, 0),
+	MYFS_OPT("--compress %s",      compress, 0),
+	MYFS_OPT("compress=%s",        compress, 0),
+	MYFS_OPT("--lazy_index %s",    lazy_index, 0),
+	MYFS_OPT("lazy_index=%s",      lazy_index, 0),
+	MYFS_OPT("--verify_dedup %s",  verify_dedup, 0),
+	MYFS_OPT("verify_dedup=%s",    verify_dedup, 0),
+	MYFS_OPT("--journal %s",       journal, 0),
+	MYFS_OPT("journal=%s",         journal, 0),
+	MYFS_OPT("--journal_data %s",  journal_data, 0),
+	MYFS_OPT("journal_data=%s",    journal_data, 0),
+	MYFS_OPT("--journal_direct %s",journal_direct, 0),
+	MYFS_OPT("journal_direct=%s",  journal_direct, 0),
+	MYFS_OPT("--dir_format %s",    dir_format, 0),
+	MYFS_OPT("dir_format=%s",      dir_format, 0),
 	MYFS_OPT("--keyfile %s",       keyfile, 0),
 	MYFS_OPT("keyfile=%s",         keyfile, 0),
 	MYFS_OPT("--pass %s",          password, 0),
 	MYFS_OPT("pass=%s",            password, 0),
 	MYFS_OPT("--create %s",        create, 0),
 	MYFS_OPT("--migrateto %s",     migrate, 0),
+	MYFS_OPT("--bench %s",         bench, 0),
 	FUSE_OPT_KEY("-V",             KEY_VERSION),
 	FUSE_OPT_KEY("--version",      KEY_VERSION),
 	FUSE_OPT_KEY("-h",             KEY_HELP),
@@ -484,7 +503,17 @@ static int myfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 			"    --pass [password] -OR- -opass=[...]\n"
 			"    --create yes\n"
 			"    --migrateto [protocol version (or latest)]\n"
+			"    --bench map|sha (run a microbenchmark, print the results & exit)\n"
 			"    --loglevel N  -OR- -ologlevel=N\n"
+			"    --writeback_threads N  -OR- -owriteback_threads=N (threads used to write buckets, default: number of cores)\n"
+			"    --cache_mb N  -OR- -ocache_mb=N (memory for decrypted chunks, default: 128)\n"
+			"    --compress none|lz4  -OR- -ocompress=none|lz4 (compress chunks of new bucket files, default: none)\n"
+			"    --lazy_index yes  -OR- -olazy_index=yes (serve reads while the dedup index is built in the background, writes wait for it)\n"
+			"    --verify_dedup sync|async  -OR- -overify_dedup=sync|async (compare deduplicated chunks inside the write or in the background, default: sync)\n"
+			"    --journal none|batched|sync  -OR- -ojournal=none|batched|sync (fdatasync journal entries: never, grouped per commit or per operation, default: batched)\n"
+			"    --journal_data journal|ordered  -OR- -ojournal_data=journal|ordered (journal the written data, or store & sync the chunks first & journal where they are, default: journal)\n"
+			"    --journal_direct yes  -OR- -ojournal_direct=yes (write the journal segments with O_DIRECT, bypassing the page cache)\n"
+			"    --dir_format hashed|json  -OR- -odir_format=hashed|json (store changed directories as hashed blocks & migrate JSON ones, which older versions cannot read, or keep JSON, default: json)\n"
 			
 			);
 			fuse_opt_add_arg(outargs, "-ho");
@@ -20,6 +20,7 @@
 #include <modules/script/JSON.h>
 #include <modules/util/files.h>
 #include <modules/util/console.h>
+#include <modules/util/benchmark.h>
 #include "modules/util/endian.h"
 #include "modules/filesystem/journal.h"
 
@@ -38,6 +39,9 @@ int main(int argc, char *argv[]) {
 	
 	auto * args = parseArgs(argc,argv,&conf);
 
+	if(conf.bench) {
+		return util::runBenchmark(conf.bench);
+	}
 	
 	if(conf.source) {
 		//CLOG(conf.source);
@@ -57,6 +61,37 @@ int main(int argc, char *argv[]) {
 		JOURNAL->setLogLevel(std::stoi(conf.loglevel));
 		FS->setLogLevel(std::stoi(conf.loglevel));
 	}
+	if(conf.writeback_threads) {
+		STOR->setWritebackThreads(std::stoi(conf.writeback_threads));
+	}
+	if(conf.cache_mb) {
+		STOR->cache.setBudget(std::stoull(conf.cache_mb)*1024*1024);
+	}
+	if(conf.compress) {
+		STOR->setCompression(filesystem::codecFromName(conf.compress));
+	}
+	if(conf.lazy_index) {
+		STOR->setLazyIndex(str(conf.lazy_index)=="yes");
+	}
+	if(conf.verify_dedup) {
+		STOR->verifier.setMode(filesystem::dedupVerifier::modeFromName(conf.verify_dedup));
+	}
+	if(conf.journal) {
+		JOURNAL->setDurability(filesystem::durabilityFromName(conf.journal));
+	}
+	if(conf.journal_data) {
+		JOURNAL->setDataMode(filesystem::dataModeFromName(conf.journal_data));
+	}
+	if(conf.journal_direct) {
+		JOURNAL->setDirect(str(conf.journal_direct)=="yes");
+	}
+	if(conf.dir_format) {
+		const str format(conf.dir_format);
+		if(format!="hashed" && format!="json") {
+			throw std::invalid_argument(str("unknown directory format "+format).c_str());
+		}
+		FS->setHashedDirectories(format=="hashed");
+	}
 	
 	
 	
@@ -81,6 +116,7 @@ int main(int argc, char *argv[]) {
 	if(mustCreate) {
 		FS->srvMESSAGE("Generating new startup configuration");
 		config = crypto::protocolInterface::newConfig("latest");
+		STOR->storeGeometry(config);
 		if(cfg.empty()==false) {
 			FS->srvERROR("Found existing config.json, abort!");
 			return EXIT_FAILURE;
@@ -90,6 +126,9 @@ int main(int argc, char *argv[]) {
 			FS->srvMESSAGE("Loading startup configuration");
 			FS->srvDEBUG(cfg);
 			config->unserialize(cfg);
+			if(!STOR->checkGeometry(config)) {
+				return EXIT_FAILURE;
+			}
 		} else {
 			FS->srvERROR("Could not load config.json, abort!");
 			return EXIT_FAILURE;
@@ -139,6 +178,7 @@ int main(int argc, char *argv[]) {
 	if(conf.migrate) {
 		auto newConfig = script::make_json();
 		newConfig = crypto::protocolInterface::newConfig(conf.migrate);
+		STOR->storeGeometry(newConfig);
 		auto newProtocol = crypto::protocolInterface::get(newConfig);
 		const str keyfileContent = newProtocol->createKeyfileContent();
 		{
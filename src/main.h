@@ -33,6 +33,16 @@ struct myfs_config {
 	const char *create;
 	const char *migrate;
 	const char *loglevel;
+	const char *writeback_threads;
+	const char *cache_mb;
+	const char *compress;
+	const char *lazy_index;
+	const char *verify_dedup;
+	const char *journal;
+	const char *journal_data;
+	const char *journal_direct;
+	const char *dir_format;
+	const char *bench;
 };
 
 #ifdef _WIN32
@@ -4,6 +4,7 @@
 #define CRYPTO_PROTOCOL_CPP
 #include "protocol.h"
 #include <stdexcept>
+#include <cstring>
 #include <sodium.h>
 #include "main.h"
 #include "sha256.h"
@@ -238,7 +239,7 @@ class protocol : public protocolInterface {
 	}
 	
 	
-	void encrypt(shared_ptr<key> k,const str & in, str & out) override {
+	void encrypt(shared_ptr<key> k,const str & in, str & out,const str & additionalData) override {
 		auto _iv = newRandomIV();
 		auto ivbytes = _iv->use();
 		out.resize(	in.size()+crypto_aead_xchacha20poly1305_ietf_ABYTES);
@@ -250,7 +251,7 @@ class protocol : public protocolInterface {
 			auto keybytes = k->use();
 			if(crypto_aead_xchacha20poly1305_ietf_encrypt(reinterpret_cast<unsigned char *>(&out[0]), &output_length,
                                    _STRTOBYTESIZE(in),
-                                   nullptr, 0, //Optional additional data
+                                   additionalData.empty() ? nullptr : reinterpret_cast<const unsigned char *>(additionalData.data()), additionalData.size(), //Optional additional data
                                    NULL, ivbytes.data(), keybytes.data() )) {
 				throw std::logic_error("Encryption function return non-zero");
 			}
@@ -261,35 +262,43 @@ class protocol : public protocolInterface {
 		//Append the IV to the data:
 		out.append(reinterpret_cast<const char *>(ivbytes.data()),ivbytes.size());	
 	}
-	void decrypt(shared_ptr<key> k,const str & in, str & out) override {
-		str cipher = in.substr(0,in.size()-IVSize);
-		
+	void decrypt(shared_ptr<key> k,const str & in, str & out,const str & additionalData) override {
+		out.resize(in.size());
+		out.resize(decryptTo(k,reinterpret_cast<const unsigned char *>(in.data()),in.size(),reinterpret_cast<unsigned char *>(&out[0]),out.size(),additionalData));
+	}
+
+	size_t decryptTo(shared_ptr<key> k,const unsigned char * in,size_t inSize,unsigned char * out,size_t outSize,const str & additionalData) override {
+		if(inSize <= IVSize+crypto_aead_xchacha20poly1305_ietf_ABYTES) {
+			throw std::logic_error("Message too short");
+		}
 		//split out the IV:
-		const str ivdta = in.substr(in.size()-IVSize);
-		auto * tst = reinterpret_cast<const uint64_t *>(ivdta.data());
-		if(*tst == 0) {
+		const size_t cipherSize = inSize-IVSize;
+		const unsigned char * ivdta = in+cipherSize;
+		uint64_t tst;
+		std::memcpy(&tst,ivdta,sizeof(tst));
+		if(tst == 0) {
 			throw std::logic_error("Too many zero's in IV");
 		}
-		_ASSERT(cipher.size()>0);
-		out.resize(	cipher.size());
+		if(outSize < cipherSize-crypto_aead_xchacha20poly1305_ietf_ABYTES) {
+			throw std::out_of_range("Output buffer too small");
+		}
 		
 		unsigned long long output_length=0;
 		
 		{
 			
 			auto keybytes = k->use();
-			//CLOG("_data.size()",_data.size()," cipher.size()",cipher.size()," _iv.size()",_iv->size());
 			auto res = crypto_aead_xchacha20poly1305_ietf_decrypt(
-				reinterpret_cast<unsigned char *>(&out[0]), &output_length, //Output
+				out, &output_length, //Output
 				nullptr, //Not used
-				_STRTOBYTESIZE(cipher),
-				nullptr,0,//Optional additional data
-				reinterpret_cast<const unsigned char *>(ivdta.data()), keybytes.data());
+				in, cipherSize,
+				additionalData.empty() ? nullptr : reinterpret_cast<const unsigned char *>(additionalData.data()), additionalData.size(),//Optional additional data
+				ivdta, keybytes.data());
 			if(res!=0) {
 				throw std::logic_error("Message forged");
 			}
 		}
-		out.resize(output_length);
+		return output_length;
 	}
 
 
@@ -88,11 +88,14 @@ namespace crypto{
 		/* Generate a new random iv */
 		virtual shared_ptr<key> newRandomIV() = 0;
 		
-		/* Use a key to encrypt data */
-		virtual void encrypt(shared_ptr<key> k,const str & in, str & out) = 0;
+		/* Use a key to encrypt data, optionally binding it to (unencrypted) additional data */
+		virtual void encrypt(shared_ptr<key> k,const str & in, str & out,const str & additionalData = "") = 0;
 		
-		/* Use a key to decrypt data */
-		virtual void decrypt(shared_ptr<key> k,const str & in, str & out) = 0;
+		/* Use a key to decrypt data, the additional data should match the data used to encrypt */
+		virtual void decrypt(shared_ptr<key> k,const str & in, str & out,const str & additionalData = "") = 0;
+
+		/* Decrypt straight into a caller owned buffer, returns the number of bytes written to out */
+		virtual size_t decryptTo(shared_ptr<key> k,const unsigned char * in,size_t inSize,unsigned char * out,size_t outSize,const str & additionalData = "") = 0;
 		
 		/* Regenerate content for a keyfile */
 		virtual str createKeyfileContent(void) = 0;
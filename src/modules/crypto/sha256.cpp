@@ -7,6 +7,7 @@
  * 
  */
 #include "sha256.h"
+#include "sha256batch.h"
 #include "main.h"
 #include <sodium.h>
 
@@ -14,7 +15,23 @@ namespace crypto {
 
 	sha256sum::sha256sum(const unsigned char * in,const size_t size) {
 		_ASSERT(crypto_hash_sha256_BYTES == sizeof(_characters));
-		crypto_hash_sha256(_bytes, in, size);
+		sha256batch::hash(&in,size,1,_bytes);
+	}
+
+	sha256sum::sha256sum(digest,const unsigned char * in) {
+		std::copy(in,in+sizeof(_bytes),_bytes);
+	}
+
+	std::vector<sha256sum> sha256sum::many(const unsigned char * const * in,const size_t size,const size_t count) {
+		std::vector<unsigned char> digests(count*sizeof(_bytes));
+		sha256batch::hash(in,size,count,digests.data());
+		std::vector<sha256sum> ret;
+		ret.reserve(count);
+		for(size_t a=0;a<count;a++) {
+			ret.push_back(sha256sum(digest(),&digests[a*sizeof(_bytes)]));
+		}
+		sodium_memzero(digests.data(),digests.size());
+		return ret;
 	}
 	
 	sha256sum::~sha256sum() {
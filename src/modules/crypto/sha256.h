@@ -4,6 +4,7 @@
 #ifndef CRYPTO_SHA256_H
 #define CRYPTO_SHA256_H
 #include "types.h"
+#include <vector>
 
 namespace crypto {
 
@@ -16,12 +17,15 @@ namespace crypto {
 			char _characters[32];
 			unsigned char _bytes[32];
 		};
+		struct digest {};
+		sha256sum(digest,const unsigned char * in); //Takes a digest that was already computed.
 		
 	public:
 		
 		//sha256sum(const sha256sum& in);
 		//sha256sum(const str & data);
 		sha256sum(const unsigned char * in,const size_t size);
+		static std::vector<sha256sum> many(const unsigned char * const * in,const size_t size,const size_t count); //count buffers of size bytes, in one pass of the batch kernel.
 		~sha256sum();
 		void copy(unsigned char * out);
 		str toLongStr() const;
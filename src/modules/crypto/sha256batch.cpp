@@ -0,0 +1,350 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+/**
+ * SHA-256 kernels for whole chunks.
+ *
+ * Every buffer is hashed as a complete message: the full 64 byte blocks straight from the buffer, then one or
+ * two blocks with the tail, the 0x80 terminator & the length in bits. The SIMD kernels are compiled with
+ * function level target attributes, so the rest of the build does not need -msha or -mavx2.
+ *
+ * A wrong digest would silently break dedup, so a kernel is only picked after it matched hashScalar (libsodium)
+ * on every tail length around the block boundaries & on every lane count of a group.
+ */
+#include "sha256batch.h"
+#include "main.h"
+#include <sodium.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256BATCH_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+using namespace crypto;
+
+namespace {
+	typedef void (*kernel_t)(const unsigned char * const *,size_t,size_t,unsigned char *);
+
+	alignas(64) const uint32_t K[64] = {
+		0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+		0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+		0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+		0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+		0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+		0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+		0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+		0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+	};
+	const uint32_t initialState[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+
+	/**
+	 * The last one or two blocks of a message of size bytes, built from its tail.
+	 */
+	struct finalBlocks {
+		std::array<unsigned char,128> data;
+		size_t blocks;
+		finalBlocks(const unsigned char * in,size_t size) {
+			const size_t tail = size % 64;
+			data.fill(0);
+			std::memcpy(data.data(),in+size-tail,tail);
+			data[tail] = 0x80;
+			blocks = tail < 56 ? 1 : 2;
+			const uint64_t bits = uint64_t(size)*8;
+			for(unsigned a=0;a<8;a++) {
+				data[blocks*64-1-a] = (unsigned char)(bits >> (8*a));
+			}
+		}
+	};
+
+	void storeDigest(const uint32_t state[8],unsigned char * out) {
+		for(unsigned a=0;a<8;a++) {
+			out[a*4+0] = (unsigned char)(state[a] >> 24);
+			out[a*4+1] = (unsigned char)(state[a] >> 16);
+			out[a*4+2] = (unsigned char)(state[a] >> 8);
+			out[a*4+3] = (unsigned char)(state[a]);
+		}
+	}
+
+#ifdef SHA256BATCH_X86
+	__attribute__((target("sha,sse4.1,ssse3")))
+	void compressShaNi(uint32_t state[8],const unsigned char * data,size_t blocks) {
+		const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+		//The sha256rnds2 instruction keeps the state as ABEF & CDGH.
+		__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])),0xB1);
+		__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])),0x1B);
+		__m128i state0 = _mm_alignr_epi8(tmp,state1,8);
+		state1 = _mm_blend_epi16(state1,tmp,0xF0);
+
+		for(;blocks>0;--blocks,data+=64) {
+			const __m128i save0 = state0,save1 = state1;
+			__m128i W[4];
+#pragma GCC unroll 16
+			for(unsigned g=0;g<16;g++) {
+				__m128i & w = W[g%4];
+				if(g<4) {
+					w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data+g*16)),byteSwap);
+				} else {
+					//W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16], four words at a time.
+					w = _mm_sha256msg1_epu32(w,W[(g+1)%4]);
+					w = _mm_add_epi32(w,_mm_alignr_epi8(W[(g+3)%4],W[(g+2)%4],4));
+					w = _mm_sha256msg2_epu32(w,W[(g+3)%4]);
+				}
+				__m128i msg = _mm_add_epi32(w,_mm_load_si128(reinterpret_cast<const __m128i *>(&K[g*4])));
+				state1 = _mm_sha256rnds2_epu32(state1,state0,msg);
+				msg = _mm_shuffle_epi32(msg,0x0E);
+				state0 = _mm_sha256rnds2_epu32(state0,state1,msg);
+			}
+			state0 = _mm_add_epi32(state0,save0);
+			state1 = _mm_add_epi32(state1,save1);
+		}
+
+		tmp = _mm_shuffle_epi32(state0,0x1B);
+		state1 = _mm_shuffle_epi32(state1,0xB1);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]),_mm_blend_epi16(tmp,state1,0xF0));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]),_mm_alignr_epi8(state1,tmp,8));
+	}
+
+	//8 messages side by side: lane i of every register belongs to message i.
+	__attribute__((target("avx2")))
+	inline __m256i rotr(__m256i x,int n) {
+		return _mm256_or_si256(_mm256_srli_epi32(x,n),_mm256_slli_epi32(x,32-n));
+	}
+
+	__attribute__((target("avx2")))
+	void transpose8(__m256i r[8]) {
+		const __m256i t0 = _mm256_unpacklo_epi32(r[0],r[1]),t1 = _mm256_unpackhi_epi32(r[0],r[1]);
+		const __m256i t2 = _mm256_unpacklo_epi32(r[2],r[3]),t3 = _mm256_unpackhi_epi32(r[2],r[3]);
+		const __m256i t4 = _mm256_unpacklo_epi32(r[4],r[5]),t5 = _mm256_unpackhi_epi32(r[4],r[5]);
+		const __m256i t6 = _mm256_unpacklo_epi32(r[6],r[7]),t7 = _mm256_unpackhi_epi32(r[6],r[7]);
+		const __m256i u0 = _mm256_unpacklo_epi64(t0,t2),u1 = _mm256_unpackhi_epi64(t0,t2);
+		const __m256i u2 = _mm256_unpacklo_epi64(t1,t3),u3 = _mm256_unpackhi_epi64(t1,t3);
+		const __m256i u4 = _mm256_unpacklo_epi64(t4,t6),u5 = _mm256_unpackhi_epi64(t4,t6);
+		const __m256i u6 = _mm256_unpacklo_epi64(t5,t7),u7 = _mm256_unpackhi_epi64(t5,t7);
+		r[0] = _mm256_permute2x128_si256(u0,u4,0x20);
+		r[1] = _mm256_permute2x128_si256(u1,u5,0x20);
+		r[2] = _mm256_permute2x128_si256(u2,u6,0x20);
+		r[3] = _mm256_permute2x128_si256(u3,u7,0x20);
+		r[4] = _mm256_permute2x128_si256(u0,u4,0x31);
+		r[5] = _mm256_permute2x128_si256(u1,u5,0x31);
+		r[6] = _mm256_permute2x128_si256(u2,u6,0x31);
+		r[7] = _mm256_permute2x128_si256(u3,u7,0x31);
+	}
+
+	__attribute__((target("avx2")))
+	void compressAvx2(__m256i S[8],const unsigned char * const data[8],size_t blocks) {
+		const __m256i byteSwap = _mm256_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3,12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+		for(size_t block=0;block<blocks;block++) {
+			__m256i W[16];
+			for(unsigned half=0;half<2;half++) {
+				__m256i * r = &W[half*8];
+				for(unsigned lane=0;lane<8;lane++) {
+					r[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data[lane]+block*64+half*32));
+				}
+				transpose8(r);
+				for(unsigned a=0;a<8;a++) {
+					r[a] = _mm256_shuffle_epi8(r[a],byteSwap);
+				}
+			}
+			__m256i a = S[0],b = S[1],c = S[2],d = S[3],e = S[4],f = S[5],g = S[6],h = S[7];
+#pragma GCC unroll 64
+			for(unsigned t=0;t<64;t++) {
+				__m256i & w = W[t%16];
+				if(t>=16) {
+					const __m256i w15 = W[(t+1)%16],w2 = W[(t+14)%16];
+					const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w15,7),rotr(w15,18)),_mm256_srli_epi32(w15,3));
+					const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w2,17),rotr(w2,19)),_mm256_srli_epi32(w2,10));
+					w = _mm256_add_epi32(_mm256_add_epi32(w,s0),_mm256_add_epi32(W[(t+9)%16],s1));
+				}
+				const __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(rotr(e,6),rotr(e,11)),rotr(e,25));
+				const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e,f),_mm256_andnot_si256(e,g));
+				const __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h,S1),_mm256_add_epi32(ch,w)),_mm256_set1_epi32((int)K[t]));
+				const __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(rotr(a,2),rotr(a,13)),rotr(a,22));
+				const __m256i maj = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(c,_mm256_or_si256(a,b)));
+				h = g; g = f; f = e;
+				e = _mm256_add_epi32(d,t1);
+				d = c; c = b; b = a;
+				a = _mm256_add_epi32(t1,_mm256_add_epi32(S0,maj));
+			}
+			S[0] = _mm256_add_epi32(S[0],a); S[1] = _mm256_add_epi32(S[1],b);
+			S[2] = _mm256_add_epi32(S[2],c); S[3] = _mm256_add_epi32(S[3],d);
+			S[4] = _mm256_add_epi32(S[4],e); S[5] = _mm256_add_epi32(S[5],f);
+			S[6] = _mm256_add_epi32(S[6],g); S[7] = _mm256_add_epi32(S[7],h);
+		}
+	}
+
+	__attribute__((target("avx2")))
+	void hash8Avx2(const unsigned char * const in[8],size_t size,unsigned char * out[8]) {
+		__m256i S[8];
+		for(unsigned a=0;a<8;a++) {
+			S[a] = _mm256_set1_epi32((int)initialState[a]);
+		}
+		compressAvx2(S,in,size/64);
+		std::array<finalBlocks,8> tails{{{in[0],size},{in[1],size},{in[2],size},{in[3],size},{in[4],size},{in[5],size},{in[6],size},{in[7],size}}};
+		const unsigned char * tailData[8];
+		for(unsigned lane=0;lane<8;lane++) {
+			tailData[lane] = tails[lane].data.data();
+		}
+		compressAvx2(S,tailData,tails[0].blocks);
+		alignas(32) uint32_t words[8][8];
+		for(unsigned a=0;a<8;a++) {
+			_mm256_store_si256(reinterpret_cast<__m256i *>(words[a]),S[a]);
+		}
+		for(unsigned lane=0;lane<8;lane++) {
+			if(out[lane]) {
+				const uint32_t state[8] = {words[0][lane],words[1][lane],words[2][lane],words[3][lane],words[4][lane],words[5][lane],words[6][lane],words[7][lane]};
+				storeDigest(state,out[lane]);
+			}
+		}
+	}
+
+	bool cpuHasShaNi(void) {
+		unsigned eax,ebx,ecx,edx;
+		if(!__get_cpuid(1,&eax,&ebx,&ecx,&edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3)) {
+			return false;
+		}
+		return __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx) && (ebx & (1u << 29));
+	}
+
+	bool cpuHasAvx2(void) {
+		unsigned eax,ebx,ecx,edx;
+		if(!__get_cpuid(1,&eax,&ebx,&ecx,&edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+			return false;
+		}
+		//The OS has to save the upper halves of the ymm registers.
+		unsigned xcr0,xcr0hi;
+		__asm__("xgetbv" : "=a"(xcr0),"=d"(xcr0hi) : "c"(0));
+		if((xcr0 & 6)!=6) {
+			return false;
+		}
+		return __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx) && (ebx & bit_AVX2);
+	}
+#endif
+
+	struct dispatch {
+		kernel_t kernel = sha256batch::hashScalar;
+		const char * name = "scalar";
+		dispatch() {
+			if(sha256batch::haveShaNi() && sha256batch::selfTest(sha256batch::hashShaNi)) {
+				kernel = sha256batch::hashShaNi;
+				name = "sha-ni";
+			} else if(sha256batch::haveAvx2() && sha256batch::selfTest(sha256batch::hashAvx2)) {
+				kernel = sha256batch::hashAvx2;
+				name = "avx2";
+			}
+		}
+	};
+
+	const dispatch & selected(void) {
+		static const dispatch d;
+		return d;
+	}
+}
+
+bool sha256batch::haveShaNi(void) {
+#ifdef SHA256BATCH_X86
+	static const bool ret = cpuHasShaNi();
+	return ret;
+#else
+	return false;
+#endif
+}
+
+bool sha256batch::haveAvx2(void) {
+#ifdef SHA256BATCH_X86
+	static const bool ret = cpuHasAvx2();
+	return ret;
+#else
+	return false;
+#endif
+}
+
+void sha256batch::hashScalar(const unsigned char * const * in,size_t size,size_t count,unsigned char * out) {
+	for(size_t a=0;a<count;a++) {
+		crypto_hash_sha256(out+a*32,in[a],size);
+	}
+}
+
+void sha256batch::hashShaNi(const unsigned char * const * in,size_t size,size_t count,unsigned char * out) {
+#ifdef SHA256BATCH_X86
+	for(size_t a=0;a<count;a++) {
+		uint32_t state[8];
+		std::copy(initialState,initialState+8,state);
+		compressShaNi(state,in[a],size/64);
+		const finalBlocks tail(in[a],size);
+		compressShaNi(state,tail.data.data(),tail.blocks);
+		storeDigest(state,out+a*32);
+	}
+#else
+	hashScalar(in,size,count,out);
+#endif
+}
+
+void sha256batch::hashAvx2(const unsigned char * const * in,size_t size,size_t count,unsigned char * out) {
+#ifdef SHA256BATCH_X86
+	for(size_t first=0;first<count;first+=8) {
+		//A last group of less than 8 repeats its first message in the unused lanes.
+		const unsigned char * lanes[8];
+		unsigned char * digests[8];
+		for(unsigned lane=0;lane<8;lane++) {
+			const bool used = first+lane < count;
+			lanes[lane] = in[used ? first+lane : first];
+			digests[lane] = used ? out+(first+lane)*32 : nullptr;
+		}
+		hash8Avx2(lanes,size,digests);
+	}
+#else
+	hashScalar(in,size,count,out);
+#endif
+}
+
+bool sha256batch::selfTest(void (*kernel)(const unsigned char * const *,size_t,size_t,unsigned char *)) {
+	constexpr size_t maxCount = 17; //2 full groups of 8 lanes & a partial one.
+	constexpr size_t maxSize = 4096;
+	std::vector<unsigned char> data(maxCount*maxSize);
+	uint32_t x = 0x9e3779b9;
+	for(auto & b: data) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		b = (unsigned char)x;
+	}
+	std::vector<const unsigned char *> in(maxCount);
+	for(size_t a=0;a<maxCount;a++) {
+		in[a] = data.data() + a*maxSize;
+	}
+	std::vector<unsigned char> expected(maxCount*32),actual(maxCount*32);
+	const auto check = [&](size_t size,size_t count) {
+		hashScalar(in.data(),size,count,expected.data());
+		kernel(in.data(),size,count,actual.data());
+		if(std::memcmp(expected.data(),actual.data(),count*32)!=0) {
+			CLOG("SHA-256 kernel failed its self-test on ",count," buffers of ",size," bytes, not using it");
+			return false;
+		}
+		return true;
+	};
+	//Every tail length of one & two final blocks, then whole chunks.
+	for(size_t size=0;size<=192;size++) {
+		if(!check(size,9)) {
+			return false;
+		}
+	}
+	for(size_t count=1;count<=maxCount;count++) {
+		if(!check(maxSize,count)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void sha256batch::hash(const unsigned char * const * in,size_t size,size_t count,unsigned char * out) {
+	selected().kernel(in,size,count,out);
+}
+
+const char * sha256batch::implementation(void) {
+	return selected().name;
+}
@@ -0,0 +1,30 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef CRYPTO_SHA256BATCH_H
+#define CRYPTO_SHA256BATCH_H
+#include "types.h"
+
+namespace crypto {
+
+	/**
+	 * SHA-256 of many buffers of the same size at once.
+	 *
+	 * The kernel is picked once, on the features of the CPU: SHA-NI (one buffer at a time, in hardware),
+	 * AVX2 (8 buffers side by side in the lanes of the vector registers) or libsodium.
+	 */
+	namespace sha256batch {
+		void hash(const unsigned char * const * in,size_t size,size_t count,unsigned char * out); //out receives count digests of 32 bytes.
+		const char * implementation(void); //"sha-ni", "avx2" or "scalar"
+
+		//The kernels themselves, only call the ones the CPU supports.
+		void hashScalar(const unsigned char * const * in,size_t size,size_t count,unsigned char * out);
+		void hashShaNi(const unsigned char * const * in,size_t size,size_t count,unsigned char * out);
+		void hashAvx2(const unsigned char * const * in,size_t size,size_t count,unsigned char * out);
+		bool haveShaNi(void);
+		bool haveAvx2(void);
+		bool selfTest(void (*kernel)(const unsigned char * const *,size_t,size_t,unsigned char *)); //The kernel matches hashScalar, checked before it is picked.
+	}
+}
+
+#endif // CRYPTO_SHA256BATCH_H
@@ -3,20 +3,49 @@
 // license that can be found in the LICENSE file.
 /**
  * The bucket class manages encrypted blocks of data and contains lists of chunks & hashes.
- * 
+ *
  * It will use protocol class to encrypt/decrypt data.
  * Bucket files are of a fixed size.
+ *
+ * Chunk & hash files are written as a header followed by a fixed size record per slot. Every record is
+ * sealed on its own (nonce + tag per slot) with the bucketIndex_t of the slot as additional data,
+ * so a single chunk can be read & decrypted without touching the rest of the file.
+ * The bucket tracks which slots changed since the last store, and only those records are re-sealed and
+ * written in place. Slots that did not change keep the same ciphertext.
+ * Legacy files (a single encrypted message) are still read, and converted on the next store.
+ *
+ * Crash model: records are overwritten in place without a rename, so a crash halfway a store can leave a torn
+ * record. A record that fails to open only affects its own slot: a hash record marks the slot bad (neither used
+ * nor free), a chunk record fails the reads of that chunk. A torn packed index leaves the other copy, which points
+ * at the records of the store before. Complete files (new, legacy conversion, packed compaction) are still
+ * replaced through a rename. A store does not sync, the journal checkpoint syncs the written files (bucketIO::sync)
+ * before it retires the entries that could replay them.
+ *
+ * With compression enabled new chunk files are PACKED: every slot is encoded (see compression.h) & sealed in a
+ * record of its own size, a sealed index after the header holds offset & length per slot. Changed slots are
+ * appended & the older of 2 index copies is rewritten in place, the file is compacted once more than half of it is stale.
+ *
+ * Data buckets (lazyChunks) only keep chunks in memory that still have to be written, clean chunks live in
+ * the global chunkCache. Meta buckets keep all their chunks in memory.
+ *
+ * When several slots are loaded at once, their records are decrypted straight into one page aligned chunk arena,
+ * the chunks point into it & a write makes a private copy as usual. Chunks loaded for the chunk cache get an
+ * allocation each instead, the cache charges an entry for one chunk & it should not keep a whole arena alive.
  */
 #include "bucket.h"
 #include "chunk.h"
 #include "main.h"
 #include <mutex>
-#include <filesystem>
+#include <algorithm>
 
 #include "modules/crypto/protocol.h"
 #include "modules/util/files.h"
 #include "modules/util/endian.h"
 #include "storage.h"
+#include "chunkcache.h"
+#include "compression.h"
+#include "journal.h"
+#include <limits>
 
 
 using namespace filesystem;
@@ -29,21 +58,263 @@ struct serializedHash{
 	crypto::sha256sum hash;
 };
 
+struct bucketFileHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+};
+static_assert(sizeof(bucketFileHeader)==16,"bucketFileHeader should be 16 bytes");
 
+const char bucketFileMagic[8] = {'c','c','f','s','b','c','k','t'};
 
 const auto byteSizeChunks = (chunksInBucket * chunkSize);
 const auto byteSizeHashes = (chunksInBucket * sizeof(serializedHash));
 
+static uint64_t recordOffset(int64_t id,size_t recordSize) {
+	return sizeof(bucketFileHeader) + id * recordSize;
+}
 
-bool bucketChangeLog::addChange(std::shared_ptr<journalEntryWrapper> in) {
-	auto idx = index.fetch_add(1);
-	if(idx<changeLog.size()) {
-		changeLog[idx] = in;
-		return true;
+bool slotBitmap::any(void) const {
+	for(const auto & w: words) {
+		if(w.load()!=0) {
+			return true;
+		}
 	}
 	return false;
 }
 
+slotBitmap::bits_t slotBitmap::exchange(void) {
+	bits_t ret;
+	for(unsigned w=0;w<words.size();w++) {
+		const uint64_t bits = words[w].exchange(0);
+		for(unsigned b=0;b<bitsPerWord && w*bitsPerWord+b<chunksInBucket;b++) {
+			if(bits & (uint64_t(1) << b)) {
+				ret.set(w*bitsPerWord+b);
+			}
+		}
+	}
+	return ret;
+}
+
+unsigned slotBitmap::setAll(void) {
+	unsigned ret = 0;
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		if(set(a)) {
+			++ret;
+		}
+	}
+	return ret;
+}
+
+void slotBitmap::add(const bits_t & in) {
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		if(in.test(a)) {
+			set(a);
+		}
+	}
+}
+
+size_t bucket::chunkRecordSize(void) const {
+	return chunkSize + _protocol->getTagSize() + _protocol->getIVSize();
+}
+
+size_t bucket::hashRecordSize(void) const {
+	return sizeof(serializedHash) + _protocol->getTagSize() + _protocol->getIVSize();
+}
+
+str bucket::fileHeader(bucketFormat format,size_t recordSize) const {
+	bucketFileHeader header;
+	std::copy(std::begin(bucketFileMagic),std::end(bucketFileMagic),std::begin(header.magic));
+	header.version = util::host_to_little_endian((uint32_t)format);
+	header.recordSize = util::host_to_little_endian((uint32_t)recordSize);
+	return str(reinterpret_cast<const char *>(&header),sizeof(header));
+}
+
+str bucket::slotAdditionalData(int64_t id) const {
+	const uint64_t idx = util::host_to_little_endian(bucketIndex_t(bucketId,id).fullindex());
+	return str(reinterpret_cast<const char *>(&idx),sizeof(idx));
+}
+
+bucketFormat bucket::fileFormat(const str & filename,size_t recordSize,std::atomic<bucketFormat> & cached,size_t packedIndexSize) {
+	auto F = cached.load();
+	if(F!=bucketFormat::UNKNOWN) {
+		return F;
+	}
+	lckunique lck(_mut);
+	uint64_t size = 0;
+	if(STOR->io.fileSize(filename,size)==false || size==0) {
+		F = bucketFormat::NONE;
+	} else {
+		F = bucketFormat::LEGACY;
+		auto hdr = STOR->io.read(filename,0,sizeof(bucketFileHeader));
+		if(hdr.size()==sizeof(bucketFileHeader)) {
+			auto * H = reinterpret_cast<const bucketFileHeader*>(hdr.data());
+			if(std::equal(std::begin(bucketFileMagic),std::end(bucketFileMagic),std::begin(H->magic))) {
+				const auto version = util::little_endian_to_host(H->version);
+				if(version==(uint32_t)bucketFormat::SLOTS) {
+					if(util::little_endian_to_host(H->recordSize)!=recordSize) {
+						throw std::out_of_range(str("record size mismatch in "+filename).c_str());
+					}
+					F = bucketFormat::SLOTS;
+				} else if(version==(uint32_t)bucketFormat::PACKED && packedIndexSize>0) {
+					//For packed files the header holds the size of the sealed index.
+					if(util::little_endian_to_host(H->recordSize)!=packedIndexSize) {
+						throw std::out_of_range(str("index size mismatch in "+filename).c_str());
+					}
+					F = bucketFormat::PACKED;
+				}
+			}
+		}
+	}
+	cached = F;
+	return F;
+}
+
+str bucket::sealRecord(int64_t id,const str & cleartext,const str & filename) {
+	str cipher;
+	try{
+		_protocol->encrypt(_key,cleartext,cipher,slotAdditionalData(id));
+	} catch(std::exception & e) {
+		throw std::logic_error(BUILDSTRING("Failed to encrypt slot ",id," (",e.what(),") ",filename).c_str());
+	}
+	return cipher;
+}
+
+void bucket::openRecord(int64_t id,const char * record,size_t recordSize,unsigned char * out,size_t outSize,const str & filename) {
+	size_t len = 0;
+	try{
+		len = _protocol->decryptTo(_key,reinterpret_cast<const unsigned char *>(record),recordSize,out,outSize,slotAdditionalData(id));
+	} catch(std::exception & e) {
+		util::putSystemString(STOR->getPath()+"decrypt_fail",str(record,recordSize));
+		throw std::logic_error(BUILDSTRING("Failed to decrypt slot ",id," (",e.what(),") ",filename).c_str());
+	}
+	if(len!=outSize) {
+		throw std::out_of_range(BUILDSTRING("failed to load slot ",id," from ",filename).c_str());
+	}
+}
+
+str bucket::chunkCleartext(shared_ptr<chunk> c) {
+	str cleartext;
+	cleartext.resize(chunkSize);
+	if(c) {
+		if(storeFilter) {
+			c = storeFilter(c);
+		}
+		c->read(0,chunkSize,reinterpret_cast<uint8_t*>(&cleartext[0]));
+	}
+	return cleartext;
+}
+
+str bucket::sealChunk(int64_t id,shared_ptr<chunk> c) {
+	auto ret = sealRecord(id,chunkCleartext(c),myfilenamechnk());
+	_ASSERT(ret.size()==chunkRecordSize());
+	return ret;
+}
+
+str bucket::sealPackedChunk(int64_t id,shared_ptr<chunk> c) {
+	const auto cleartext = chunkCleartext(c);
+	const auto encoded = encodeChunk(reinterpret_cast<const unsigned char *>(cleartext.data()),cleartext.size(),STOR->getCompression());
+	STOR->stats.packedIn += cleartext.size();
+	STOR->stats.packedOut += encoded.size();
+	return sealRecord(id,encoded,myfilenamechnk());
+}
+
+std::pair<uint64_t,size_t> bucket::chunkRecordLocation(int64_t id) {
+	if(chunkFileFormat()==bucketFormat::PACKED) {
+		loadPackedIndex();
+		const auto & slot = packedIndex.at(id);
+		return {slot.offset,slot.length};
+	}
+	return {recordOffset(id,chunkRecordSize()),chunkRecordSize()};
+}
+
+void bucket::openChunkRecord(int64_t id,const char * record,size_t size,chunk & out) {
+	if(chunkFileFormat()==bucketFormat::PACKED) {
+		//Open into a buffer of the largest possible encoding, then decode into the chunk.
+		if(size <= _protocol->getTagSize()+_protocol->getIVSize() || size > chunkRecordSize()+1) {
+			throw std::out_of_range(BUILDSTRING("failed to load chunk ",id," from ",myfilenamechnk()).c_str());
+		}
+		str encoded;
+		encoded.resize(size-_protocol->getTagSize()-_protocol->getIVSize());
+		openRecord(id,record,size,reinterpret_cast<unsigned char *>(&encoded[0]),encoded.size(),myfilenamechnk());
+		try{
+			decodeChunk(reinterpret_cast<const unsigned char *>(encoded.data()),encoded.size(),out.data.data(),out.data.size());
+		} catch(std::exception & e) {
+			throw std::out_of_range(BUILDSTRING("failed to decode chunk ",id," (",e.what(),") ",myfilenamechnk()).c_str());
+		}
+		return;
+	}
+	if(size!=chunkRecordSize()) {
+		throw std::out_of_range(BUILDSTRING("failed to load chunk ",id," from ",myfilenamechnk()).c_str());
+	}
+	openRecord(id,record,size,out.data.data(),out.data.size(),myfilenamechnk());
+}
+
+shared_ptr<chunk> bucket::openChunk(int64_t id,const str & record) {
+	auto ret = std::make_shared<chunk>(chunk::noInit());
+	openChunkRecord(id,record.data(),record.size(),*ret);
+	if(loadFilter) {
+		return loadFilter(ret);
+	}
+	return ret;
+}
+
+std::vector<shared_ptr<chunk>> bucket::openChunks(const std::vector<int64_t> & ids,const str & content,uint64_t contentOffset,bool arena) {
+	const str filenamechnk = myfilenamechnk();
+	//Decrypt every record straight into its place, in a single arena or in a chunk of its own.
+	std::vector<shared_ptr<chunk>> ret;
+	if(arena) {
+		ret = chunk::newArena(ids.size());
+	} else {
+		ret.reserve(ids.size());
+		for(size_t a=0;a<ids.size();a++) {
+			ret.push_back(std::make_shared<chunk>(chunk::noInit()));
+		}
+	}
+	for(size_t a=0;a<ids.size();a++) {
+		const auto location = chunkRecordLocation(ids[a]);
+		const uint64_t offset = location.first - contentOffset;
+		if(location.first < contentOffset || offset+location.second > content.size()) {
+			throw std::out_of_range(BUILDSTRING("failed to load chunk ",ids[a]," from ",filenamechnk).c_str());
+		}
+		try{
+			openChunkRecord(ids[a],content.data()+offset,location.second,*ret[a]);
+		} catch(std::exception & e) {
+			//Left out, so only reading this chunk fails (loadChunk tries the record on its own again).
+			STOR->srvERROR("Bad chunk record: ",e.what());
+			++STOR->stats.badRecords;
+			ret[a] = nullptr;
+		}
+	}
+	if(loadFilter) {
+		for(auto & c: ret) {
+			if(c) {
+				c = loadFilter(c);
+			}
+		}
+	}
+	return ret;
+}
+
+str bucket::sealHash(int64_t id,shared_ptr<hash> h) {
+	static const crypto::sha256sum emptyHsh(nullptr,0);
+	str cleartext;
+	cleartext.resize(sizeof(serializedHash));
+	auto * hptr = reinterpret_cast<serializedHash*>(&cleartext[0]);
+	if(h) {
+		hptr->bucket = h->getBucketIndex();
+		hptr->refcnt = h->getRefCnt();
+		hptr->hash = h->getHashPrimitive();
+	} else {
+		hptr->bucket = 0;
+		hptr->refcnt = 0;
+		hptr->hash = emptyHsh;
+	}
+	auto ret = sealRecord(id,cleartext,myfilenamehsh());
+	_ASSERT(ret.size()==hashRecordSize());
+	return ret;
+}
+
 shared_ptr<bucketArray<hash>> bucket::loadHashes(void) {
 	lckunique lck(_mut);
 	auto OH = hashes.load();
@@ -53,21 +324,47 @@ shared_ptr<bucketArray<hash>> bucket::loadHashes(void) {
 	auto H = std::make_shared<bucketArray<hash>>();
 	const str filenamehsh = myfilenamehsh();
 	//const str filenamechnk = myfilenamechnk();
-	
-	auto cipher = util::getSystemString(filenamehsh);
-	if(cipher.empty()==false) {
-		str cleartext;
-		try{
-			_protocol->decrypt(_key,cipher,cleartext);
-		} catch(std::exception & e) {
-			throw std::logic_error(BUILDSTRING("Failed to decrypt hashes (",e.what(),") ",filenamehsh).c_str());
-		}
+
+	str cleartext;
+	switch(hashFileFormat()) {
+		case bucketFormat::SLOTS:
+			{
+				//Hash files are small, read the whole file & open every record.
+				auto content = STOR->io.read(filenamehsh);
+				if(content.size()<recordOffset(chunksInBucket,hashRecordSize())) {
+					throw std::out_of_range(str("failed to load hashes from "+filenamehsh).c_str());
+				}
+				cleartext.resize(byteSizeHashes);
+				for(unsigned a=0;a<chunksInBucket;a++) {
+					try{
+						openRecord(a,content.data()+recordOffset(a,hashRecordSize()),hashRecordSize(),reinterpret_cast<unsigned char *>(&cleartext[a*sizeof(serializedHash)]),sizeof(serializedHash),filenamehsh);
+					} catch(std::exception & e) {
+						//A torn record: the slot reads as empty, but is not handed out again.
+						STOR->srvERROR("Bad hash record, slot ",a," marked bad: ",e.what());
+						std::fill_n(&cleartext[a*sizeof(serializedHash)],sizeof(serializedHash),0);
+						badHashes.set(a);
+						++STOR->stats.badRecords;
+					}
+				}
+			}
+			break;
+		case bucketFormat::LEGACY:
+			try{
+				_protocol->decrypt(_key,STOR->io.read(filenamehsh),cleartext);
+			} catch(std::exception & e) {
+				throw std::logic_error(BUILDSTRING("Failed to decrypt hashes (",e.what(),") ",filenamehsh).c_str());
+			}
+			break;
+		default:
+			break;
+	}
+	if(cleartext.empty()==false) {
 		if(cleartext.size()!=byteSizeHashes) {
 			throw std::out_of_range(str("failed to load hashes from "+filenamehsh).c_str());
 		}
 		//load the chunks from the cleartext:
 		auto * ptr = reinterpret_cast<const serializedHash*>(cleartext.data());
-		
+
 		unsigned N = 0;
 		for(auto& h: *H) {
 			//CLOG("ptr->refcnt:",ptr->refcnt);
@@ -78,11 +375,55 @@ shared_ptr<bucketArray<hash>> bucket::loadHashes(void) {
 			ptr++;
 		}
 	}
-	hashChangesSinceLoad = 0;
 	hashes = H;
 	return H;
 }
 
+void bucket::loadLegacyChunks(shared_ptr<bucketArray<chunk>> C) {
+	const str filenamechnk = myfilenamechnk();
+	auto cipher = STOR->io.read(filenamechnk);
+	//CLOG("bucket::loadChunks: ",filename);
+	//The chunks of an arena are contiguous, so the whole message is decrypted straight into them.
+	auto arena = chunk::newArena(chunksInBucket);
+	size_t len = 0;
+	try{
+		len = _protocol->decryptTo(_key,reinterpret_cast<const unsigned char *>(cipher.data()),cipher.size(),arena[0]->data.data(),byteSizeChunks);
+	} catch(std::exception & e) {
+		util::putSystemString(STOR->getPath()+"decrypt_fail",cipher);
+		throw std::logic_error(BUILDSTRING("Failed to decrypt chunks (",e.what(),") ",filenamechnk).c_str());
+	}
+	if(len!=byteSizeChunks) {
+		throw std::out_of_range(str("failed to load chunks from "+filenamechnk).c_str());
+	}
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		C->at(a) = loadFilter ? loadFilter(arena[a]) : arena[a];
+	}
+	//CLOG("bucket::load_end: ",filename);
+}
+
+void bucket::loadAllChunks(shared_ptr<bucketArray<chunk>> C) {
+	lckunique lck(_mut);
+	const auto format = chunkFileFormat();
+	if(format!=bucketFormat::SLOTS && format!=bucketFormat::PACKED) {
+		return;
+	}
+	//Read the file once & open all slots that are not in memory yet.
+	const str filenamechnk = myfilenamechnk();
+	auto content = STOR->io.read(filenamechnk);
+	if(format==bucketFormat::SLOTS && content.size()<recordOffset(chunksInBucket,chunkRecordSize())) {
+		throw std::out_of_range(str("failed to load chunks from "+filenamechnk).c_str());
+	}
+	std::vector<int64_t> missing;
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		if(C->at(a).load()==nullptr) {
+			missing.push_back(a);
+		}
+	}
+	auto opened = openChunks(missing,content,0,true);
+	for(size_t a=0;a<missing.size();a++) {
+		C->at(missing[a]) = opened[a];
+	}
+}
 
 shared_ptr<bucketArray<chunk>> bucket::loadChunks(void) {
 	lckunique lck(_mut);
@@ -90,53 +431,56 @@ shared_ptr<bucketArray<chunk>> bucket::loadChunks(void) {
 	if(OC) {
 		return OC;
 	}
-	chunk base;
-
-	//const str filenamehsh = myfilenamehsh();
-	const str filenamechnk = myfilenamechnk();
 	auto C = std::make_shared<bucketArray<chunk>>();
-	auto cipher = util::getSystemString(filenamechnk);
-	if(cipher.empty()==false) {
-		//CLOG("bucket::loadChunks: ",filename);
-		str cleartext;
-		try{
-			_protocol->decrypt(_key,cipher,cleartext);
-		} catch(std::exception & e) {
-			util::putSystemString(STOR->getPath()+"decrypt_fail",util::getSystemString(filenamechnk));
-			throw std::logic_error(BUILDSTRING("Failed to decrypt chunks (",e.what(),") ",filenamechnk).c_str());
-		}	
-		if(cleartext.size()!=byteSizeChunks) {
-			throw std::out_of_range(str("failed to load chunks from "+filenamechnk).c_str());
-		}
-		//load the chunks from the cleartext:
-		auto * ptr = reinterpret_cast<const uint8_t*>(cleartext.data());
-		
-		if(loadFilter) {
-			for(auto & cptr: *C) {
-				cptr = loadFilter(base.write(0,chunkSize,ptr));
-				ptr+=chunkSize;
-			} 
-		} else {
-			for(auto & cptr: *C) {
-				cptr = base.write(0,chunkSize,ptr);
-				ptr+=chunkSize;
-			} 
-		}
-		//CLOG("bucket::load_end: ",filename);
-	} else {
-		//CLOG("bucket::create: ",filename);
-		for(auto & cptr: *C) {
-			cptr = std::make_shared<chunk>();
-		}
+	switch(chunkFileFormat()) {
+		case bucketFormat::SLOTS:
+		case bucketFormat::PACKED:
+			//Slots are opened on demand by loadChunk, unless this bucket wants everything in memory.
+			if(lazyChunks==false) {
+				loadAllChunks(C);
+			}
+			break;
+		case bucketFormat::LEGACY:
+			loadLegacyChunks(C);
+			break;
+		default:
+			//CLOG("bucket::create: ",filename);
+			if(lazyChunks==false) {
+				for(auto & cptr: *C) {
+					cptr = std::make_shared<chunk>();
+				}
+			}
+			break;
 	}
 
-	chunkChangesSinceLoad = 0;
 	chunks = C;
 	return C;
 }
-bucket::bucket(const str & file,std::shared_ptr<crypto::key> ikey,crypto::protocolInterface * iprotocol) :filenamebase(file), _key(ikey), _protocol(iprotocol){
-	chunkChangesSinceLoad = 0;
-	hashChangesSinceLoad = 0;
+
+shared_ptr<chunk> bucket::loadChunk(int64_t id,shared_ptr<bucketArray<chunk>> C) {
+	lckunique lck(_mut);
+	shared_ptr<chunk> ret = C->at(id);
+	if(ret) {
+		return ret;
+	}
+	if(chunkFileFormat()==bucketFormat::NONE) {
+		//Nothing on disk yet.
+		return std::make_shared<chunk>();
+	}
+	//Only read the record for this slot:
+	const auto location = chunkRecordLocation(id);
+	ret = openChunk(id,STOR->io.read(myfilenamechnk(),location.first,location.second));
+	if(lazyChunks) {
+		STOR->cache.put(cacheKey(id),ret);
+	} else {
+		C->at(id) = ret;
+	}
+	return ret;
+}
+
+bucket::bucket(const str & file,uint64_t id,bool ilazyChunks,std::shared_ptr<crypto::key> ikey,crypto::protocolInterface * iprotocol) :filenamebase(file), bucketId(id), lazyChunks(ilazyChunks), _key(ikey), _protocol(iprotocol){
+	chunkFormat = bucketFormat::UNKNOWN;
+	hashFormat = bucketFormat::UNKNOWN;
 }
 
 bucket::~bucket() {
@@ -146,30 +490,53 @@ bucket::~bucket() {
 }
 
 void filesystem::bucket::del(void) {
-	hashChangesSinceLoad = 0;
-	chunkChangesSinceLoad = 0;
+	const auto dirty = dirtyChunks.exchange();
+	dirtyHashes.exchange();
 	lckunique lck(_mut);
+	if(lazyChunks) {
+		STOR->cache.addDirty(-(int64_t)dirty.count());
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			STOR->cache.erase(cacheKey(a));
+		}
+	}
 	chunks = std::shared_ptr<bucketArray<chunk>>();
 	hashes = std::shared_ptr<bucketArray<hash>>();
 	const str filenamehsh = myfilenamehsh();
 	const str filenamechnk = myfilenamechnk();
-	std::filesystem::remove(filenamehsh.c_str());
-	std::filesystem::remove(filenamechnk.c_str());
+	STOR->io.remove(filenamehsh);
+	STOR->io.remove(filenamechnk);
+	chunkFormat = bucketFormat::UNKNOWN;
+	hashFormat = bucketFormat::UNKNOWN;
+	packedIndexLoaded = false;
 	//CLOG("bucket::del: ", filename);
 }
 
 void filesystem::bucket::migrateTo(bucket * targetBucket) {
 	lckunique lck(_mut);
-	hashChangesSinceLoad = 0;
-	chunkChangesSinceLoad = 0;
-	if(chunks.load()==nullptr) {loadChunks();}
+	const auto dirty = dirtyChunks.exchange();
+	dirtyHashes.exchange();
+	if(lazyChunks) {
+		STOR->cache.addDirty(-(int64_t)dirty.count());
+	}
+	auto C = loadChunks();
+	loadAllChunks(C);
+	if(chunkFileFormat()==bucketFormat::NONE) {
+		for(auto & cptr: *C) {
+			if(cptr.load()==nullptr) {
+				cptr = std::make_shared<chunk>();
+			}
+		}
+	}
 	if(hashes.load()==nullptr) {loadHashes();}
 	targetBucket->chunks = chunks.load();
 	targetBucket->hashes = hashes.load();
 	chunks = std::shared_ptr<bucketArray<chunk>>();
 	hashes = std::shared_ptr<bucketArray<hash>>();
-	targetBucket->hashChangesSinceLoad = 1000;
-	targetBucket->chunkChangesSinceLoad = 1000;
+	const auto newDirty = targetBucket->dirtyChunks.setAll();
+	targetBucket->dirtyHashes.setAll();
+	if(targetBucket->lazyChunks) {
+		STOR->cache.addDirty(newDirty);
+	}
 }
 
 /*void filesystem::bucket::clearCache() {
@@ -180,7 +547,48 @@ std::shared_ptr<chunk> bucket::getChunk(int64_t id) {
 	auto C = chunks.load();
 	if(!C) { C= loadChunks();}
 	_ASSERT(C!=nullptr);
-	return C->at(id);
+	std::shared_ptr<chunk> ret = C->at(id);
+	if(!ret && lazyChunks) { ret = STOR->cache.get(cacheKey(id)); }
+	if(!ret) { ret = loadChunk(id,C); }
+	return ret;
+}
+
+void bucket::prefetchChunks(const std::vector<int64_t> & ids) {
+	if(lazyChunks==false || ids.empty()) {
+		return;
+	}
+	//Keep the lock while loading, so a store can not put newer chunks in the cache in the mean time.
+	lckunique lck(_mut);
+	auto C = chunks.load();
+	if(!C) { C = loadChunks(); }
+	const auto format = chunkFileFormat();
+	if(format!=bucketFormat::SLOTS && format!=bucketFormat::PACKED) {
+		return;
+	}
+	std::vector<int64_t> missing;
+	for(auto id: ids) {
+		if(C->at(id).load()==nullptr && STOR->cache.contains(cacheKey(id))==false) {
+			missing.push_back(id);
+		}
+	}
+	if(missing.empty()) {
+		return;
+	}
+	//Read the records from the first to the last missing slot in one go.
+	uint64_t first = std::numeric_limits<uint64_t>::max(),last = 0;
+	for(auto id: missing) {
+		const auto location = chunkRecordLocation(id);
+		first = std::min<uint64_t>(first,location.first);
+		last = std::max<uint64_t>(last,location.first+location.second);
+	}
+	auto content = STOR->io.read(myfilenamechnk(),first,last-first);
+	auto opened = openChunks(missing,content,first,false);
+	for(size_t a=0;a<missing.size();a++) {
+		if(opened[a]) {
+			STOR->cache.put(cacheKey(missing[a]),opened[a]);
+		}
+	}
+	STOR->stats.chunksPrefetched += missing.size();
 }
 
 std::shared_ptr<hash> bucket::getHash(int64_t id) {
@@ -190,22 +598,78 @@ std::shared_ptr<hash> bucket::getHash(int64_t id) {
 	return H->at(id);
 }
 
+bool bucket::unloadHashes(void) {
+	lckunique lck(_mut);
+	if(dirtyHashes.any()) {
+		return false;
+	}
+	auto H = hashes.exchange(shared_ptr<bucketArray<hash>>());
+	if(!H) {
+		return true;
+	}
+	//A hash that is held elsewhere would get a second object for its slot after a reload: keep them.
+	bool inUse = H.use_count() > 1;
+	for(unsigned a=0;a<chunksInBucket && !inUse;a++) {
+		auto h = H->at(a).load();
+		inUse = h && h.use_count() > 2;
+	}
+	if(inUse) {
+		hashes = H;
+		return false;
+	}
+	return true;
+}
+
+void bucket::loadedHashes(std::vector<std::shared_ptr<hash>> & out) {
+	auto H = hashes.load();
+	if(!H) {
+		return;
+	}
+	for(auto & h: *H) {
+		if(auto hsh = h.load()) {
+			out.push_back(hsh);
+		}
+	}
+}
+
 void bucket::putHashAndChunk(int64_t id,std::shared_ptr<hash> h,std::shared_ptr<chunk> c) {
 	auto H = hashes.load();
-	if(!H) {H = loadHashes();}	
+	if(!H) {H = loadHashes();}
 	auto C = chunks.load();
 	if(!C) { C = loadChunks(); }
 	_ASSERT(H!=nullptr && C!=nullptr);
-	++chunkChangesSinceLoad;
-	++hashChangesSinceLoad;
 	H->at(id) = h;
 	C->at(id) = c;
+	if(dirtyChunks.set(id) && lazyChunks) {
+		STOR->cache.addDirty(1);
+	}
+	dirtyHashes.set(id);
 }
 
 void bucket::clearHashAndChunk(int64_t id) {
 	putHashAndChunk(id,nullptr,std::make_shared<chunk>());
 }
 
+void bucket::clearHashesAndChunks(const std::vector<int64_t> & ids) {
+	auto H = hashes.load();
+	if(!H) {H = loadHashes();}
+	auto C = chunks.load();
+	if(!C) { C = loadChunks(); }
+	_ASSERT(H!=nullptr && C!=nullptr);
+	int64_t newDirty = 0;
+	for(auto id: ids) {
+		H->at(id) = nullptr;
+		C->at(id) = std::make_shared<chunk>();
+		if(dirtyChunks.set(id)) {
+			++newDirty;
+		}
+		dirtyHashes.set(id);
+	}
+	if(lazyChunks && newDirty>0) {
+		STOR->cache.addDirty(newDirty);
+	}
+}
+
 
 void bucket::putHashedChunk(bucketIndex_t idx,const script::int_t irefcnt,std::shared_ptr<chunk> c) {
 	auto hsh = c->getHash();
@@ -213,21 +677,336 @@ void bucket::putHashedChunk(bucketIndex_t idx,const script::int_t irefcnt,std::s
 	putHashAndChunk(idx.index(),rootHash,c);
 }
 
+void bucket::chunksStored(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,const sealedChunks_t & sealed) {
+	if(lazyChunks==false) {
+		return;
+	}
+	STOR->cache.addDirty(-(int64_t)dirty.count());
+	if(C==nullptr) {
+		return;
+	}
+	//Written chunks move to the chunk cache. Only the objects that were sealed: putHashAndChunk does not take the
+	//lock, a newer chunk in the slot is not on disk yet & stays there for the next store.
+	for(const auto & s: sealed) {
+		shared_ptr<chunk> c = s.second;
+		if(C->at(s.first).compare_exchange_strong(c,nullptr) && dirty.test(s.first)) {
+			STOR->cache.put(cacheKey(s.first),s.second);
+		}
+	}
+}
+
+size_t bucket::packedIndexRecordSize(void) const {
+	return sizeof(uint64_t) + chunksInBucket * sizeof(packedSlot) + _protocol->getTagSize() + _protocol->getIVSize();
+}
+
+uint64_t bucket::packedIndexOffset(uint64_t sequence) const {
+	return sizeof(bucketFileHeader) + (sequence % 2) * packedIndexRecordSize();
+}
+
+uint64_t bucket::packedDataOffset(void) const {
+	return sizeof(bucketFileHeader) + 2 * packedIndexRecordSize();
+}
+
+str bucket::packedIndexAdditionalData(void) const {
+	//Longer than the additional data of a slot, so the index can never be swapped with a record.
+	return slotAdditionalData(0) + "packedindex";
+}
+
+void bucket::loadPackedIndex(void) {
+	lckunique lck(_mut);
+	if(packedIndexLoaded) {
+		return;
+	}
+	const str filenamechnk = myfilenamechnk();
+	uint64_t size = 0;
+	if(STOR->io.fileSize(filenamechnk,size)==false) {
+		throw std::out_of_range(str("failed to load index from "+filenamechnk).c_str());
+	}
+	//Both copies are read, the valid one with the highest sequence number is current.
+	const auto records = STOR->io.read(filenamechnk,sizeof(bucketFileHeader),2 * packedIndexRecordSize());
+	bool found = false;
+	str lastError = "short file";
+	for(unsigned copy=0;copy<2;copy++) {
+		if(records.size() < (copy+1) * packedIndexRecordSize()) {
+			break;
+		}
+		str cleartext;
+		cleartext.resize(sizeof(uint64_t) + sizeof(packedIndex_t));
+		try{
+			const auto len = _protocol->decryptTo(_key,reinterpret_cast<const unsigned char *>(records.data() + copy * packedIndexRecordSize()),packedIndexRecordSize(),reinterpret_cast<unsigned char *>(&cleartext[0]),cleartext.size(),packedIndexAdditionalData());
+			if(len!=cleartext.size()) {
+				throw std::out_of_range("wrong size");
+			}
+		} catch(std::exception & e) {
+			lastError = e.what();
+			continue;
+		}
+		uint64_t sequence;
+		std::copy_n(cleartext.data(),sizeof(sequence),reinterpret_cast<char *>(&sequence));
+		sequence = util::little_endian_to_host(sequence);
+		if(sequence % 2 != copy || (found && sequence < packedSequence)) {
+			continue;
+		}
+		packedIndex_t index;
+		std::copy_n(cleartext.data() + sizeof(sequence),sizeof(index),reinterpret_cast<char *>(index.data()));
+		for(auto & slot: index) {
+			slot.offset = util::little_endian_to_host(slot.offset);
+			slot.length = util::little_endian_to_host(slot.length);
+			if(slot.offset < packedDataOffset() || slot.offset + (uint64_t)slot.length > size) {
+				throw std::out_of_range(str("index out of range in "+filenamechnk).c_str());
+			}
+		}
+		packedIndex = index;
+		packedSequence = sequence;
+		found = true;
+	}
+	if(!found) {
+		throw std::logic_error(BUILDSTRING("Failed to decrypt index (",lastError,") ",filenamechnk).c_str());
+	}
+	packedEnd = size;
+	packedIndexLoaded = true;
+}
+
+str bucket::sealPackedIndex(const packedIndex_t & index,uint64_t sequence) {
+	str cleartext;
+	cleartext.resize(sizeof(uint64_t) + sizeof(packedIndex_t));
+	sequence = util::host_to_little_endian(sequence);
+	std::copy_n(reinterpret_cast<const char *>(&sequence),sizeof(sequence),&cleartext[0]);
+	auto * ptr = reinterpret_cast<packedSlot*>(&cleartext[sizeof(sequence)]);
+	for(const auto & slot: index) {
+		ptr->offset = util::host_to_little_endian(slot.offset);
+		ptr->length = util::host_to_little_endian(slot.length);
+		++ptr;
+	}
+	str ret;
+	try{
+		_protocol->encrypt(_key,cleartext,ret,packedIndexAdditionalData());
+	} catch(std::exception & e) {
+		throw std::logic_error(BUILDSTRING("Failed to encrypt index (",e.what(),") ",myfilenamechnk()).c_str());
+	}
+	_ASSERT(ret.size()==packedIndexRecordSize());
+	return ret;
+}
+
+bool bucket::writePackedFile(const std::vector<str> & records) {
+	_ASSERT(records.size()==chunksInBucket);
+	packedIndex_t index;
+	uint64_t offset = packedDataOffset();
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		index[a] = packedSlot{(uint32_t)offset,(uint32_t)records[a].size()};
+		offset += records[a].size();
+	}
+	str content = fileHeader(bucketFormat::PACKED,packedIndexRecordSize());
+	content.reserve(offset);
+	content.append(sealPackedIndex(index,0));
+	content.append(packedIndexRecordSize(),'\0'); //The second copy is written by the next store.
+	for(const auto & r: records) {
+		content.append(r);
+	}
+	_ASSERT(content.size()==offset);
+	if(STOR->io.replace(myfilenamechnk(),content)==false) {
+		return false;
+	}
+	STOR->stats.bytesWritten += content.size();
+	packedIndex = index;
+	packedEnd = offset;
+	packedSequence = 0;
+	packedIndexLoaded = true;
+	chunkFormat = bucketFormat::PACKED;
+	return true;
+}
+
+bool bucket::storePackedChunks(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,sealedChunks_t & sealed) {
+	if(C==nullptr || dirty.none()) {
+		return true;
+	}
+	loadPackedIndex();
+	const str filenamechnk = myfilenamechnk();
+	//New records are appended, then the older index copy is rewritten in place to point at them.
+	auto index = packedIndex;
+	std::vector<std::pair<unsigned,str>> changed;
+	uint64_t end = packedEnd;
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		if(dirty.test(a)) {
+			shared_ptr<chunk> cptr = C->at(a);
+			if(cptr) {
+				auto record = sealPackedChunk(a,cptr);
+				index[a] = packedSlot{(uint32_t)end,(uint32_t)record.size()};
+				end += record.size();
+				changed.emplace_back(a,std::move(record));
+				sealed.emplace_back(a,cptr);
+			}
+		}
+	}
+	if(changed.empty()) {
+		return true;
+	}
+	STOR->stats.slotsWritten += changed.size();
+	uint64_t live = 0;
+	for(const auto & slot: index) {
+		live += slot.length;
+	}
+	if(end > std::numeric_limits<uint32_t>::max() || end - packedDataOffset() > 2 * live + chunksInBucket * 64) {
+		//More than half of the file is replaced records: rewrite it. Records that did not change are copied as they are.
+		STOR->srvDEBUG("Compacting chunks in: ",filenamechnk);
+		const auto content = STOR->io.read(filenamechnk);
+		std::vector<str> records(chunksInBucket);
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			const auto & slot = packedIndex[a];
+			if(slot.offset + (uint64_t)slot.length > content.size()) {
+				throw std::out_of_range(str("failed to compact "+filenamechnk).c_str());
+			}
+			records[a] = content.substr(slot.offset,slot.length);
+		}
+		for(auto & c: changed) {
+			records[c.first] = std::move(c.second);
+		}
+		return writePackedFile(records);
+	}
+	str appended;
+	for(const auto & c: changed) {
+		appended.append(c.second);
+	}
+	std::vector<std::pair<uint64_t,str>> parts;
+	parts.emplace_back(packedEnd,std::move(appended));
+	parts.emplace_back(packedIndexOffset(packedSequence+1),sealPackedIndex(index,packedSequence+1));
+	STOR->srvDEBUG("Storing ",changed.size()," packed chunks in: ",filenamechnk);
+	if(STOR->io.patch(filenamechnk,parts)==false) {
+		return false;
+	}
+	STOR->stats.bytesWritten += parts[0].second.size() + parts[1].second.size();
+	packedIndex = index;
+	packedEnd = end;
+	++packedSequence;
+	return true;
+}
+
+bool bucket::storeChunks(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,sealedChunks_t & sealed) {
+	const str filenamechnk = myfilenamechnk();
+	const auto recordSize = chunkRecordSize();
+	const auto format = chunkFileFormat();
+	if(format==bucketFormat::SLOTS) {
+		//Re-seal & overwrite only the records of the slots that changed.
+		if(C==nullptr || dirty.none()) {
+			return true;
+		}
+		std::vector<std::pair<uint64_t,str>> parts;
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			if(dirty.test(a)) {
+				shared_ptr<chunk> cptr = C->at(a);
+				if(cptr) {
+					parts.emplace_back(recordOffset(a,recordSize),sealChunk(a,cptr));
+					sealed.emplace_back(a,cptr);
+					STOR->stats.bytesWritten += recordSize;
+					++STOR->stats.slotsWritten;
+				}
+			}
+		}
+		STOR->srvDEBUG("Storing ",parts.size()," chunks in: ",filenamechnk);
+		return parts.empty() || STOR->io.patch(filenamechnk,parts);
+	}
+	if(format==bucketFormat::PACKED) {
+		return storePackedChunks(C,dirty,sealed);
+	}
+	if(C==nullptr && format!=bucketFormat::NONE) {
+		return true;
+	}
+	if(C==nullptr) {
+		STOR->srvWARNING("Writing hashes without chunks to: ",myfilenamehsh());
+	}
+	if(STOR->getCompression()!=chunkCodec::NONE) {
+		std::vector<str> records;
+		records.reserve(chunksInBucket);
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			shared_ptr<chunk> cptr = C ? C->at(a).load() : nullptr;
+			records.push_back(sealPackedChunk(a,cptr));
+			if(cptr) {
+				sealed.emplace_back(a,cptr);
+			}
+		}
+		STOR->srvDEBUG("Storing packed chunks in: ",filenamechnk);
+		if(writePackedFile(records)==false) {
+			return false;
+		}
+		STOR->stats.slotsWritten += chunksInBucket;
+		return true;
+	}
+	//Write the complete file in the slots layout:
+	str cipher = fileHeader(bucketFormat::SLOTS,recordSize);
+	cipher.reserve(recordOffset(chunksInBucket,recordSize));
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		shared_ptr<chunk> cptr = C ? C->at(a).load() : nullptr;
+		cipher.append(sealChunk(a,cptr));
+		if(cptr) {
+			sealed.emplace_back(a,cptr);
+		}
+	}
+	_ASSERT(cipher.size()==recordOffset(chunksInBucket,recordSize));
+	STOR->srvDEBUG("Storing chunks in: ",filenamechnk);
+	if(STOR->io.replace(filenamechnk,cipher)==false) {
+		return false;
+	}
+	STOR->stats.bytesWritten += cipher.size();
+	STOR->stats.slotsWritten += chunksInBucket;
+	chunkFormat = bucketFormat::SLOTS;
+	return true;
+}
 
+bool bucket::storeHashes(shared_ptr<bucketArray<hash>> H,const slotBitmap::bits_t & dirty) {
+	const str filenamehsh = myfilenamehsh();
+	const auto recordSize = hashRecordSize();
+	if(hashFileFormat()==bucketFormat::SLOTS) {
+		if(dirty.none()) {
+			return true;
+		}
+		std::vector<std::pair<uint64_t,str>> parts;
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			if(dirty.test(a)) {
+				parts.emplace_back(recordOffset(a,recordSize),sealHash(a,H->at(a)));
+				STOR->stats.bytesWritten += recordSize;
+			}
+		}
+		STOR->srvDEBUG("Storing ",parts.size()," hashes in: ",filenamehsh);
+		if(STOR->io.patch(filenamehsh,parts)==false) {
+			return false;
+		}
+		for(unsigned a=0;a<chunksInBucket;a++) {
+			if(dirty.test(a)) {
+				badHashes.reset(a);
+			}
+		}
+		return true;
+	}
+	str cipher = fileHeader(bucketFormat::SLOTS,recordSize);
+	cipher.reserve(recordOffset(chunksInBucket,recordSize));
+	for(unsigned a=0;a<chunksInBucket;a++) {
+		cipher.append(sealHash(a,H->at(a)));
+	}
+	_ASSERT(cipher.size()==recordOffset(chunksInBucket,recordSize));
+	STOR->srvDEBUG("Storing hashes in: ",filenamehsh);
+	if(STOR->io.replace(filenamehsh,cipher)==false) {
+		return false;
+	}
+	STOR->stats.bytesWritten += cipher.size();
+	hashFormat = bucketFormat::SLOTS;
+	return true;
+}
 
 void bucket::store(bool clearCache) {
-	if(hashChangesSinceLoad>0 || chunkChangesSinceLoad>0) {
+	if(dirtyChunks.any() || dirtyHashes.any() || oldestJournalEntry()!=noJournalEntry) {
 		lckunique lck(_mut);
-		if(hashChangesSinceLoad==0 && chunkChangesSinceLoad == 0) {
-			return;
+
+		//The journal entries stay pending until the store is done, they are covered by it from here on.
+		{
+			std::unique_lock<std::mutex> l(_journalMut);
+			journalStoring = std::min(journalStoring,journalPending);
+			journalPending = noJournalEntry;
 		}
-		
-		const str filenamehsh = myfilenamehsh();
-		const str filenamechnk = myfilenamechnk();
-		
-		std::shared_ptr<bucketChangeLog> CL;
-		CL = changes.exchange(std::shared_ptr<bucketChangeLog>());
-		
+		const auto stored = [this]() {
+			std::unique_lock<std::mutex> l(_journalMut);
+			journalStoring = noJournalEntry;
+		};
+
 		shared_ptr<bucketArray<chunk>> C;
 		if(clearCache) {
 			C = chunks.exchange(shared_ptr<bucketArray<chunk>>());
@@ -235,105 +1014,63 @@ void bucket::store(bool clearCache) {
 			C = chunks.load();
 		}
 		auto H = hashes.load();
-		hashChangesSinceLoad = 0;
-		chunkChangesSinceLoad = 0;
-		const bool haveChunks = C!=nullptr;
-		const auto byteSizeEncryptionOverhead = _protocol->getIVSize()+_protocol->getTagSize();
-		crypto::sha256sum emptyHsh(nullptr,0);
-		str cleartext,cleartextH,cipher,cipherH;
-		
-		cleartext.resize(byteSizeChunks);
-		_ASSERT(cleartext.size()==byteSizeChunks);
-		
-		cleartextH.resize(byteSizeHashes);
-		_ASSERT(cleartextH.size()==byteSizeHashes);
-		
+		const auto dirtyC = dirtyChunks.exchange();
+		const auto dirtyH = dirtyHashes.exchange();
+		if(dirtyC.none() && dirtyH.none()) {
+			stored();
+			return;
+		}
+
 		_ASSERT(H!=nullptr);
-		
-		//
-		if(haveChunks || util::fileExists(filenamechnk)==false) {
-			if(haveChunks) {
-				auto * ptr = reinterpret_cast<uint8_t*>(&cleartext[0]);
-				for(auto & L: *C) {
-					shared_ptr<chunk> cptr = L;
-					if (cptr) {
-						if (storeFilter) {
-							auto i = storeFilter(cptr);
-							i->read(0, chunkSize, reinterpret_cast<uint8_t*>(ptr));
-						}
-						else {
-							cptr->read(0, chunkSize, reinterpret_cast<uint8_t*>(ptr));
-						}
-					}
-					ptr+=chunkSize;
-				} 
-			} else {
-				STOR->srvWARNING("Writing hashes without chunks to: ",filenamehsh);					
-			}
 
-			try{
-				_protocol->encrypt(_key,cleartext,cipher);
-			} catch(std::exception & e) {
-				throw std::logic_error(BUILDSTRING("Failed to encrypt chunks (",e.what(),") ",filenamechnk).c_str());
-			}	
-			_ASSERT(cipher.empty()==false);
-			_ASSERT(cipher.size()==byteSizeChunks+byteSizeEncryptionOverhead);
-		}
-		
-		//CLOG("bucket::store_hashes: ",filename);
-		auto * hptr = reinterpret_cast<serializedHash*>(&cleartextH[0]);
+		sealedChunks_t sealed;
 		unsigned num = 0;
 		for(auto & L: *H) {
-			shared_ptr<hash> h = L;
-			if(h) {
+			if(L.load()) {
 				++num;
-				hptr->bucket = h->getBucketIndex();
-				hptr->refcnt = h->getRefCnt();
-				hptr->hash = h->getHashPrimitive();
-			} else {
-				hptr->bucket = 0;
-				hptr->refcnt = 0;
-				hptr->hash = emptyHsh;
 			}
-			hptr++;
 		}
 		if(num > 0) {
 			try{
-				_protocol->encrypt(_key,cleartextH,cipherH);
+				_ASSERT(storeChunks(C,dirtyC,sealed)==true);
+				_ASSERT(storeHashes(H,dirtyH)==true);
 			} catch(std::exception & e) {
-				throw std::logic_error(BUILDSTRING("Failed to encrypt hashes (",e.what(),") ",filenamehsh).c_str());
-			}	
-			
-			_ASSERT(cipherH.empty()==false);
-			_ASSERT(cipherH.size()==byteSizeHashes+byteSizeEncryptionOverhead);
-			
-			if(cipher.empty()==false) {
-				STOR->srvDEBUG("Storing chunks in: ",filenamechnk);
-				_ASSERT(util::putSystemString(filenamechnk,cipher)==true);
+				dirtyChunks.add(dirtyC);
+				dirtyHashes.add(dirtyH);
+				{
+					std::unique_lock<std::mutex> l(_journalMut);
+					journalPending = std::min(journalPending,journalStoring);
+					journalStoring = noJournalEntry;
+				}
+				throw;
 			}
-			STOR->srvDEBUG("Storing hashes in: ",filenamehsh);
-			_ASSERT(util::putSystemString(filenamehsh,cipherH)==true);
+			//What a full rewrite of both files would have cost:
+			STOR->stats.bytesFullRewrite += recordOffset(chunksInBucket,chunkRecordSize()) + recordOffset(chunksInBucket,hashRecordSize());
 		} else {
-			STOR->srvWARNING("No hashes to store, not writing ",filenamehsh," have chunks?",cipher.empty()==false);
+			STOR->srvWARNING("No hashes to store, not writing ",myfilenamehsh()," have chunks?",C!=nullptr);
 		}
+		chunksStored(C,dirtyC,sealed);
+		stored();
+	}
+}
 
+std::vector<str> bucket::storeOrdered(void) {
+	{
+		//store() returns at once when another store took the dirty slots, this waits until that one wrote them.
+		lckunique lck(_mut);
+		store();
 	}
+	return {myfilenamechnk(),myfilenamehsh()};
 }
 
 void bucket::addChange(std::shared_ptr<journalEntryWrapper> in) {
-	while(in!=nullptr) {
-		std::shared_ptr<bucketChangeLog> H = nullptr;
-		changes.compare_exchange_strong(H,std::make_shared<bucketChangeLog>());
-		H = changes.load();
-		_ASSERT(H!=nullptr);
-		if(H->addChange(in)) {
-			break;
-		} else {
-			STOR->srvWARNING("Too many changes for bucket: ",filenamebase);
-			hashChangesSinceLoad++;
-			chunkChangesSinceLoad++;
-			store();//Storing here is the wrong way to handle this! Should make this list grow. if changes keep getting added to a log without actual changes, then we have an issue.
-		}
+	if(in!=nullptr) {
+		std::unique_lock<std::mutex> l(_journalMut);
+		journalPending = std::min<uint64_t>(journalPending,in->entry()->id);
 	}
 }
 
+uint64_t bucket::oldestJournalEntry(void) {
+	std::unique_lock<std::mutex> l(_journalMut);
+	return std::min(journalPending,journalStoring);
+}
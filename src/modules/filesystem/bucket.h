@@ -7,6 +7,8 @@
 #include <vector>
 #include <mutex>
 #include <functional>
+#include <bitset>
+#include <array>
 #include "types.h"
 #include "modules/crypto/key.h"
 #include "modules/util/atomic_shared_ptr.h"
@@ -22,16 +24,45 @@ namespace filesystem {
 	typedef std::function<shared_ptr<chunk>(shared_ptr<chunk>)> storeFilter_t;
 	template<typename T> using bucketArray = std::array<util::atomic_shared_ptr<T>,chunksInBucket>;
 
-	class bucketChangeLog{
+	/**
+	 * On-disk layout of the chunk & hash files of a bucket.
+	 * LEGACY: all slots are encrypted as a single message.
+	 * SLOTS: every slot is sealed in its own fixed size record, bound to its bucketIndex_t.
+	 * PACKED: slots are encoded (compressed) & sealed in variable size records, found through a sealed index.
+	 */
+	enum class bucketFormat: uint32_t {
+		UNKNOWN = 0,
+		LEGACY = 1,
+		SLOTS = 2,
+		PACKED = 3,
+		NONE = 0xFFFFFFFF, //No file on disk (yet)
+	};
+
+	/**
+	 * Lock free set of slots, used to track which slots of a bucket need to be written.
+	 */
+	class slotBitmap{
 		private:
-		std::atomic_uint index;
-		std::array<std::shared_ptr<journalEntryWrapper>,1024> changeLog;
+		static constexpr unsigned bitsPerWord = 64;
+		std::array<std::atomic_uint64_t,(chunksInBucket+bitsPerWord-1)/bitsPerWord> words;
 		public:
-		bucketChangeLog(): index(0) {}
+		typedef std::bitset<chunksInBucket> bits_t;
+		slotBitmap() { exchange(); }
 		
-		bool addChange(std::shared_ptr<journalEntryWrapper> in);
+		bool set(int64_t id) { //Returns true if the slot was not set yet.
+			const uint64_t bit = uint64_t(1) << (id%bitsPerWord);
+			return (words.at(id/bitsPerWord).fetch_or(bit) & bit) == 0;
+		}
+		bool test(int64_t id) const { return (words.at(id/bitsPerWord).load() & (uint64_t(1) << (id%bitsPerWord))) != 0; }
+		void reset(int64_t id) { words.at(id/bitsPerWord).fetch_and(~(uint64_t(1) << (id%bitsPerWord))); }
+		unsigned setAll(void); //Returns the number of slots that were not set yet.
+		bool any(void) const;
+		bits_t exchange(void); //Return the set slots & clear them.
+		void add(const bits_t & in);
 	};
 
+	constexpr uint64_t noJournalEntry = UINT64_MAX;
+
 	class bucket {
 		
 		typedef std::recursive_mutex locktype;
@@ -41,22 +72,74 @@ namespace filesystem {
 		locktype _mut;
 		util::atomic_shared_ptr<bucketArray<chunk>> chunks;
 		util::atomic_shared_ptr<bucketArray<hash>> hashes;
-		util::atomic_shared_ptr<bucketChangeLog> changes;
+		//Oldest journal entry with changes in this bucket that are not on disk yet, & the same for the store in progress.
+		std::mutex _journalMut;
+		uint64_t journalPending = noJournalEntry, journalStoring = noJournalEntry;
 		
 		const str filenamebase;
+		const uint64_t bucketId;
+		const bool lazyChunks; //Load chunks slot by slot through the chunk cache (true) or keep the whole file in memory (false)
 		const str myfilenamehsh() const {return filenamebase+".hsh"; }
 		const str myfilenamechnk() const {return filenamebase+".chnk"; }
 		
 		std::shared_ptr<crypto::key> _key;
 		crypto::protocolInterface * _protocol;
+		std::atomic<bucketFormat> chunkFormat,hashFormat;
+		slotBitmap dirtyChunks,dirtyHashes;
+		slotBitmap badHashes; //Records that failed to open at load (a torn write), their slots are neither used nor free.
+		bucketFormat fileFormat(const str & filename,size_t recordSize,std::atomic<bucketFormat> & cached,size_t packedIndexSize = 0);
+		bucketFormat chunkFileFormat(void) { return fileFormat(myfilenamechnk(),chunkRecordSize(),chunkFormat,packedIndexRecordSize()); }
+		bucketFormat hashFileFormat(void) { return fileFormat(myfilenamehsh(),hashRecordSize(),hashFormat); }
+		size_t chunkRecordSize(void) const;
+		size_t hashRecordSize(void) const;
+		str fileHeader(bucketFormat format,size_t recordSize) const;
+		str slotAdditionalData(int64_t id) const;
+		str sealRecord(int64_t id,const str & cleartext,const str & filename);
+		void openRecord(int64_t id,const char * record,size_t recordSize,unsigned char * out,size_t outSize,const str & filename); //Decrypts into out, which should be filled exactly.
+		str chunkCleartext(shared_ptr<chunk> c);
+		str sealChunk(int64_t id,shared_ptr<chunk> c);
+		std::pair<uint64_t,size_t> chunkRecordLocation(int64_t id); //Offset & size of the record of a slot in the chunk file
+		void openChunkRecord(int64_t id,const char * record,size_t size,chunk & out);
+		shared_ptr<chunk> openChunk(int64_t id,const str & record);
+		std::vector<shared_ptr<chunk>> openChunks(const std::vector<int64_t> & ids,const str & content,uint64_t contentOffset,bool arena); //content holds the file from contentOffset on. arena: the chunks share one arena, else each has its own allocation (for the chunk cache).
+
+		//PACKED chunk files: header, 2 copies of the sealed index (sequence number, offset & length per slot), records in any order.
+		//The index is written to the older copy, so a torn index write leaves the previous one.
+		struct packedSlot {
+			uint32_t offset;
+			uint32_t length;
+		};
+		static_assert(sizeof(packedSlot)==8,"packedSlot should be 8 bytes");
+		typedef std::array<packedSlot,chunksInBucket> packedIndex_t;
+		packedIndex_t packedIndex;
+		bool packedIndexLoaded = false;
+		uint64_t packedEnd = 0; //End of the chunk file, new records are appended here.
+		uint64_t packedSequence = 0; //Of the current index copy, which is at packedSequence%2.
+		size_t packedIndexRecordSize(void) const;
+		uint64_t packedIndexOffset(uint64_t sequence) const;
+		uint64_t packedDataOffset(void) const;
+		str packedIndexAdditionalData(void) const;
+		void loadPackedIndex(void);
+		str sealPackedIndex(const packedIndex_t & index,uint64_t sequence);
+		str sealPackedChunk(int64_t id,shared_ptr<chunk> c);
+		bool writePackedFile(const std::vector<str> & records);
+		typedef std::vector<std::pair<unsigned,shared_ptr<chunk>>> sealedChunks_t; //The exact chunk objects a store wrote, per slot.
+		bool storePackedChunks(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,sealedChunks_t & sealed);
+		str sealHash(int64_t id,shared_ptr<hash> h);
 		shared_ptr<bucketArray<chunk>> loadChunks(void);
+		shared_ptr<chunk> loadChunk(int64_t id,shared_ptr<bucketArray<chunk>> C);
+		void loadAllChunks(shared_ptr<bucketArray<chunk>> C);
+		void loadLegacyChunks(shared_ptr<bucketArray<chunk>> C);
 		shared_ptr<bucketArray<hash>> loadHashes(void);
-		std::atomic_int chunkChangesSinceLoad,hashChangesSinceLoad;
+		uint64_t cacheKey(int64_t id) const { return bucketIndex_t(bucketId,id).fullindex(); }
+		void chunksStored(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,const sealedChunks_t & sealed);
+		bool storeChunks(shared_ptr<bucketArray<chunk>> C,const slotBitmap::bits_t & dirty,sealedChunks_t & sealed);
+		bool storeHashes(shared_ptr<bucketArray<hash>> H,const slotBitmap::bits_t & dirty);
 		loadFilter_t loadFilter;
 		storeFilter_t storeFilter;
 
 		public:
-		bucket(const str & file,std::shared_ptr<crypto::key> ikey,crypto::protocolInterface * iprotocol);
+		bucket(const str & file,uint64_t id,bool ilazyChunks,std::shared_ptr<crypto::key> ikey,crypto::protocolInterface * iprotocol);
 		~bucket();
 		
 		
@@ -66,20 +149,27 @@ namespace filesystem {
 		void migrateTo(bucket * targetBucket);
 		
 		std::shared_ptr<chunk> getChunk(int64_t id);
+		void prefetchChunks(const std::vector<int64_t> & ids); //Load the chunks into the chunk cache
 		
 		std::shared_ptr<hash> getHash(int64_t id);
+		bool badSlot(int64_t id) const { return badHashes.test(id); } //The hash record of the slot could not be opened.
+		bool unloadHashes(void); //Drop the hash objects if they are stored & not in use, getHash loads them again.
+		void loadedHashes(std::vector<std::shared_ptr<hash>> & out); //The hash objects that are in memory now.
 		
 		void putHashAndChunk(int64_t id,std::shared_ptr<hash> h,std::shared_ptr<chunk> c);
 
 		void clearHashAndChunk(int64_t id);
+		void clearHashesAndChunks(const std::vector<int64_t> & ids);
 
-		void hashChanged(void) { ++hashChangesSinceLoad; }
+		void hashChanged(int64_t id) { dirtyHashes.set(id); }
 		
 		void putHashedChunk(bucketIndex_t idx,const script::int_t irefcnt,std::shared_ptr<chunk> c);
 		
 		void store(bool clearCache = false);
+		std::vector<str> storeOrdered(void); //Stores the bucket after a store in progress is done, returns its files to sync.
 		
 		void addChange(std::shared_ptr<journalEntryWrapper> in);
+		uint64_t oldestJournalEntry(void); //noJournalEntry when every change journaled for this bucket is stored.
 	};
 
 }
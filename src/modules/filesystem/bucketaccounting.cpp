@@ -177,7 +177,32 @@ std::set<uint64_t> bucketaccounting::getBucketsInUse() {
 	return ret;
 }
 
+void bucketaccounting::reserve(bucketIndex_t data) {
+	lckguard l(_mut);
+	//A bucket created before the crash is not in the stored list, createBuckets would hand it out again.
+	bucketsInUse.insert(data.bucket());
+	reserved.insert(data.fullindex());
+	anyReserved = true;
+}
+
+void bucketaccounting::reserveBucket(uint64_t bucket) {
+	lckguard l(_mut);
+	bucketsInUse.insert(bucket);
+}
+
+bool bucketaccounting::isReserved(bucketIndex_t data) {
+	if(anyReserved.load()==false) {
+		return false;
+	}
+	lckguard l(_mut);
+	return reserved.erase(data.fullindex())==1; //Handed out once it is posted again.
+}
+
 void bucketaccounting::post(bucketIndex_t data) {
+	if(anyReserved.load()) {
+		lckguard l(_mut);
+		reserved.erase(data.fullindex());
+	}
 	while(true) {
 		auto * node = takeFromList(freeList);
 		if(node) {
@@ -208,6 +233,9 @@ bucketIndex_t bucketaccounting::fetch() {
 			ret = node->data;
 			node->data = 0;
 			insertIntoList(node,freeList);
+			if(isReserved(ret)) {
+				continue;
+			}
 			break;
 		} else {
 			//No more in availableList. freeList should be filled.
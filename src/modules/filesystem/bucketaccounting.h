@@ -54,6 +54,10 @@ class bucketaccounting{
 	std::set<uint64_t> bucketsInUse;
 	bucketInfo * info;
 	
+	std::set<uint64_t> reserved; //Entries that are in use but may still be in the pool, fetch skips them.
+	std::atomic_bool anyReserved{false};
+	bool isReserved(bucketIndex_t data);
+	
 	public:
 		bucketaccounting(std::set<uint64_t> _buckets,bucketInfo * iinfo); 
 
@@ -62,6 +66,9 @@ class bucketaccounting{
 	void post(bucketIndex_t data);//Post a single entry back to the pool
 
 	bucketIndex_t fetch();//Get a single entry from the pool.
+	
+	void reserve(bucketIndex_t data);//The journal replay puts something at data: never hand it out, keep its bucket.
+	void reserveBucket(uint64_t bucket);//The journal replay points into a bucket that may not be in the stored list.
 
 	
 
@@ -0,0 +1,350 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "bucketio.h"
+#include "main.h"
+#include "modules/util/files.h"
+#include <filesystem>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+
+using namespace filesystem;
+
+#ifndef _WIN32
+static bool writeFully(int fd,std::vector<iovec> & iov,uint64_t offset) {
+	size_t first = 0;
+	while(first < iov.size()) {
+		const auto n = pwritev(fd,&iov[first],(int)(iov.size()-first),offset);
+		if(n < 0) {
+			if(errno==EINTR) {
+				continue;
+			}
+			return false;
+		}
+		offset += n;
+		//Skip what was written, a short write can end halfway a buffer.
+		size_t left = n;
+		while(first < iov.size() && left >= iov[first].iov_len) {
+			left -= iov[first].iov_len;
+			++first;
+		}
+		if(left > 0) {
+			iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+			iov[first].iov_len -= left;
+		}
+	}
+	return true;
+}
+#endif
+
+bucketIO::handle::~handle() {
+#ifndef _WIN32
+	if(fd >= 0) {
+		::close(fd);
+	}
+#endif
+}
+
+std::shared_ptr<bucketIO::handle> bucketIO::get(const str & path) {
+	{
+		lckunique l(_mut);
+		auto it = openFiles.find(path);
+		if(it!=openFiles.end()) {
+			lru.splice(lru.begin(),lru,it->second.it);
+			++reused;
+			return it->second.h;
+		}
+	}
+#ifndef _WIN32
+	int fd;
+	do {
+		fd = ::open(path.c_str(),O_RDWR|O_CLOEXEC);
+	} while(fd < 0 && errno==EINTR);
+	if(fd < 0) {
+		return nullptr;
+	}
+	++opened;
+	auto h = std::make_shared<handle>(fd);
+	lckunique l(_mut);
+	auto it = openFiles.find(path);
+	if(it!=openFiles.end()) {
+		//Opened by another thread, or replaced, in the mean time: that descriptor is the current one.
+		return it->second.h;
+	}
+	insertLocked(path,h);
+	return h;
+#else
+	return nullptr;
+#endif
+}
+
+void bucketIO::insert(const str & path,std::shared_ptr<handle> h) {
+	lckunique l(_mut);
+	insertLocked(path,h);
+}
+
+void bucketIO::insertLocked(const str & path,std::shared_ptr<handle> h) {
+	auto it = openFiles.find(path);
+	if(it!=openFiles.end()) {
+		it->second.h = h;
+		lru.splice(lru.begin(),lru,it->second.it);
+	} else {
+		lru.push_front(path);
+		openFiles[path] = entry{h,lru.begin()};
+	}
+	//Descriptors still in use are closed when the last user drops them.
+	while(openFiles.size() > maxOpen) {
+		openFiles.erase(lru.back());
+		lru.pop_back();
+	}
+}
+
+bool bucketIO::fileSize(const str & path,uint64_t & size) {
+#ifndef _WIN32
+	auto h = get(path);
+	if(!h) {
+		return false;
+	}
+	struct stat st;
+	if(fstat(h->fd,&st)!=0) {
+		return false;
+	}
+	size = st.st_size;
+	return true;
+#else
+	size_t s = 0;
+	if(util::fileExists(path,&s)) {
+		size = s;
+		return true;
+	}
+	return false;
+#endif
+}
+
+str bucketIO::read(const str & path,uint64_t offset,uint64_t size) {
+#ifndef _WIN32
+	auto h = get(path);
+	if(!h) {
+		return "";
+	}
+	if(size==0) {
+		struct stat st;
+		if(fstat(h->fd,&st)!=0 || (uint64_t)st.st_size <= offset) {
+			return "";
+		}
+		size = st.st_size - offset;
+	}
+	str ret;
+	ret.resize(size);
+	uint64_t done = 0;
+	while(done < size) {
+		const auto n = pread(h->fd,&ret[done],size-done,offset+done);
+		if(n < 0 && errno==EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	ret.resize(done);
+	return ret;
+#else
+	return util::getSystemString(path,offset,size);
+#endif
+}
+
+bool bucketIO::patch(const str & path,const std::vector<std::pair<uint64_t,str>> & parts) {
+#ifndef _WIN32
+	auto h = get(path);
+	if(!h) {
+		CLOG("Failed to open file ",path," for patching");
+		return false;
+	}
+	//Parts that follow each other are written with a single call.
+	std::vector<iovec> iov;
+	uint64_t runOffset = 0,runEnd = 0;
+	for(const auto & part: parts) {
+		if(iov.empty()==false && (part.first!=runEnd || iov.size()>=IOV_MAX)) {
+			if(writeFully(h->fd,iov,runOffset)==false) {
+				CLOG("Failed to patch file ",path," error: ",errno);
+				return false;
+			}
+			iov.clear();
+		}
+		if(iov.empty()) {
+			runOffset = part.first;
+			runEnd = part.first;
+		}
+		iov.push_back(iovec{const_cast<char*>(part.second.data()),part.second.size()});
+		runEnd += part.second.size();
+	}
+	if(iov.empty()==false && writeFully(h->fd,iov,runOffset)==false) {
+		CLOG("Failed to patch file ",path," error: ",errno);
+		return false;
+	}
+	written(path,false);
+	return true;
+#else
+	return util::patchSystemString(path,parts);
+#endif
+}
+
+bool bucketIO::replace(const str & path,const str & content) {
+#ifndef _WIN32
+	const str pathtemp = path+"~";
+	int fd;
+	do {
+		fd = ::open(pathtemp.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,0666);
+	} while(fd < 0 && errno==EINTR);
+	if(fd < 0) {
+		CLOG("Failed to open file ",pathtemp," for writing");
+		return false;
+	}
+	++opened;
+	auto h = std::make_shared<handle>(fd);
+	std::vector<iovec> iov{iovec{const_cast<char*>(content.data()),content.size()}};
+	if(writeFully(fd,iov,0)==false || ::rename(pathtemp.c_str(),path.c_str())!=0) {
+		CLOG("Failed to write file ",path," error: ",errno);
+		return false;
+	}
+	//The new file replaces the descriptor of the old one.
+	insert(path,h);
+	written(path,true);
+	return true;
+#else
+	return util::putSystemString(path,content);
+#endif
+}
+
+void bucketIO::remove(const str & path) {
+	close(path);
+	std::filesystem::remove(path.c_str());
+}
+
+void bucketIO::makeDir(const str & path) {
+	std::unique_lock<std::mutex> l(_dirMut);
+	if(createdDirs.count(path)==0) {
+		util::MKDIR(path);
+		createdDirs.insert(path);
+	}
+}
+
+static str parentOf(const str & path) {
+	return std::filesystem::path(path.c_str()).parent_path().string().c_str();
+}
+
+void bucketIO::written(const str & path,bool renamed) {
+	std::unique_lock<std::mutex> l(_syncMut);
+	++writes;
+	unsynced[path] = writes;
+	if(renamed) {
+		unsyncedDirs[parentOf(path)] = writes;
+	}
+}
+
+bool bucketIO::syncPending(const pending_t & files,const pending_t & dirs) {
+#ifndef _WIN32
+	//A path stays pending until it is synced, so a concurrent sync that finds it syncs it as well.
+	bool ok = true;
+	pending_t done;
+	for(const auto & f: files) {
+		auto h = get(f.first);
+		if(h && fdatasync(h->fd)!=0) {
+			CLOG("Failed to sync file ",f.first," error: ",errno);
+			ok = false;
+			continue;
+		}
+		++synced; //Or removed since, then there is nothing left to sync.
+		done.push_back(f);
+	}
+	const size_t doneFiles = done.size();
+	for(const auto & d: dirs) {
+		int fd;
+		do {
+			fd = ::open(d.first.c_str(),O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		} while(fd < 0 && errno==EINTR);
+		if(fd < 0 || fsync(fd)!=0) {
+			CLOG("Failed to sync directory ",d.first," error: ",errno);
+			if(fd >= 0) {
+				::close(fd);
+			}
+			ok = false;
+			continue;
+		}
+		::close(fd);
+		done.push_back(d);
+	}
+	//Written again in the mean time: that write may not be covered.
+	std::unique_lock<std::mutex> l(_syncMut);
+	for(size_t a=0;a<done.size();a++) {
+		auto & M = a<doneFiles ? unsynced : unsyncedDirs;
+		auto it = M.find(done[a].first);
+		if(it!=M.end() && it->second==done[a].second) {
+			M.erase(it);
+		}
+	}
+	return ok;
+#else
+	return true; //util::putSystemString & patchSystemString have no descriptor to sync.
+#endif
+}
+
+bool bucketIO::sync(void) {
+	pending_t files,dirs;
+	{
+		std::unique_lock<std::mutex> l(_syncMut);
+		files.assign(unsynced.begin(),unsynced.end());
+		dirs.assign(unsyncedDirs.begin(),unsyncedDirs.end());
+	}
+	return syncPending(files,dirs);
+}
+
+bool bucketIO::sync(const std::vector<str> & paths) {
+	pending_t files,dirs;
+	{
+		std::unique_lock<std::mutex> l(_syncMut);
+		for(const auto & p: paths) {
+			auto it = unsynced.find(p);
+			if(it!=unsynced.end()) {
+				files.push_back(*it);
+			}
+			it = unsyncedDirs.find(parentOf(p));
+			if(it!=unsyncedDirs.end() && std::none_of(dirs.begin(),dirs.end(),[&](const auto & d) { return d.first==it->first; })) {
+				dirs.push_back(*it);
+			}
+		}
+	}
+	return syncPending(files,dirs);
+}
+
+void bucketIO::close(const str & path) {
+	lckunique l(_mut);
+	auto it = openFiles.find(path);
+	if(it!=openFiles.end()) {
+		lru.erase(it->second.it);
+		openFiles.erase(it);
+	}
+}
+
+void bucketIO::closeAll(void) {
+	lckunique l(_mut);
+	openFiles.clear();
+	lru.clear();
+}
+
+size_t bucketIO::numOpen(void) {
+	lckunique l(_mut);
+	return openFiles.size();
+}
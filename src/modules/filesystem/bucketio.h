@@ -0,0 +1,86 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_BUCKETIO_H
+#define FILESYSTEM_BUCKETIO_H
+
+#include "types.h"
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace filesystem {
+
+	/**
+	 * File access for the chunk & hash files of buckets.
+	 *
+	 * Keeps a limited number of file descriptors open (least recently used is closed first), so loading a slot
+	 * is a single pread into a buffer of the exact size, and patching records is a pwritev per contiguous run.
+	 * Directories are only created the first time they are needed.
+	 *
+	 * Callers serialize access to a single file (the bucket lock), the cache itself is thread safe.
+	 * On _WIN32 the util::files functions are used instead of descriptors.
+	 *
+	 * Nothing is synced when it is written. The files written & not synced yet are remembered, sync fdatasyncs
+	 * them (& the directories of replaced ones): all of them before the journal retires the entries they hold,
+	 * or the files of the buckets the ordered writes of a commit window stored, before their entries.
+	 */
+	class bucketIO {
+	private:
+		struct handle {
+			int fd = -1;
+			handle(int ifd) : fd(ifd) {}
+			handle(const handle&) = delete;
+			~handle();
+		};
+		typedef std::unique_lock<std::mutex> lckunique;
+		struct entry {
+			std::shared_ptr<handle> h;
+			std::list<str>::iterator it;
+		};
+
+		std::mutex _mut;
+		std::list<str> lru; //Front is most recently used.
+		std::unordered_map<str,entry> openFiles;
+		size_t maxOpen;
+
+		std::mutex _dirMut;
+		std::unordered_set<str> createdDirs;
+
+		typedef std::vector<std::pair<str,uint64_t>> pending_t;
+		std::mutex _syncMut;
+		std::unordered_map<str,uint64_t> unsynced,unsyncedDirs; //The last write per path, until a sync after it succeeded.
+		uint64_t writes = 0;
+		void written(const str & path,bool renamed); //After the write, so a sync that misses it leaves it for the next.
+		bool syncPending(const pending_t & files,const pending_t & dirs);
+
+		std::shared_ptr<handle> get(const str & path);
+		void insert(const str & path,std::shared_ptr<handle> h); //Overwrites the entry, for replace().
+		void insertLocked(const str & path,std::shared_ptr<handle> h); //With _mut held.
+	public:
+		static constexpr size_t defaultMaxOpen = 256;
+		std::atomic_uint64_t opened{0},reused{0},synced{0};
+
+		bucketIO(size_t imaxOpen = defaultMaxOpen) : maxOpen(imaxOpen) {}
+		bucketIO(const bucketIO&) = delete;
+
+		bool fileSize(const str & path,uint64_t & size); //False if the file does not exist.
+		str read(const str & path,uint64_t offset = 0,uint64_t size = 0); //size 0 reads up to the end of the file. A short read returns what could be read.
+		bool patch(const str & path,const std::vector<std::pair<uint64_t,str>> & parts); //Overwrite parts of an existing file in place.
+		bool replace(const str & path,const str & content); //Write a new file next to the old one & rename it over it.
+		void remove(const str & path);
+		void makeDir(const str & path);
+		bool sync(void); //Everything written before the call is on disk when it returns true.
+		bool sync(const std::vector<str> & paths); //Only these files & the renames into their directories.
+
+		void close(const str & path);
+		void closeAll(void);
+		size_t numOpen(void);
+	};
+}
+
+#endif // FILESYSTEM_BUCKETIO_H
@@ -2,7 +2,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 /**
- * The chunk class represents a fixed size (4096bytes) block of data.
+ * The chunk class represents a fixed size (chunkSize, 4096 bytes by default) block of data.
  * all operations are const with the exception of as<T>().
  * The write operation will return a copy of the data with the added changes.
  * 
@@ -14,6 +14,40 @@
 
 using namespace filesystem;
 #include <stdexcept>
+#include <new>
+#include <cstring>
+
+static_assert(sizeof(chunk)==chunkSize,"chunks in an arena should be contiguous");
+
+namespace filesystem {
+	/**
+	 * One allocation holding a number of chunks, used by buckets to decrypt many slots straight into place.
+	 * The chunks handed out share ownership of the arena, it is freed together with the last of them.
+	 * The arena is owned through its own deleter type, so chunk::inArena can recognise its chunks.
+	 */
+	class chunkArena {
+	public:
+		static constexpr size_t alignment = 4096;
+		chunk * chunks;
+		const size_t count;
+		chunkArena(size_t icount) : count(icount) {
+			chunks = static_cast<chunk*>(::operator new(count*sizeof(chunk),std::align_val_t(alignment)));
+			for(size_t a=0;a<count;a++) {
+				new (&chunks[a]) chunk(chunk::noInit());
+			}
+		}
+		chunkArena(const chunkArena&) = delete;
+		~chunkArena() {
+			for(size_t a=0;a<count;a++) {
+				chunks[a].~chunk();
+			}
+			::operator delete(chunks,std::align_val_t(alignment));
+		}
+		struct deleter {
+			void operator()(chunkArena * a) const { delete a; }
+		};
+	};
+}
 
 chunk::chunk(){
 	zeroOut(data);
@@ -26,6 +60,15 @@ crypto::sha256sum filesystem::chunk::getHash() {
 	return crypto::sha256sum(data.data(),data.size());
 }
 
+std::vector<crypto::sha256sum> chunk::getHashes(const std::vector<std::shared_ptr<chunk>> & chunks) {
+	std::vector<const unsigned char *> buffers;
+	buffers.reserve(chunks.size());
+	for(auto & c: chunks) {
+		buffers.push_back(c->data.data());
+	}
+	return crypto::sha256sum::many(buffers.data(),chunkSize,buffers.size());
+}
+
 
 
 
@@ -38,23 +81,48 @@ void chunk::read(my_off_t offset,my_size_t size,unsigned char * output) const {
 }
 
 std::shared_ptr<chunk> chunk::write(my_off_t offset,my_size_t size,const unsigned char * input) const {
-	auto newChunk = std::make_shared<chunk>();
-	newChunk->data = data;
-	if(offset+size<=data.size()) {
-		std::copy(input,input+size,newChunk->data.begin()+offset);
-	} else {
+	if(offset+size>data.size()) {
 		throw std::out_of_range("chunk::write "+std::to_string(offset)+" "+std::to_string(size));
 	}
+	//Every byte of the copy is written once: the old data around the new data.
+	auto newChunk = std::make_shared<chunk>(noInit());
+	std::copy(data.begin(),data.begin()+offset,newChunk->data.begin());
+	std::copy(input,input+size,newChunk->data.begin()+offset);
+	std::copy(data.begin()+offset+size,data.end(),newChunk->data.begin()+offset+size);
 	return newChunk;
 }
 
 std::shared_ptr<chunk> chunk::clone() const {
-	auto newChunk = std::make_shared<chunk>();
+	auto newChunk = std::make_shared<chunk>(noInit());
 	newChunk->data = data;
 
 	return newChunk;
 }
 
+bool chunk::inArena(const std::shared_ptr<chunk> & c) {
+	return std::get_deleter<chunkArena::deleter>(c)!=nullptr;
+}
+
+std::shared_ptr<chunk> chunk::standalone(std::shared_ptr<chunk> c) {
+	if(c && inArena(c)) {
+		return c->clone();
+	}
+	return c;
+}
+
+std::vector<std::shared_ptr<chunk>> chunk::newArena(size_t count) {
+	std::vector<std::shared_ptr<chunk>> ret;
+	if(count==0) {
+		return ret;
+	}
+	std::shared_ptr<chunkArena> arena(new chunkArena(count),chunkArena::deleter());
+	ret.reserve(count);
+	for(size_t a=0;a<count;a++) {
+		ret.emplace_back(arena,&arena->chunks[a]);
+	}
+	return ret;
+}
+
 
 std::shared_ptr<chunk> filesystem::chunk::newChunk(my_size_t size, const unsigned char * input) {
 	auto newChunk = std::make_shared<chunk>();
@@ -81,3 +149,33 @@ bool chunk::compareChunk(shared_ptr<chunk> c) {
 	
 	return true;
 }
+
+bool chunk::isZero(const unsigned char * input,my_size_t size) {
+	//OR together 64 bytes at a time, the compiler turns the inner loop into a few vector instructions.
+	const size_t stride = 64;
+	size_t a = 0;
+	for(;a+stride<=size;a+=stride) {
+		uint64_t words[stride/sizeof(uint64_t)];
+		std::memcpy(words,input+a,stride);
+		uint64_t acc = 0;
+		for(auto w: words) {
+			acc |= w;
+		}
+		if(acc!=0) {
+			return false;
+		}
+	}
+	for(;a<size;a++) {
+		if(input[a]!=0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool chunk::isZeroOutside(my_off_t offset,my_size_t size) const {
+	if(offset+size>data.size()) {
+		throw std::out_of_range("chunk::isZeroOutside "+std::to_string(offset)+" "+std::to_string(size));
+	}
+	return isZero(data.data(),offset) && isZero(data.data()+offset+size,data.size()-offset-size);
+}
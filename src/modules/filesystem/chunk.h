@@ -6,29 +6,54 @@
 #include "main.h"
 #include "hash.h"
 #include <array>
+#include <vector>
+
+/**
+ * Chunk geometry is fixed at build time (make CHUNKSIZE=16384 CHUNKSINBUCKET=128), it is stored in config.json
+ * when a filesystem is created & a filesystem can only be mounted by a build with the same geometry.
+ */
+#ifndef CCFS_CHUNK_SIZE
+#define CCFS_CHUNK_SIZE 4096
+#endif
+#ifndef CCFS_CHUNKS_IN_BUCKET
+#define CCFS_CHUNKS_IN_BUCKET 256
+#endif
+
 namespace filesystem {
-	const unsigned chunkSize = 4096;
-	const unsigned chunksInBucket = 256;
+	const unsigned chunkSize = CCFS_CHUNK_SIZE;
+	const unsigned chunksInBucket = CCFS_CHUNKS_IN_BUCKET;
+	static_assert((chunkSize==4096 && chunksInBucket==256) || (chunkSize==16384 && chunksInBucket==128) || (chunkSize==65536 && chunksInBucket==64),
+		"Supported chunk geometries are 4K/256, 16K/128 & 64K/64");
 
 	class file;
 	class bucket;
+	class chunkArena;
 	/**
 	 * @todo write docs
 	 */
 	class chunk {
 	private:
 		friend class bucket;
+		friend class chunkArena;
+		struct noInit {};
 		std::array<unsigned char,chunkSize> data;
+		static std::vector<std::shared_ptr<chunk>> newArena(size_t count); //count chunks in one contiguous page aligned block, content is undefined.
 	public:
 		chunk();
+		chunk(noInit) {} //Content is undefined, for chunks that get overwritten right away. Only chunk & friends can name noInit.
 		~chunk();
 		crypto::sha256sum getHash();
+		static std::vector<crypto::sha256sum> getHashes(const std::vector<std::shared_ptr<chunk>> & chunks); //Hashes all chunks in one pass of the batch kernel.
 		void read(my_off_t offset,my_size_t size,unsigned char * output) const;
 		std::shared_ptr<chunk> write(my_off_t offset,my_size_t size,const unsigned char * input) const;
 		std::shared_ptr<chunk> clone() const;
+		static bool inArena(const std::shared_ptr<chunk> & c); //The chunk keeps a whole arena of chunks alive.
+		static std::shared_ptr<chunk> standalone(std::shared_ptr<chunk> c); //c, or a copy in its own allocation if c is in an arena.
 		static std::shared_ptr<chunk> newChunk(my_size_t size, const unsigned char * input);
 		
 		bool compareChunk(shared_ptr<chunk> c);
+		bool isZeroOutside(my_off_t offset,my_size_t size) const; //True if all bytes before offset & from offset+size on are zero.
+		static bool isZero(const unsigned char * input,my_size_t size);
 		
 		template<typename T> T* as() { 
 			static_assert(sizeof(T) == chunkSize ,"type should be of chunkSize"); 
@@ -0,0 +1,183 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+/**
+ * ARC as described by Megiddo & Modha, "ARC: A Self-Tuning, Low Overhead Replacement Cache".
+ *
+ * T1: chunks seen once recently, T2: chunks seen at least twice.
+ * B1/B2: keys recently evicted from T1/T2 (no data), a hit on these moves the target size p of T1.
+ */
+#include "chunkcache.h"
+#include "chunk.h"
+#include "main.h"
+
+using namespace filesystem;
+
+chunkCache::chunkCache(size_t budgetBytes) {
+	setBudget(budgetBytes);
+}
+
+std::list<uint64_t> & chunkCache::listOf(arcList l) {
+	switch(l) {
+		case arcList::T1: return T1;
+		case arcList::T2: return T2;
+		case arcList::B1: return B1;
+		default: return B2;
+	}
+}
+
+void chunkCache::moveTo(uint64_t key,entry & e,arcList l) {
+	auto & target = listOf(l);
+	target.splice(target.begin(),listOf(e.list),e.it);
+	e.list = l;
+	e.it = target.begin();
+	if(l==arcList::B1 || l==arcList::B2) {
+		e.data.reset();
+	}
+}
+
+void chunkCache::dropLRU(arcList l) {
+	auto & L = listOf(l);
+	if(L.empty()) {
+		return;
+	}
+	if(l==arcList::T1 || l==arcList::T2) {
+		++evictions;
+	}
+	entries.erase(L.back());
+	L.pop_back();
+}
+
+void chunkCache::replace(bool inB2) {
+	if(T1.empty()==false && (T1.size() > p || (inB2 && T1.size()==p) || T2.empty())) {
+		const auto key = T1.back();
+		moveTo(key,entries.at(key),arcList::B1);
+	} else if(T2.empty()==false) {
+		const auto key = T2.back();
+		moveTo(key,entries.at(key),arcList::B2);
+	} else {
+		return;
+	}
+	++evictions;
+}
+
+void chunkCache::setBudget(size_t budgetBytes) {
+	lckunique l(_mut);
+	capacity = budgetBytes/chunkSize;
+	p = std::min(p,capacity);
+	while(T1.size()+T2.size() > capacity) {
+		replace(false);
+	}
+	while(B1.size() > capacity) {
+		dropLRU(arcList::B1);
+	}
+	while(B2.size() > capacity) {
+		dropLRU(arcList::B2);
+	}
+}
+
+size_t chunkCache::getBudget(void) {
+	lckunique l(_mut);
+	return capacity*chunkSize;
+}
+
+size_t chunkCache::size(void) {
+	lckunique l(_mut);
+	return T1.size()+T2.size();
+}
+
+std::shared_ptr<chunk> chunkCache::get(uint64_t key) {
+	lckunique l(_mut);
+	auto it = entries.find(key);
+	if(it!=entries.end() && (it->second.list==arcList::T1 || it->second.list==arcList::T2)) {
+		moveTo(key,it->second,arcList::T2);
+		++hits;
+		return it->second.data;
+	}
+	++misses;
+	return nullptr;
+}
+
+bool chunkCache::contains(uint64_t key) {
+	lckunique l(_mut);
+	auto it = entries.find(key);
+	return it!=entries.end() && (it->second.list==arcList::T1 || it->second.list==arcList::T2);
+}
+
+void chunkCache::put(uint64_t key,std::shared_ptr<chunk> c) {
+	//An entry is charged for one chunk, so it may not keep an arena of them alive.
+	c = chunk::standalone(c);
+	lckunique l(_mut);
+	if(capacity==0 || c==nullptr) {
+		return;
+	}
+	auto it = entries.find(key);
+	if(it!=entries.end()) {
+		auto & e = it->second;
+		switch(e.list) {
+			case arcList::T1:
+			case arcList::T2:
+				break;
+			case arcList::B1:
+				p = std::min(capacity, p + std::max<size_t>(B2.size()/std::max<size_t>(B1.size(),1),1));
+				if(T1.size()+T2.size() >= capacity) {
+					replace(false);
+				}
+				break;
+			case arcList::B2:
+				p -= std::min(p, std::max<size_t>(B1.size()/std::max<size_t>(B2.size(),1),1));
+				if(T1.size()+T2.size() >= capacity) {
+					replace(true);
+				}
+				break;
+		}
+		moveTo(key,e,arcList::T2);
+		e.data = c;
+		return;
+	}
+	//Not seen recently:
+	if(T1.size()+B1.size() >= capacity) {
+		if(T1.size() < capacity) {
+			dropLRU(arcList::B1);
+			if(T1.size()+T2.size() >= capacity) {
+				replace(false);
+			}
+		} else {
+			dropLRU(arcList::T1);
+		}
+	} else if(T1.size()+T2.size()+B1.size()+B2.size() >= capacity) {
+		if(T1.size()+T2.size()+B1.size()+B2.size() >= 2*capacity) {
+			dropLRU(arcList::B2);
+		}
+		if(T1.size()+T2.size() >= capacity) {
+			replace(false);
+		}
+	}
+	T1.push_front(key);
+	entries[key] = entry{arcList::T1,T1.begin(),c};
+}
+
+void chunkCache::erase(uint64_t key) {
+	lckunique l(_mut);
+	auto it = entries.find(key);
+	if(it!=entries.end()) {
+		listOf(it->second.list).erase(it->second.it);
+		entries.erase(it);
+	}
+}
+
+void chunkCache::clear(void) {
+	lckunique l(_mut);
+	entries.clear();
+	T1.clear();
+	T2.clear();
+	B1.clear();
+	B2.clear();
+	p = 0;
+}
+
+bool chunkCache::overDirtyBudget(void) {
+	//Allow half the cache in dirty chunks, with a minimum of a few buckets so small caches still batch writes.
+	const int64_t maxDirty = std::max<int64_t>(getBudget()/chunkSize/2,chunksInBucket*4);
+	return dirtyChunks.load() > maxDirty;
+}
@@ -0,0 +1,69 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_CHUNKCACHE_H
+#define FILESYSTEM_CHUNKCACHE_H
+
+#include "types.h"
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+
+namespace filesystem {
+	class chunk;
+
+	/**
+	 * Global cache of decrypted data chunks, keyed on bucketIndex_t, limited by a byte budget.
+	 *
+	 * Uses ARC (adaptive replacement cache): recently used & frequently used entries are kept in separate lists,
+	 * ghost lists of evicted keys steer the balance between the two. A single sequential scan can only
+	 * flush the 'recent' part of the cache, chunks that are used repeatedly stay.
+	 *
+	 * The cache also keeps count of the chunks that are waiting in buckets to be written, so writers know
+	 * when the dirty data should be flushed.
+	 */
+	class chunkCache {
+	private:
+		enum class arcList: uint8_t { T1, T2, B1, B2 };
+		struct entry {
+			arcList list;
+			std::list<uint64_t>::iterator it;
+			std::shared_ptr<chunk> data;
+		};
+		typedef std::unique_lock<std::mutex> lckunique;
+
+		std::mutex _mut;
+		std::unordered_map<uint64_t,entry> entries;
+		std::list<uint64_t> T1,T2,B1,B2; //Front is most recently used.
+		size_t capacity = 0; //In chunks
+		size_t p = 0; //Target size for T1
+
+		std::list<uint64_t> & listOf(arcList l);
+		void moveTo(uint64_t key,entry & e,arcList l);
+		void dropLRU(arcList l);
+		void replace(bool inB2);
+	public:
+		static constexpr size_t defaultBudget = 128*1024*1024;
+		std::atomic_uint64_t hits{0},misses{0},evictions{0};
+		std::atomic_int64_t dirtyChunks{0};
+
+		chunkCache(size_t budgetBytes);
+		chunkCache(const chunkCache&) = delete;
+
+		void setBudget(size_t budgetBytes);
+		size_t getBudget(void);
+		size_t size(void); //In chunks
+
+		std::shared_ptr<chunk> get(uint64_t key);
+		bool contains(uint64_t key); //Does not count as a use of the chunk.
+		void put(uint64_t key,std::shared_ptr<chunk> c);
+		void erase(uint64_t key);
+		void clear(void);
+
+		void addDirty(int64_t num) { dirtyChunks += num; }
+		bool overDirtyBudget(void); //True if enough chunks are waiting to be written that the buckets should be stored.
+	};
+}
+
+#endif // FILESYSTEM_CHUNKCACHE_H
@@ -0,0 +1,155 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "compactindex.h"
+#include "main.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+using namespace filesystem;
+
+uint64_t compactIndex::prefix(const record & r) {
+	uint64_t ret;
+	std::memcpy(&ret,r.sum.data(),sizeof(ret));
+	return ret;
+}
+
+compactIndex::shard & compactIndex::shardOf(std::array<shard,numShards> & shards,const record & r) {
+	uint64_t h;
+	std::memcpy(&h,r.sum.data()+sizeof(h),sizeof(h));
+	return shards[h % numShards];
+}
+
+size_t compactIndex::home(const shard & s,uint64_t prefix) {
+	//Maps the prefix onto [0,size) without a division, so the tables can grow in small steps.
+	return (size_t)(((prefix >> 32) * s.slots.size()) >> 32);
+}
+
+size_t compactIndex::next(const shard & s,size_t a) {
+	return a+1==s.slots.size() ? 0 : a+1;
+}
+
+size_t compactIndex::find(const shard & s,const record & key) {
+	const auto p = prefix(key);
+	for(size_t a=home(s,p);;a=next(s,a)) {
+		const auto & r = s.slots[a];
+		if(r.location==0) {
+			return a;
+		}
+		if(prefix(r)==p && std::memcmp(r.sum.data(),key.sum.data(),key.sum.size())==0) {
+			return a;
+		}
+	}
+}
+
+void compactIndex::grow(shard & s) {
+	std::vector<record> old(std::max(minCapacity,s.slots.size()+s.slots.size()/4));
+	old.swap(s.slots);
+	for(const auto & r: old) {
+		if(r.location!=0) {
+			s.slots[find(s,r)] = r;
+		}
+	}
+}
+
+compactIndex::compactIndex() {
+	for(auto & s: shards) {
+		s.slots.resize(minCapacity);
+	}
+}
+
+bucketIndex_t compactIndex::get(const crypto::sha256sum & sum) {
+	const auto key = dedupIndex::makeEntry(sum,bucketIndex_t());
+	auto & s = shardOf(shards,key);
+	std::shared_lock<std::shared_mutex> l(s._mut);
+	return bucketIndex_t(s.slots[find(s,key)].location);
+}
+
+void compactIndex::insert(const record & r) {
+	_ASSERT(r.location!=0);
+	auto & s = shardOf(shards,r);
+	std::unique_lock<std::shared_mutex> l(s._mut);
+	//At most 80% full, probing compares only the prefix of most records it passes.
+	if((s.used+1)*10 > s.slots.size()*8) {
+		grow(s);
+	}
+	auto & slot = s.slots[find(s,r)];
+	if(slot.location==0) {
+		++s.used;
+		++_size;
+	}
+	slot = r;
+}
+
+bool compactIndex::insertIfAbsent(const record & r) {
+	_ASSERT(r.location!=0);
+	auto & s = shardOf(shards,r);
+	std::unique_lock<std::shared_mutex> l(s._mut);
+	if((s.used+1)*10 > s.slots.size()*8) {
+		grow(s);
+	}
+	auto & slot = s.slots[find(s,r)];
+	if(slot.location!=0) {
+		return false;
+	}
+	++s.used;
+	++_size;
+	slot = r;
+	return true;
+}
+
+size_t compactIndex::erase(const crypto::sha256sum & sum) {
+	const auto key = dedupIndex::makeEntry(sum,bucketIndex_t());
+	auto & s = shardOf(shards,key);
+	std::unique_lock<std::shared_mutex> l(s._mut);
+	size_t hole = find(s,key);
+	if(s.slots[hole].location==0) {
+		return 0;
+	}
+	//Move back the records after the hole that would otherwise no longer be found from their home slot.
+	for(size_t a=next(s,hole);s.slots[a].location!=0;a=next(s,a)) {
+		const size_t h = home(s,prefix(s.slots[a]));
+		const bool between = hole<=a ? (hole<h && h<=a) : (hole<h || h<=a);
+		if(!between) {
+			s.slots[hole] = s.slots[a];
+			hole = a;
+		}
+	}
+	s.slots[hole].location = 0;
+	--s.used;
+	--_size;
+	return 1;
+}
+
+void compactIndex::clear(void) {
+	for(auto & s: shards) {
+		std::unique_lock<std::shared_mutex> l(s._mut);
+		_size -= s.used;
+		s.used = 0;
+		std::vector<record>(minCapacity).swap(s.slots);
+	}
+}
+
+size_t compactIndex::memoryUsage(void) {
+	size_t ret = sizeof(*this);
+	for(auto & s: shards) {
+		std::shared_lock<std::shared_mutex> l(s._mut);
+		ret += s.slots.capacity()*sizeof(record);
+	}
+	return ret;
+}
+
+std::vector<compactIndex::record> compactIndex::list(void) {
+	std::vector<record> ret;
+	ret.reserve(size());
+	for(auto & s: shards) {
+		std::shared_lock<std::shared_mutex> l(s._mut);
+		for(const auto & r: s.slots) {
+			if(r.location!=0) {
+				ret.push_back(r);
+			}
+		}
+	}
+	return ret;
+}
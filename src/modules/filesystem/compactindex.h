@@ -0,0 +1,62 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_COMPACTINDEX_H
+#define FILESYSTEM_COMPACTINDEX_H
+
+#include "types.h"
+#include "hash.h"
+#include "dedupindex.h"
+#include <array>
+#include <atomic>
+#include <shared_mutex>
+#include <vector>
+
+namespace filesystem {
+
+	/**
+	 * Dedup index of the data buckets: sha256sum -> bucketIndex_t, in flat open addressing tables of 40 byte records.
+	 *
+	 * The hash objects themselves stay in their buckets, which only keep them in memory while they are in use.
+	 * The records are spread over shards with their own lock, on the second 8 bytes of the sum. Within a shard
+	 * the first 8 bytes pick the home slot and are compared before the full sum (linear probing, deletes shift
+	 * the following records back so there are no tombstones). Tables grow by a quarter at 80% load.
+	 */
+	class compactIndex {
+	public:
+		typedef dedupIndex::entry record; //location 0 marks an empty slot, bucket 0 is never used.
+	private:
+		static constexpr size_t numShards = 64;
+		static constexpr size_t minCapacity = 16;
+		struct alignas(64) shard {
+			std::shared_mutex _mut;
+			std::vector<record> slots;
+			size_t used = 0;
+		};
+		std::array<shard,numShards> shards;
+		std::atomic<size_t> _size{0};
+
+		static uint64_t prefix(const record & r);
+		static shard & shardOf(std::array<shard,numShards> & shards,const record & r);
+		static size_t home(const shard & s,uint64_t prefix);
+		static size_t next(const shard & s,size_t a);
+		static size_t find(const shard & s,const record & key); //Slot of the key, or of the empty slot where it should go.
+		static void grow(shard & s);
+	public:
+		compactIndex();
+		compactIndex(const compactIndex&) = delete;
+
+		bucketIndex_t get(const crypto::sha256sum & sum); //Zero if not in the index.
+		void insert(const record & r);
+		bool insertIfAbsent(const record & r); //False if the sum is in the index already, that entry is kept.
+		void insert(const crypto::sha256sum & sum,const bucketIndex_t & location) { insert(dedupIndex::makeEntry(sum,location)); }
+		size_t erase(const crypto::sha256sum & sum);
+		void clear(void);
+
+		size_t size(void) { return _size.load(); }
+		size_t memoryUsage(void); //Bytes used by the tables.
+		std::vector<record> list(void);
+	};
+}
+
+#endif // FILESYSTEM_COMPACTINDEX_H
@@ -0,0 +1,103 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+/**
+ * Compression of chunks before they are sealed into packed bucket files.
+ *
+ * Every encoded chunk starts with its chunkCodec, so buckets can hold a mix of compressed & stored chunks
+ * and the codec setting can be changed between mounts.
+ */
+#include "compression.h"
+#include "modules/util/lz.h"
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+using namespace filesystem;
+
+namespace {
+	constexpr size_t maxSamples = 4096;
+	constexpr double maxEntropy = 7.5; //Bits per byte, above this the data is most likely compressed or encrypted already.
+	constexpr size_t minSaving = 64; //Bytes a compressed chunk should save to be worth the decompression.
+}
+
+chunkCodec filesystem::codecFromName(const str & name) {
+	if(name=="none") {
+		return chunkCodec::NONE;
+	}
+	if(name=="lz4") {
+		return chunkCodec::LZ;
+	}
+	throw std::invalid_argument(str("unknown compression codec "+name).c_str());
+}
+
+str filesystem::codecName(chunkCodec codec) {
+	switch(codec) {
+		case chunkCodec::NONE: return "none";
+		case chunkCodec::LZ: return "lz4";
+	}
+	return "unknown";
+}
+
+bool filesystem::looksCompressible(const unsigned char * data,size_t size) {
+	if(size==0) {
+		return false;
+	}
+	const size_t step = size > maxSamples ? size/maxSamples : 1;
+	std::array<uint32_t,256> histogram;
+	histogram.fill(0);
+	size_t samples = 0;
+	for(size_t a=0;a<size;a+=step) {
+		++histogram[data[a]];
+		++samples;
+	}
+	double entropy = 0;
+	for(auto h: histogram) {
+		if(h) {
+			const double p = double(h)/samples;
+			entropy -= p * std::log2(p);
+		}
+	}
+	return entropy < maxEntropy;
+}
+
+str filesystem::encodeChunk(const unsigned char * data,size_t size,chunkCodec codec) {
+	str ret;
+	if(codec==chunkCodec::LZ && looksCompressible(data,size)) {
+		ret.resize(1+size-minSaving);
+		const auto len = util::lz::compress(data,size,reinterpret_cast<uint8_t*>(&ret[1]),ret.size()-1);
+		if(len>0) {
+			ret[0] = (char)chunkCodec::LZ;
+			ret.resize(1+len);
+			return ret;
+		}
+	}
+	ret.resize(1+size);
+	ret[0] = (char)chunkCodec::NONE;
+	std::memcpy(&ret[1],data,size);
+	return ret;
+}
+
+void filesystem::decodeChunk(const unsigned char * in,size_t inSize,unsigned char * out,size_t outSize) {
+	if(inSize==0) {
+		throw std::out_of_range("decodeChunk: empty record");
+	}
+	size_t len = 0;
+	switch((chunkCodec)in[0]) {
+		case chunkCodec::NONE:
+			len = inSize-1;
+			if(len==outSize) {
+				std::memcpy(out,in+1,len);
+			}
+			break;
+		case chunkCodec::LZ:
+			len = util::lz::decompress(in+1,inSize-1,reinterpret_cast<uint8_t*>(out),outSize);
+			break;
+		default:
+			throw std::out_of_range("decodeChunk: unknown codec");
+	}
+	if(len!=outSize) {
+		throw std::out_of_range("decodeChunk: wrong size");
+	}
+}
@@ -0,0 +1,27 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_COMPRESSION_H
+#define FILESYSTEM_COMPRESSION_H
+
+#include "types.h"
+
+namespace filesystem {
+
+	/**
+	 * Codec of a single chunk record, stored as the first byte of the cleartext of the record.
+	 */
+	enum class chunkCodec: uint8_t {
+		NONE = 0,
+		LZ = 1,
+	};
+
+	chunkCodec codecFromName(const str & name); //"none" or "lz4", throws std::invalid_argument otherwise.
+	str codecName(chunkCodec codec);
+
+	bool looksCompressible(const unsigned char * data,size_t size); //Order-0 entropy estimate of (a sample of) the data.
+	str encodeChunk(const unsigned char * data,size_t size,chunkCodec codec); //Codec byte + payload, stored as NONE if compressing does not pay off.
+	void decodeChunk(const unsigned char * in,size_t inSize,unsigned char * out,size_t outSize); //Throws std::out_of_range if the result is not exactly outSize bytes.
+}
+
+#endif // FILESYSTEM_COMPRESSION_H
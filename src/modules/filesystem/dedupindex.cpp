@@ -0,0 +1,211 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+/**
+ * The dedup index file is a list of sealed parts, each preceded by its (uint32) length:
+ * a header with the version, generation & number of entries, followed by blocks of sorted entries.
+ * Every part is bound to its place in the file (and the blocks to the generation) by its additional data.
+ */
+#include "dedupindex.h"
+#include "storage.h"
+#include "modules/crypto/protocol.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace filesystem;
+
+namespace {
+	constexpr uint64_t formatVersion = 1;
+	constexpr uint64_t blockEntries = 65536;
+
+	struct indexHeader {
+		uint64_t version;
+		uint64_t generation;
+		uint64_t count;
+	};
+
+	str additionalData(uint64_t generation,uint64_t part) {
+		str ret = "dedupindex";
+		ret.append(reinterpret_cast<const char *>(&generation),sizeof(generation));
+		ret.append(reinterpret_cast<const char *>(&part),sizeof(part));
+		return ret;
+	}
+
+	bool lessThan(const dedupIndex::entry & a,const dedupIndex::entry & b) {
+		return std::memcmp(a.sum.data(),b.sum.data(),a.sum.size()) < 0;
+	}
+
+	void appendPart(str & out,crypto::protocolInterface * prot,const void * data,size_t size,const str & ad) {
+		str cipher;
+		prot->encrypt(prot->getEncryptionKey(),str(static_cast<const char *>(data),size),cipher,ad);
+		const uint32_t len = (uint32_t)cipher.size();
+		out.append(reinterpret_cast<const char *>(&len),sizeof(len));
+		out.append(cipher);
+	}
+
+	void openPart(const str & in,size_t & pos,crypto::protocolInterface * prot,void * out,size_t size,const str & ad) {
+		uint32_t len;
+		if(in.size()-pos < sizeof(len)) {
+			throw std::out_of_range("truncated dedup index");
+		}
+		std::memcpy(&len,in.data()+pos,sizeof(len));
+		pos += sizeof(len);
+		if(in.size()-pos < len) {
+			throw std::out_of_range("truncated dedup index");
+		}
+		const auto * record = reinterpret_cast<const unsigned char *>(in.data()+pos);
+		if(prot->decryptTo(prot->getEncryptionKey(),record,len,static_cast<unsigned char *>(out),size,ad)!=size) {
+			throw std::out_of_range("dedup index part has the wrong size");
+		}
+		pos += len;
+	}
+}
+
+dedupIndex::entry dedupIndex::makeEntry(const crypto::sha256sum & sum,const bucketIndex_t & location) {
+	entry ret;
+	static_assert(sizeof(sum)==sizeof(ret.sum),"sha256sum size mismatch");
+	std::memcpy(ret.sum.data(),&sum,ret.sum.size());
+	ret.location = location.fullindex();
+	return ret;
+}
+
+bool dedupIndex::store(const str & path,uint64_t generation,std::vector<entry> & entries,crypto::protocolInterface * prot) {
+	std::sort(entries.begin(),entries.end(),lessThan);
+	entries.erase(std::unique(entries.begin(),entries.end(),[](const entry & a,const entry & b) {
+		return std::memcmp(a.sum.data(),b.sum.data(),a.sum.size())==0;
+	}),entries.end());
+
+	str content;
+	const indexHeader header{formatVersion,generation,entries.size()};
+	appendPart(content,prot,&header,sizeof(header),additionalData(0,0));
+	uint64_t part = 1;
+	for(uint64_t first=0;first<entries.size();first+=blockEntries,++part) {
+		const auto num = std::min<uint64_t>(blockEntries,entries.size()-first);
+		appendPart(content,prot,&entries[first],num*sizeof(entry),additionalData(generation,part));
+	}
+	if(!STOR->io.replace(path,content)) {
+		STOR->srvERROR("Failed to write dedup index ",path);
+		return false;
+	}
+	STOR->srvMESSAGE("Stored dedup index with ",entries.size()," hashes, generation ",generation);
+	return true;
+}
+
+bool dedupIndex::load(const str & path,uint64_t generation,crypto::protocolInterface * prot) {
+	clear();
+	const auto content = STOR->io.read(path,0,0);
+	if(content.empty()) {
+		return false;
+	}
+	std::vector<entry> loaded;
+	try {
+		size_t pos = 0;
+		indexHeader header;
+		openPart(content,pos,prot,&header,sizeof(header),additionalData(0,0));
+		if(header.version!=formatVersion || header.generation!=generation) {
+			STOR->srvMESSAGE("Dedup index is generation ",header.generation,", the filesystem expects ",generation);
+			return false;
+		}
+		//Every entry takes more than 40 bytes in the file, a corrupt count can not make us allocate more than that.
+		if(header.count > content.size()/sizeof(entry)) {
+			throw std::out_of_range("dedup index has too many entries");
+		}
+		loaded.resize(header.count);
+		uint64_t part = 1;
+		for(uint64_t first=0;first<loaded.size();first+=blockEntries,++part) {
+			const auto num = std::min<uint64_t>(blockEntries,loaded.size()-first);
+			openPart(content,pos,prot,&loaded[first],num*sizeof(entry),additionalData(generation,part));
+		}
+		if(pos!=content.size()) {
+			throw std::out_of_range("trailing data after dedup index");
+		}
+		for(size_t a=1;a<loaded.size();a++) {
+			if(!lessThan(loaded[a-1],loaded[a])) {
+				throw std::out_of_range("dedup index is not sorted");
+			}
+		}
+	} catch(std::exception & e) {
+		STOR->srvERROR("Failed to load dedup index ",path,": ",e.what());
+		return false;
+	}
+	std::unique_lock<std::shared_mutex> l(_mut);
+	entries = std::move(loaded);
+	state.assign(entries.size(),entryState::ON_DISK);
+	unresolved = entries.size();
+	return true;
+}
+
+void dedupIndex::clear(void) {
+	std::unique_lock<std::shared_mutex> l(_mut);
+	entries.clear();
+	entries.shrink_to_fit();
+	state.clear();
+	state.shrink_to_fit();
+	unresolved = 0;
+}
+
+size_t dedupIndex::position(const crypto::sha256sum & sum) {
+	const auto key = makeEntry(sum,bucketIndex_t());
+	auto it = std::lower_bound(entries.begin(),entries.end(),key,lessThan);
+	if(it==entries.end() || lessThan(key,*it)) {
+		return entries.size();
+	}
+	return it-entries.begin();
+}
+
+bucketIndex_t dedupIndex::find(const crypto::sha256sum & sum) {
+	if(unresolved.load()==0) {
+		return bucketIndex_t();
+	}
+	std::shared_lock<std::shared_mutex> l(_mut);
+	const auto pos = position(sum);
+	if(pos==entries.size() || state[pos]!=entryState::ON_DISK) {
+		return bucketIndex_t();
+	}
+	return bucketIndex_t(entries[pos].location);
+}
+
+void dedupIndex::resolved(const crypto::sha256sum & sum) {
+	std::unique_lock<std::shared_mutex> l(_mut);
+	const auto pos = position(sum);
+	if(pos<entries.size() && state[pos]==entryState::ON_DISK) {
+		state[pos] = entryState::RESOLVED;
+		--unresolved;
+	}
+}
+
+bool dedupIndex::forget(const crypto::sha256sum & sum,const bucketIndex_t & location) {
+	if(unresolved.load()==0) {
+		return false;
+	}
+	std::unique_lock<std::shared_mutex> l(_mut);
+	const auto pos = position(sum);
+	if(pos==entries.size() || state[pos]!=entryState::ON_DISK || entries[pos].location!=location.fullindex()) {
+		return false;
+	}
+	state[pos] = entryState::FORGOTTEN;
+	--unresolved;
+	return true;
+}
+
+std::vector<uint64_t> dedupIndex::locations(void) {
+	std::shared_lock<std::shared_mutex> l(_mut);
+	std::vector<uint64_t> ret;
+	ret.reserve(entries.size());
+	for(const auto & e: entries) {
+		ret.push_back(e.location);
+	}
+	l.unlock();
+	std::sort(ret.begin(),ret.end());
+	return ret;
+}
+
+void dedupIndex::collect(std::vector<entry> & out) {
+	std::shared_lock<std::shared_mutex> l(_mut);
+	for(size_t a=0;a<entries.size();a++) {
+		if(state[a]==entryState::ON_DISK) {
+			out.push_back(entries[a]);
+		}
+	}
+}
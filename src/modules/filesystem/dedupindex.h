@@ -0,0 +1,67 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_DEDUPINDEX_H
+#define FILESYSTEM_DEDUPINDEX_H
+
+#include "types.h"
+#include "hash.h"
+#include <array>
+#include <atomic>
+#include <shared_mutex>
+#include <vector>
+
+namespace crypto {
+	class protocolInterface;
+}
+
+namespace filesystem {
+
+	/**
+	 * On disk copy of the dedup index of the data buckets (sha256sum -> bucketIndex_t), so a mount does not have
+	 * to decrypt the hashes of every data bucket.
+	 *
+	 * The index is written at unmount and is only valid for the generation recorded in the root metadata.
+	 * A mount that reads it removes the file, so after a crash the next mount falls back to loading every bucket.
+	 *
+	 * Entries are sorted on the sha256sum and resolved lazily: the hash itself is taken from its bucket the
+	 * first time the sum is looked up, after which it lives in the hashesIndex like any other hash.
+	 */
+	class dedupIndex {
+	public:
+		struct entry {
+			std::array<unsigned char,32> sum;
+			uint64_t location; //bucketIndex_t::fullindex()
+		};
+		static_assert(sizeof(entry)==40,"dedupIndex::entry needs to be 40 bytes");
+
+		static constexpr const char * filename = "dedup.idx";
+
+		static entry makeEntry(const crypto::sha256sum & sum,const bucketIndex_t & location);
+		static bool store(const str & path,uint64_t generation,std::vector<entry> & entries,crypto::protocolInterface * prot); //Sorts entries.
+
+	private:
+		enum class entryState: uint8_t { ON_DISK, RESOLVED, FORGOTTEN };
+
+		std::shared_mutex _mut;
+		std::vector<entry> entries;
+		std::vector<entryState> state;
+		std::atomic_uint64_t unresolved{0};
+
+		size_t position(const crypto::sha256sum & sum); //entries.size() if not found, call with lock.
+
+	public:
+		bool load(const str & path,uint64_t generation,crypto::protocolInterface * prot); //False if missing, corrupt or of another generation.
+		void clear(void);
+
+		bucketIndex_t find(const crypto::sha256sum & sum); //Zero if the sum is not (or no longer) in the index.
+		void resolved(const crypto::sha256sum & sum); //The hash has been moved into the hashesIndex.
+		bool forget(const crypto::sha256sum & sum,const bucketIndex_t & location); //The hash was deleted before it was resolved.
+
+		uint64_t numUnresolved(void) { return unresolved.load(); }
+		std::vector<uint64_t> locations(void); //Sorted locations of all entries.
+		void collect(std::vector<entry> & out); //Entries that are not resolved or forgotten.
+	};
+}
+
+#endif // FILESYSTEM_DEDUPINDEX_H
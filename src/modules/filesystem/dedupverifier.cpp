@@ -0,0 +1,128 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "dedupverifier.h"
+#include "storage.h"
+#include "chunk.h"
+#include "hash.h"
+#include "main.h"
+#include <stdexcept>
+
+using namespace filesystem;
+
+dedupVerifier::dedupVerifier() : maxBacklog((16*1024*1024)/chunkSize) {
+}
+
+dedupVerifier::~dedupVerifier() {
+	stop();
+}
+
+dedupVerifier::mode dedupVerifier::modeFromName(const str & name) {
+	if(name=="sync") {
+		return mode::SYNC;
+	}
+	if(name=="async") {
+		return mode::ASYNC;
+	}
+	throw std::invalid_argument(str("unknown dedup verification mode "+name).c_str());
+}
+
+const char * dedupVerifier::modeName(mode m) {
+	return m==mode::ASYNC ? "async" : "sync";
+}
+
+void dedupVerifier::setMode(mode m) {
+	std::unique_lock<std::mutex> l(_mut);
+	_mode = m;
+	if(m==mode::ASYNC && !worker.joinable()) {
+		stopping = false;
+		worker = std::thread([this]() { run(); });
+	}
+}
+
+bool dedupVerifier::check(const pending & p) {
+	auto stored = p.existing->data();
+	if(!stored) {
+		++skipped;
+		return true;
+	}
+	if(stored->compareChunk(p.written)) {
+		return true;
+	}
+	//The hash may have been deleted after the hit & its slot reused, that is only a collision while the slot still holds the same sum.
+	if(!(stored->getHash()==p.existing->getHashPrimitive())) {
+		++skipped;
+		return true;
+	}
+	++collisions;
+	STOR->srvERROR("HASH COLLISION in hash: ",p.existing->getHashStr()," at ",p.existing->getBucketIndex().toString(),", later hits on it are verified inline");
+	std::unique_lock<std::mutex> l(_mut);
+	quarantine.insert(p.existing->getHashPrimitive());
+	return false;
+}
+
+bool dedupVerifier::isQuarantined(const crypto::sha256sum & sum) {
+	std::unique_lock<std::mutex> l(_mut);
+	return quarantine.count(sum)>0;
+}
+
+void dedupVerifier::verify(std::shared_ptr<hash> existing,std::shared_ptr<chunk> written) {
+	if(_mode.load()==mode::ASYNC && !isQuarantined(existing->getHashPrimitive())) {
+		std::unique_lock<std::mutex> l(_mut);
+		if(!stopping && backlog.size()<maxBacklog) {
+			backlog.push_back({existing,written});
+			_cv.notify_one();
+			return;
+		}
+	}
+	++verifiedInline;
+	check({existing,written});
+}
+
+size_t dedupVerifier::backlogSize(void) {
+	std::unique_lock<std::mutex> l(_mut);
+	return backlog.size();
+}
+
+void dedupVerifier::run(void) {
+	typedef std::chrono::steady_clock clock;
+	const auto interval = std::chrono::microseconds(1000000/verifiesPerSecond);
+	auto next = clock::now();
+	for(;;) {
+		pending p;
+		bool drain;
+		{
+			std::unique_lock<std::mutex> l(_mut);
+			_cv.wait(l,[this]() { return stopping || !backlog.empty(); });
+			if(backlog.empty()) {
+				return;
+			}
+			p = std::move(backlog.front());
+			backlog.pop_front();
+			drain = stopping;
+		}
+		if(!drain) { //Rate limited, except for what is left at unmount.
+			next = std::max(next,clock::now());
+			std::this_thread::sleep_until(next);
+			next += interval;
+		}
+		try{
+			check(p);
+			++verifiedAsync;
+		} catch(std::exception & e) {
+			++skipped;
+			STOR->srvWARNING("dedupVerifier: could not verify ",p.existing->getHashStr(),": ",e.what());
+		}
+	}
+}
+
+void dedupVerifier::stop(void) {
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		stopping = true;
+		_cv.notify_all();
+	}
+	if(worker.joinable()) {
+		worker.join();
+	}
+}
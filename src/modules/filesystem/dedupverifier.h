@@ -0,0 +1,68 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_DEDUPVERIFIER_H
+#define FILESYSTEM_DEDUPVERIFIER_H
+
+#include "types.h"
+#include "modules/crypto/sha256.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace filesystem {
+	class chunk;
+	class hash;
+
+	/**
+	 * Byte for byte check of dedup hits: the chunk that was written against the chunk that is already stored under the same sha256.
+	 *
+	 * In SYNC mode the stored chunk is compared inside the write, which may have to load & decrypt its bucket.
+	 * In ASYNC mode the write trusts the sha256 and the pair is queued for a background thread, which verifies at most
+	 * verifiesPerSecond pairs a second. When the backlog is full the write verifies inline again.
+	 * A collision is logged & its sum is quarantined: every later hit on that sum is verified inline.
+	 */
+	class dedupVerifier {
+	public:
+		enum class mode { SYNC, ASYNC };
+	private:
+		struct pending {
+			std::shared_ptr<hash> existing;
+			std::shared_ptr<chunk> written;
+		};
+		std::atomic<mode> _mode{mode::SYNC};
+		std::mutex _mut;
+		std::condition_variable _cv;
+		std::deque<pending> backlog;
+		std::set<crypto::sha256sum> quarantine;
+		bool stopping = false;
+		std::thread worker;
+		size_t maxBacklog;
+		unsigned verifiesPerSecond = 2000;
+
+		bool check(const pending & p); //False on a real collision.
+		bool isQuarantined(const crypto::sha256sum & sum);
+		void run(void);
+	public:
+		std::atomic_uint64_t verifiedInline{0},verifiedAsync{0},skipped{0},collisions{0};
+
+		dedupVerifier();
+		dedupVerifier(const dedupVerifier&) = delete;
+		~dedupVerifier();
+
+		void setMode(mode m);
+		mode getMode(void) { return _mode.load(); }
+		static mode modeFromName(const str & name); //"sync" or "async"
+		static const char * modeName(mode m);
+
+		void verify(std::shared_ptr<hash> existing,std::shared_ptr<chunk> written); //Called on every dedup hit.
+		size_t backlogSize(void);
+		void stop(void); //Verifies what is left in the backlog & ends the worker.
+	};
+}
+
+#endif // FILESYSTEM_DEDUPVERIFIER_H
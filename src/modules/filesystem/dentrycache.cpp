@@ -0,0 +1,203 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "dentrycache.h"
+#include "modules/util/buildstring.h"
+#include <string_view>
+#include <cstring>
+
+using namespace filesystem;
+
+dentryCache::dentryCache(size_t icapacity) : capacity(icapacity) {
+	size_t n = 1;
+	while(n<capacity) {
+		n <<= 1;
+	}
+	table.assign(n,nullptr);
+}
+
+dentryCache::~dentryCache() {
+	clear();
+}
+
+uint64_t dentryCache::hashOf(uint64_t parent,const char * name,size_t len) {
+	uint64_t h = std::hash<std::string_view>{}(std::string_view(name,len)) ^ (parent * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+dentryCache::entry * dentryCache::find(uint64_t parent,const char * name,size_t len,uint64_t h) {
+	for(entry * e = table[h & (table.size()-1)];e!=nullptr;e = e->hashNext) {
+		if(e->hash==h && e->parent==parent && e->name.size()==len && memcmp(e->name.data(),name,len)==0) {
+			return e;
+		}
+	}
+	return nullptr;
+}
+
+void dentryCache::touch(entry * e) {
+	if(e==lruHead) {
+		return;
+	}
+	//Unlink
+	e->lruPrev->lruNext = e->lruNext;
+	if(e->lruNext) {
+		e->lruNext->lruPrev = e->lruPrev;
+	} else {
+		lruTail = e->lruPrev;
+	}
+	//Push front
+	e->lruPrev = nullptr;
+	e->lruNext = lruHead;
+	lruHead->lruPrev = e;
+	lruHead = e;
+}
+
+void dentryCache::remove(entry * e) {
+	entry ** slot = &table[e->hash & (table.size()-1)];
+	while(*slot!=e) {
+		slot = &(*slot)->hashNext;
+	}
+	*slot = e->hashNext;
+
+	if(e->lruPrev) {
+		e->lruPrev->lruNext = e->lruNext;
+	} else {
+		lruHead = e->lruNext;
+	}
+	if(e->lruNext) {
+		e->lruNext->lruPrev = e->lruPrev;
+	} else {
+		lruTail = e->lruPrev;
+	}
+
+	if(e->siblingNext) {
+		e->siblingNext->siblingPrev = e->siblingPrev;
+	}
+	if(e->siblingPrev) {
+		e->siblingPrev->siblingNext = e->siblingNext;
+	} else if(e->siblingNext) {
+		children[e->parent] = e->siblingNext;
+	} else {
+		children.erase(e->parent);
+	}
+
+	delete e;
+	--count;
+}
+
+void dentryCache::store(uint64_t parent,const str & name,uint64_t ino,bool isDir) {
+	const uint64_t h = hashOf(parent,name.data(),name.size());
+	if(entry * e = find(parent,name.data(),name.size(),h)) {
+		e->ino = ino;
+		e->isDir = ino!=0 && isDir;
+		touch(e);
+		return;
+	}
+
+	entry * e = new entry{parent,name,h,ino,ino!=0 && isDir,nullptr,nullptr,nullptr,nullptr,nullptr};
+	entry *& slot = table[h & (table.size()-1)];
+	e->hashNext = slot;
+	slot = e;
+
+	e->lruNext = lruHead;
+	if(lruHead) {
+		lruHead->lruPrev = e;
+	} else {
+		lruTail = e;
+	}
+	lruHead = e;
+
+	entry *& first = children[parent];
+	e->siblingNext = first;
+	if(first) {
+		first->siblingPrev = e;
+	}
+	first = e;
+
+	++count;
+	while(count>capacity) {
+		remove(lruTail);
+		++evictions;
+	}
+}
+
+dentryCache::result dentryCache::lookup(uint64_t parent,const char * name,size_t len,uint64_t & ino,bool & isDir) {
+	const uint64_t h = hashOf(parent,name,len);
+	std::unique_lock<std::mutex> l(_mut);
+	entry * e = find(parent,name,len,h);
+	if(e==nullptr) {
+		++misses;
+		return result::MISS;
+	}
+	touch(e);
+	if(e->ino==0) {
+		++negativeHits;
+		return result::NEGATIVE;
+	}
+	++hits;
+	ino = e->ino;
+	isDir = e->isDir;
+	return result::POSITIVE;
+}
+
+void dentryCache::insert(uint64_t parent,const str & name,uint64_t ino,bool isDir,uint64_t seen) {
+	std::unique_lock<std::mutex> l(_mut);
+	if(generation(parent)!=seen) {
+		return; //The directory may have changed after it was read.
+	}
+	store(parent,name,ino,isDir);
+}
+
+void dentryCache::set(uint64_t parent,const str & name,uint64_t ino,bool isDir) {
+	std::unique_lock<std::mutex> l(_mut);
+	++gens[genSlot(parent)];
+	store(parent,name,ino,isDir);
+}
+
+void dentryCache::forget(uint64_t parent,const char * name,size_t len) {
+	const uint64_t h = hashOf(parent,name,len);
+	std::unique_lock<std::mutex> l(_mut);
+	++gens[genSlot(parent)];
+	if(entry * e = find(parent,name,len,h)) {
+		remove(e);
+	}
+}
+
+void dentryCache::invalidateSubtree(uint64_t dir) {
+	std::unique_lock<std::mutex> l(_mut);
+	++epoch; //Also the directories below it that have no entries cached.
+	std::vector<uint64_t> todo{dir};
+	while(!todo.empty()) {
+		const uint64_t d = todo.back();
+		todo.pop_back();
+		auto itr = children.find(d);
+		while(itr!=children.end()) {
+			entry * e = itr->second;
+			if(e->isDir) {
+				todo.push_back(e->ino);
+			}
+			remove(e); //Erases the children entry of d after its last entry, so look it up again.
+			itr = children.find(d);
+		}
+	}
+}
+
+void dentryCache::clear(void) {
+	std::unique_lock<std::mutex> l(_mut);
+	++epoch;
+	while(lruHead) {
+		remove(lruHead);
+	}
+}
+
+str dentryCache::getStats(void) {
+	size_t n;
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		n = count;
+	}
+	return BUILDSTRING("Dentries: ",n,"/",capacity," hits: ",hits.load()," negative hits: ",negativeHits.load()," misses: ",misses.load()," evictions: ",evictions.load(),"\n");
+}
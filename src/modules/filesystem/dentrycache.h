@@ -0,0 +1,77 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_DENTRYCACHE_H
+#define FILESYSTEM_DENTRYCACHE_H
+
+#include "types.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+namespace filesystem {
+
+	/**
+	 * Directory entries keyed by (parent inode, name), so a path resolves with one probe per component and
+	 * a rename or unlink only touches the entries of the names it changes. Names known to be absent are kept as
+	 * negative entries. The least recently used entries are evicted beyond capacity.
+	 *
+	 * The directories keep the cache up to date when they change (set/forget). A lookup that missed reads the
+	 * directory itself & passes the generation of that parent it saw before doing so to insert, which drops the
+	 * result if the directory changed in between. The generations are counted per hashed parent slot, so a busy
+	 * directory does not make the lookups in every other directory fail to cache; dropping subtrees & clear bump
+	 * an epoch shared by all.
+	 */
+	class dentryCache final{
+	public:
+		enum class result { MISS, POSITIVE, NEGATIVE };
+		static constexpr size_t defaultCapacity = 65536;
+		static constexpr size_t genSlots = 4096;
+
+		dentryCache(size_t icapacity = defaultCapacity);
+		~dentryCache();
+		dentryCache(const dentryCache&) = delete;
+
+		result lookup(uint64_t parent,const char * name,size_t len,uint64_t & ino,bool & isDir);
+		uint64_t generation(uint64_t parent) { return epoch.load() + gens[genSlot(parent)].load(); } //Both only grow, so the sum changes when either does.
+		void insert(uint64_t parent,const str & name,uint64_t ino,bool isDir,uint64_t seen); //ino 0: negative
+		void set(uint64_t parent,const str & name,uint64_t ino,bool isDir); //The directory changed, ino 0: negative
+		void forget(uint64_t parent,const char * name,size_t len);
+		void invalidateSubtree(uint64_t dir); //Every entry below dir, for when it is gone & its inode may be reused.
+		void clear(void);
+		str getStats(void);
+
+		std::atomic_uint64_t hits{0},negativeHits{0},misses{0},evictions{0};
+
+	private:
+		struct entry{
+			uint64_t parent;
+			str name;
+			uint64_t hash;
+			uint64_t ino;
+			bool isDir;
+			entry * hashNext;
+			entry * lruPrev, * lruNext; //lruHead is the most recently used
+			entry * siblingPrev, * siblingNext; //The entries with the same parent
+		};
+		std::mutex _mut;
+		std::vector<entry *> table; //Chained, a power of 2 in size
+		std::unordered_map<uint64_t,entry *> children; //First entry per parent
+		entry * lruHead = nullptr, * lruTail = nullptr;
+		size_t count = 0;
+		const size_t capacity;
+		std::atomic_uint64_t epoch{0};
+		std::atomic_uint64_t gens[genSlots] = {};
+
+		static size_t genSlot(uint64_t parent) { return (parent * 0x9e3779b97f4a7c15ULL) >> 52; } //genSlots is 2^12
+		static uint64_t hashOf(uint64_t parent,const char * name,size_t len);
+		entry * find(uint64_t parent,const char * name,size_t len,uint64_t h);
+		void store(uint64_t parent,const str & name,uint64_t ino,bool isDir);
+		void touch(entry * e);
+		void remove(entry * e);
+	};
+
+}
+
+#endif // FILESYSTEM_DENTRYCACHE_H
@@ -0,0 +1,349 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "directory.h"
+#include "main.h"
+#include <sodium.h>
+#include <cstring>
+#include <algorithm>
+
+using namespace filesystem;
+
+namespace {
+	const char dirMagic[8] = {'C','C','F','S','H','D','I','R'};
+	constexpr uint32_t dirVersion = 1;
+	constexpr uint32_t maxGlobalDepth = 24; //A table of 64MB, far beyond the bucket blocks a filesystem this size holds.
+}
+
+static_assert(crypto_shorthash_BYTES==sizeof(uint64_t),"the directory hash is 64 bits");
+static_assert(crypto_shorthash_KEYBYTES==16,"the directory hash key is 16 bytes");
+
+bool hashedDirectory::isHashed(const str & content) {
+	return content.size()>=sizeof(dirMagic) && memcmp(content.data(),dirMagic,sizeof(dirMagic))==0;
+}
+
+str * hashedDirectory::block(uint64_t idx) {
+	auto it = blocks.find(idx);
+	if(it==blocks.end()) {
+		str b;
+		if(!readBlock(idx,b) || b.size()!=chunkSize) {
+			return nullptr;
+		}
+		it = blocks.emplace(idx,std::move(b)).first;
+	}
+	return &it->second;
+}
+
+bool hashedDirectory::store(uint64_t idx) {
+	auto it = blocks.find(idx);
+	_ASSERT(it!=blocks.end());
+	return writeBlock(idx,it->second);
+}
+
+bool hashedDirectory::loadHeader(void) {
+	if(loaded) {
+		return true;
+	}
+	auto b = block(0);
+	if(b==nullptr || !isHashed(*b)) {
+		return false;
+	}
+	memcpy(&H,b->data(),sizeof(H));
+	loaded = H.version==dirVersion && H.globalDepth<=maxGlobalDepth;
+	return loaded;
+}
+
+bool hashedDirectory::storeHeader(void) {
+	auto & b = blocks[0];
+	b.resize(chunkSize);
+	memcpy(&b[0],&H,sizeof(H));
+	return store(0);
+}
+
+uint64_t hashedDirectory::hashOf(const str & name) const {
+	uint64_t ret;
+	crypto_shorthash(reinterpret_cast<unsigned char *>(&ret),reinterpret_cast<const unsigned char *>(name.data()),name.size(),H.hashKey);
+	return ret;
+}
+
+bool hashedDirectory::pointer(uint64_t slot,uint32_t & out) {
+	auto b = block(H.tableBlock + slot/pointersPerBlock);
+	if(b==nullptr) {
+		return false;
+	}
+	memcpy(&out,b->data()+(slot%pointersPerBlock)*sizeof(uint32_t),sizeof(uint32_t));
+	return out>0 && out<H.numBlocks;
+}
+
+bool hashedDirectory::setPointer(uint64_t slot,uint32_t value,std::vector<uint64_t> & dirty) {
+	const auto idx = H.tableBlock + slot/pointersPerBlock;
+	auto b = block(idx);
+	if(b==nullptr) {
+		return false;
+	}
+	memcpy(&(*b)[(slot%pointersPerBlock)*sizeof(uint32_t)],&value,sizeof(uint32_t));
+	if(std::find(dirty.begin(),dirty.end(),idx)==dirty.end()) {
+		dirty.push_back(idx);
+	}
+	return true;
+}
+
+bool hashedDirectory::bucketFor(uint64_t h,uint32_t & out) {
+	return pointer(h & ((uint64_t(1) << H.globalDepth)-1),out);
+}
+
+size_t hashedDirectory::findIn(const str & b,const str & name) {
+	bucketHeader bh;
+	memcpy(&bh,b.data(),sizeof(bh));
+	size_t offset = sizeof(bh);
+	const size_t end = std::min<size_t>(sizeof(bh)+bh.used,b.size());
+	while(offset+entryOverhead<=end) {
+		uint16_t len;
+		memcpy(&len,b.data()+offset+sizeof(uint64_t),sizeof(len));
+		if(len==name.size() && offset+entryOverhead+len<=end && memcmp(b.data()+offset+entryOverhead,name.data(),len)==0) {
+			return offset;
+		}
+		offset += entryOverhead+len;
+	}
+	return 0;
+}
+
+bool hashedDirectory::create(void) {
+	blocks.clear();
+	memset(&H,0,sizeof(H));
+	memcpy(H.magic,dirMagic,sizeof(dirMagic));
+	H.version = dirVersion;
+	H.globalDepth = 0;
+	H.tableBlock = 1;
+	H.numBlocks = 3;
+	randombytes_buf(H.hashKey,sizeof(H.hashKey)); //Names can not be picked to fill one bucket.
+	loaded = true;
+
+	blocks[1] = str(chunkSize,'\0');
+	const uint32_t first = 2;
+	memcpy(&blocks[1][0],&first,sizeof(first));
+	blocks[2] = str(chunkSize,'\0'); //An empty bucket with localDepth 0.
+	return store(2) && store(1) && storeHeader();
+}
+
+uint64_t hashedDirectory::numBlocks(void) {
+	return loadHeader() ? H.numBlocks : 0;
+}
+
+bool hashedDirectory::find(const str & name,uint64_t * id) {
+	uint32_t bi;
+	if(!loadHeader() || !bucketFor(hashOf(name),bi)) {
+		return false;
+	}
+	auto b = block(bi);
+	if(b==nullptr) {
+		return false;
+	}
+	const auto offset = findIn(*b,name);
+	if(offset==0) {
+		return false;
+	}
+	if(id) {
+		memcpy(id,b->data()+offset,sizeof(uint64_t));
+	}
+	return true;
+}
+
+hashedDirectory::result hashedDirectory::insert(const str & name,uint64_t id) {
+	const size_t need = entryOverhead+name.size();
+	if(name.empty() || sizeof(bucketHeader)+need>chunkSize || !loadHeader()) {
+		return result::FAILED;
+	}
+	const auto h = hashOf(name);
+	for(;;) {
+		uint32_t bi;
+		str * b;
+		if(!bucketFor(h,bi) || (b = block(bi))==nullptr) {
+			return result::FAILED;
+		}
+		if(findIn(*b,name)) {
+			return result::EXISTS;
+		}
+		bucketHeader bh;
+		memcpy(&bh,b->data(),sizeof(bh));
+		if(sizeof(bh)+bh.used+need<=chunkSize) {
+			const uint16_t len = name.size();
+			char * p = &(*b)[sizeof(bh)+bh.used];
+			memcpy(p,&id,sizeof(id));
+			memcpy(p+sizeof(id),&len,sizeof(len));
+			memcpy(p+entryOverhead,name.data(),len);
+			bh.used += need;
+			memcpy(&(*b)[0],&bh,sizeof(bh));
+			return store(bi) ? result::OK : result::FAILED;
+		}
+		if(!split(h)) {
+			return result::FAILED;
+		}
+	}
+}
+
+hashedDirectory::result hashedDirectory::erase(const str & name) {
+	uint32_t bi;
+	str * b;
+	if(!loadHeader() || !bucketFor(hashOf(name),bi) || (b = block(bi))==nullptr) {
+		return result::FAILED;
+	}
+	const auto offset = findIn(*b,name);
+	if(offset==0) {
+		return result::NOT_FOUND;
+	}
+	bucketHeader bh;
+	memcpy(&bh,b->data(),sizeof(bh));
+	const size_t size = entryOverhead+name.size();
+	b->erase(offset,size);
+	b->append(size,'\0');
+	bh.used -= size;
+	memcpy(&(*b)[0],&bh,sizeof(bh));
+	return store(bi) ? result::OK : result::FAILED;
+}
+
+bool hashedDirectory::forEach(const std::function<bool(const str & name,uint64_t id)> & fn) {
+	if(!loadHeader()) {
+		return false;
+	}
+	//Every block but the header & the table is a bucket, tables that were moved are zeroed & read as empty buckets.
+	const auto tableEnd = H.tableBlock + tableBlocks(H.globalDepth);
+	for(uint64_t idx=1;idx<H.numBlocks;idx++) {
+		if(idx>=H.tableBlock && idx<tableEnd) {
+			continue;
+		}
+		str b;
+		if(!readBlock(idx,b) || b.size()!=chunkSize) {
+			return false;
+		}
+		bucketHeader bh;
+		memcpy(&bh,b.data(),sizeof(bh));
+		size_t offset = sizeof(bh);
+		const size_t end = std::min<size_t>(sizeof(bh)+bh.used,b.size());
+		while(offset+entryOverhead<=end) {
+			uint64_t id;
+			uint16_t len;
+			memcpy(&id,b.data()+offset,sizeof(id));
+			memcpy(&len,b.data()+offset+sizeof(id),sizeof(len));
+			if(offset+entryOverhead+len>end) {
+				return false;
+			}
+			if(!fn(b.substr(offset+entryOverhead,len),id)) {
+				return true;
+			}
+			offset += entryOverhead+len;
+		}
+	}
+	return true;
+}
+
+bool hashedDirectory::doubleTable(void) {
+	if(H.globalDepth>=maxGlobalDepth) {
+		return false;
+	}
+	const uint64_t oldN = uint64_t(1) << H.globalDepth;
+	std::vector<uint64_t> dirty;
+	if(tableBlocks(H.globalDepth+1)==tableBlocks(H.globalDepth)) {
+		//The table still fits its blocks, the new half points where the old half does.
+		for(uint64_t s=0;s<oldN;s++) {
+			uint32_t p;
+			if(!pointer(s,p) || !setPointer(oldN+s,p,dirty)) {
+				return false;
+			}
+		}
+	} else {
+		//The table moves to the end, the old blocks are zeroed so they cost no storage.
+		std::vector<uint32_t> old(oldN);
+		for(uint64_t s=0;s<oldN;s++) {
+			if(!pointer(s,old[s])) {
+				return false;
+			}
+		}
+		const auto oldStart = H.tableBlock;
+		const auto oldBlocks = tableBlocks(H.globalDepth);
+		H.tableBlock = H.numBlocks;
+		H.numBlocks += tableBlocks(H.globalDepth+1);
+		for(uint64_t idx=H.tableBlock;idx<H.numBlocks;idx++) {
+			blocks[idx] = str(chunkSize,'\0');
+		}
+		for(uint64_t s=0;s<2*oldN;s++) {
+			if(!setPointer(s,old[s%oldN],dirty)) {
+				return false;
+			}
+		}
+		for(uint64_t idx=oldStart;idx<oldStart+oldBlocks;idx++) {
+			blocks[idx] = str(chunkSize,'\0');
+			dirty.push_back(idx);
+		}
+	}
+	++H.globalDepth;
+	for(auto idx: dirty) {
+		if(!store(idx)) {
+			return false;
+		}
+	}
+	return storeHeader();
+}
+
+bool hashedDirectory::split(uint64_t h) {
+	uint32_t bi;
+	str * b;
+	if(!bucketFor(h,bi) || (b = block(bi))==nullptr) {
+		return false;
+	}
+	bucketHeader bh;
+	memcpy(&bh,b->data(),sizeof(bh));
+	if(bh.localDepth>H.globalDepth) {
+		return false;
+	}
+	if(bh.localDepth==H.globalDepth) {
+		if(!doubleTable()) {
+			return false;
+		}
+		b = block(bi);
+	}
+	const auto d = bh.localDepth;
+	const uint32_t ni = H.numBlocks++;
+	str lower(chunkSize,'\0'),upper(chunkSize,'\0');
+	bucketHeader lh{0,d+1},uh{0,d+1};
+	size_t offset = sizeof(bh);
+	const size_t end = std::min<size_t>(sizeof(bh)+bh.used,b->size());
+	while(offset+entryOverhead<=end) {
+		uint16_t len;
+		memcpy(&len,b->data()+offset+sizeof(uint64_t),sizeof(len));
+		const size_t size = entryOverhead+len;
+		if(offset+size>end) {
+			return false;
+		}
+		const str name = b->substr(offset+entryOverhead,len);
+		const bool up = (hashOf(name) >> d) & 1;
+		auto & target = up ? upper : lower;
+		auto & th = up ? uh : lh;
+		memcpy(&target[sizeof(th)+th.used],b->data()+offset,size);
+		th.used += size;
+		offset += size;
+	}
+	memcpy(&lower[0],&lh,sizeof(lh));
+	memcpy(&upper[0],&uh,sizeof(uh));
+	blocks[bi] = std::move(lower);
+	blocks[ni] = std::move(upper);
+
+	//Every slot that ends in the bits of the old bucket & has bit d set moves to the new bucket.
+	std::vector<uint64_t> dirty;
+	const uint64_t low = h & ((uint64_t(1) << d)-1);
+	for(uint64_t s = low | (uint64_t(1) << d);s<(uint64_t(1) << H.globalDepth);s+=uint64_t(1) << (d+1)) {
+		if(!setPointer(s,ni,dirty)) {
+			return false;
+		}
+	}
+	//The new bucket is written before anything points to it.
+	if(!store(ni) || !store(bi)) {
+		return false;
+	}
+	for(auto idx: dirty) {
+		if(!store(idx)) {
+			return false;
+		}
+	}
+	return storeHeader();
+}
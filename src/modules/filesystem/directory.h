@@ -0,0 +1,77 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_DIRECTORY_H
+#define FILESYSTEM_DIRECTORY_H
+
+#include "types.h"
+#include "chunk.h"
+#include <functional>
+#include <unordered_map>
+
+namespace filesystem {
+
+	/**
+	 * Directory content as an extendible hash of chunk sized blocks, so a lookup reads 3 blocks & a change writes
+	 * the one bucket it lands in (a split writes the new bucket & the table blocks that point to it as well).
+	 *
+	 * Block 0 holds the header, the table of 2^globalDepth bucket block numbers follows at tableBlock. A bucket
+	 * holds entries (uint64_t id, uint16_t name length, name) of the names whose keyed hash ends in its localDepth bits.
+	 * Buckets are not merged when they get empty, a directory does not shrink.
+	 */
+	class hashedDirectory final{
+	public:
+		typedef std::function<bool(uint64_t block,str & out)> readBlock_t; //False when the block does not exist.
+		typedef std::function<bool(uint64_t block,const str & in)> writeBlock_t;
+		enum class result { OK, EXISTS, NOT_FOUND, FAILED };
+
+		hashedDirectory(readBlock_t iread,writeBlock_t iwrite) : readBlock(iread), writeBlock(iwrite) {}
+
+		static bool isHashed(const str & content); //The content starts with the header of this format.
+
+		bool create(void); //Writes an empty directory.
+		bool find(const str & name,uint64_t * id = nullptr);
+		result insert(const str & name,uint64_t id);
+		result erase(const str & name);
+		bool forEach(const std::function<bool(const str & name,uint64_t id)> & fn); //Until fn returns false. False if a block failed to load.
+		uint64_t numBlocks(void);
+
+	private:
+		struct header{
+			char magic[8];
+			uint32_t version;
+			uint32_t globalDepth;
+			uint64_t numBlocks;
+			uint64_t tableBlock;
+			uint8_t hashKey[16];
+		};
+		struct bucketHeader{
+			uint32_t used; //Bytes of entries behind the header.
+			uint32_t localDepth;
+		};
+		static constexpr size_t entryOverhead = sizeof(uint64_t)+sizeof(uint16_t);
+		static constexpr size_t pointersPerBlock = chunkSize/sizeof(uint32_t);
+
+		readBlock_t readBlock;
+		writeBlock_t writeBlock;
+		std::unordered_map<uint64_t,str> blocks; //Read or written during this operation.
+		header H;
+		bool loaded = false;
+
+		str * block(uint64_t idx);
+		bool store(uint64_t idx);
+		bool loadHeader(void);
+		bool storeHeader(void);
+		uint64_t hashOf(const str & name) const;
+		uint64_t tableBlocks(uint32_t depth) const { return ((uint64_t(1) << depth) + pointersPerBlock - 1) / pointersPerBlock; }
+		bool pointer(uint64_t slot,uint32_t & out);
+		bool setPointer(uint64_t slot,uint32_t value,std::vector<uint64_t> & dirty);
+		bool bucketFor(uint64_t h,uint32_t & out);
+		size_t findIn(const str & b,const str & name); //Offset of the entry, 0 when not there.
+		bool doubleTable(void);
+		bool split(uint64_t h);
+	};
+
+}
+
+#endif // FILESYSTEM_DIRECTORY_H
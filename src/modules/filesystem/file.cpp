@@ -14,6 +14,8 @@
 #include "hash.h"
 #include "chunk.h"
 #include "bucket.h"
+#include "bucketaccounting.h"
+#include "readahead.h"
 #include "main.h"
 #include "mode.h"
 #include "modules/util/str.h"
@@ -33,6 +35,8 @@
  */
 		
 #include <mutex>
+#include <map>
+#include <cstring>
 
 using namespace filesystem;
 using namespace script::SLT;
@@ -54,8 +58,7 @@ file::file(specialFile intype):  extraMeta(script::make_json()), metaChunk(chunk
 	_type = intype;
 	refs.store(0); 
 	isDeleted.store(false);
-	numHashWrites.store(0); 
-	numHashReads.store(0);
+	changedSinceRest.store(false);
 	loadHashes();
 }
 
@@ -64,8 +67,7 @@ file::file(std::shared_ptr<chunk> imeta, const str & ipath, const std::vector<pe
 	loadHashes();
 	refs.store(0); 
 	isDeleted.store(false);
-	numHashWrites.store(0); 
-	numHashReads.store(0);
+	changedSinceRest.store(false);
 	
 	_ASSERT(INode()->nlinks.is_lock_free());
 	
@@ -153,6 +155,12 @@ void file::setMetaProperty(const str & propertyname,script::JSONPtr in) {
 	extraMeta->set(propertyname,in);
 }
 
+void file::setMetaProperty(const str & propertyname,script::int_t in) {
+	if(!valid())return;
+	lckunique l(_mut); // Need lock to protect extraMeta variable
+	(*extraMeta)[propertyname] = in;
+}
+
 
 
 
@@ -336,6 +344,23 @@ my_err_t file::addNode(const str & name,shared_ptr<chunk> nodeMeta,bool force,co
 		return EE::access_denied;
 	}
 	lckunique l(_mut);
+	if(isHashedDir()) {
+		lckshared _dirs(FS->directoryWrites); //An insert may split a block & double the table, several writes.
+		_ASSERT(nodeMeta->as<inode>()->myID);
+		FS->srvDEBUG("Adding node ",name," to ",path," ino: ",nodeMeta->as<inode>()->myID, " mode:",nodeMeta->as<inode>()->mode.load());
+		switch(dirBlocks(je).insert(name,(uint64_t)nodeMeta->as<inode>()->myID)) {
+			case hashedDirectory::result::OK:
+				break;
+			case hashedDirectory::result::EXISTS:
+				return EE::exists;
+			default:
+				return EE::io_error;
+		}
+		rest();
+		INode()->ctime = currentTime();
+		FS->dentries.set((uint64_t)INode()->myID,name,(uint64_t)nodeMeta->as<inode>()->myID,nodeMeta->as<inode>()->mode.type()==mode::TYPE_DIR);
+		return EE::ok;
+	}
 	auto directory = script::make_json();
 	if(!readDirectoryContent(directory)) {
 		return EE::permission_denied;
@@ -350,11 +375,11 @@ my_err_t file::addNode(const str & name,shared_ptr<chunk> nodeMeta,bool force,co
 	
 	FS->srvDEBUG("Adding node ",name," to ",path," ino: ",nodeMeta->as<inode>()->myID, " mode:",nodeMeta->as<inode>()->mode.load());
 	(*directory)[name] = (uint64_t)nodeMeta->as<inode>()->myID;
-	if(!writeDirectoryContent(directory,je)) {
+	if(!(FS->getHashedDirectories() ? migrateDirectory(directory,je) : writeDirectoryContent(directory,je))) {
 		return EE::io_error;
 	}
 	INode()->ctime = currentTime();
-	
+	FS->dentries.set((uint64_t)INode()->myID,name,(uint64_t)nodeMeta->as<inode>()->myID,nodeMeta->as<inode>()->mode.type()==mode::TYPE_DIR);
 	
 	return EE::ok;
 }
@@ -366,6 +391,21 @@ my_err_t file::removeNode(const str & name,const context * ctx,std::shared_ptr<j
 		return EE::access_denied;
 	}
 	lckunique l(_mut);
+	if(isHashedDir()) {
+		lckshared _dirs(FS->directoryWrites);
+		switch(dirBlocks(je).erase(name)) {
+			case hashedDirectory::result::OK:
+				break;
+			case hashedDirectory::result::NOT_FOUND:
+				return EE::entity_not_found;
+			default:
+				return EE::io_error;
+		}
+		rest();
+		INode()->ctime = currentTime();
+		FS->dentries.set((uint64_t)INode()->myID,name,0,false);
+		return EE::ok;
+	}
 	auto directory = script::make_json();
 	if(!readDirectoryContent(directory)) {
 		return EE::permission_denied;
@@ -379,10 +419,11 @@ my_err_t file::removeNode(const str & name,const context * ctx,std::shared_ptr<j
 		return EE::entity_not_found;
 	}
 	
-	if(!writeDirectoryContent(directory,je)) {
+	if(!(FS->getHashedDirectories() ? migrateDirectory(directory,je) : writeDirectoryContent(directory,je))) {
 		return EE::io_error;
 	}
 	INode()->ctime = currentTime();
+	FS->dentries.set((uint64_t)INode()->myID,name,0,false); //Negative, the name is looked up again soon after a delete or rename.
 	
 	return EE::ok;
 }
@@ -393,6 +434,20 @@ my_err_t file::hasNode(const str & name,const context * ctx,bucketIndex_t * id)
 	if(ctx && !validate_access(ctx,access::X)) {
 		return EE::access_denied;
 	}
+	lckshared l(_mut,std::defer_lock); //A lookup reads several blocks, none of them may change meanwhile.
+	if(_mut.hasUniqueLock()==false) {
+		l.lock();
+	}
+	if(isHashedDir()) {
+		uint64_t found;
+		if(!dirBlocks(nullptr).find(name,&found)) {
+			return EE::entity_not_found;
+		}
+		if(id) {
+			*id = found;
+		}
+		return EE::ok;
+	}
 	
 	auto directory = script::make_json();
 	if(!readDirectoryContent(directory)) {
@@ -540,14 +595,16 @@ my_err_t file::truncateInner(my_off_t newSize,shared_ptr<journalEntryWrapper> je
 		toDelete = hashList.truncateAndReturn(newNum,FS->zeroHash());
 		
 		_ASSERT(toDelete.size()==expected);
+		refCntDeltas deltas;
+		deltas.reserve(toDelete.size());
 		for (auto deleteHash : toDelete) {
 			if(deleteHash ) {
 				bucketsAffected.insert(deleteHash->getBucketIndex().bucket());
 				--expected;
-				deleteHash->decRefCnt();
-				deleteHash->rest(); //This will store the hash, or, will delete it altogether.
+				deltas.emplace_back(deleteHash,-1);
 			}
 		}
+		hash::changeRefCnts(std::move(deltas));
 		toDelete.clear();//This will call rest for all hashes that are exclusivly owned by this
 		_ASSERT(expected==0);
 	} else if(newNum>hashList.getSize()) {
@@ -570,11 +627,12 @@ my_err_t file::truncateInner(my_off_t newSize,shared_ptr<journalEntryWrapper> je
 	
 	INode()->size = newSize;
 	rest();	
+	changedSinceRest = true;
 	return EE::ok;
 }
 
 
-my_off_t file::read(unsigned char * buf,my_size_t size,const my_off_t offset) {
+my_off_t file::read(unsigned char * buf,my_size_t size,const my_off_t offset,readAhead * ra) {
 	if(!valid()) {
 		return 0;
 	}
@@ -610,6 +668,12 @@ my_off_t file::read(unsigned char * buf,my_size_t size,const my_off_t offset) {
 	if(maxReadSize % chunkSize>0) {
 		++numHashesInRead;
 	}
+	if(ra) {
+		const auto range = ra->access(offset,size);
+		if(range.second > range.first) {
+			prefetch(range.first,range.second);
+		}
+	}
 	try{
 		lckshared l2(_mut,std::defer_lock);//, and a shared lock for aligned writes.
 		if(_mut.hasUniqueLock()==false) {
@@ -631,7 +695,6 @@ my_off_t file::read(unsigned char * buf,my_size_t size,const my_off_t offset) {
 					readHash->read(newOffset, newSize, &buf[offsetInBuf]);
 					offsetInBuf += newSize;
 					size -= newSize;
-					++numHashReads;
 				}
 				myFileOffset += chunkSize;
 			}
@@ -645,21 +708,48 @@ my_off_t file::read(unsigned char * buf,my_size_t size,const my_off_t offset) {
 		FS->srvWARNING(" read call offsetInBuf!=maxReadSize! (",offsetInBuf,",",maxReadSize,") :",path," originalSize:",originalSize," offset:",offset);
 	}
 	
-	if (numHashReads.load() > (script::int_t)(chunksInBucket * 5)) {
-		numHashReads.store(0);
-		if (rest()) {
-			FS->unloadBuckets();
+	return offsetInBuf;
+}
+void file::prefetch(uint64_t firstHash,uint64_t lastHash) {
+	auto * pool = STOR->writebackPool();
+	if(pool->size()==0) {
+		return;//No background threads, reading ahead would only delay this read.
+	}
+	lastHash = std::min<uint64_t>(lastHash,hashList.getSize());
+	if(firstHash >= lastHash) {
+		return;
+	}
+	//One task per bucket, so every bucket is read once for all slots that are needed.
+	std::map<uint64_t,std::vector<int64_t>> perBucket;
+	auto zero = FS->zeroHash();
+	for(auto & h: hashList.getRange(firstHash,lastHash-firstHash)) {
+		if(h && h!=zero) {
+			const auto idx = h->getBucketIndex();
+			perBucket[idx.bucket()].push_back(idx.index());
 		}
 	}
-		
-	return offsetInBuf;
+	for(auto & b: perBucket) {
+		//Drop the prefetch when the pool is busy, the read itself will load the chunks.
+		pool->tryPost([id = b.first,slots = std::move(b.second)]() {
+			try{
+				STOR->buckets->getBucket(id)->prefetchChunks(slots);
+			} catch(std::exception & e) {
+				FS->srvWARNING("file::prefetch failed for bucket ",id,": ",e.what());
+			}
+		});
+	}
 }
+
 my_off_t file::write(const unsigned char * buf,my_size_t size, const my_off_t offset) {
 	if(!valid()) {
 		return 0;
 	}
 	if(_type!=specialFile::REGULAR) return 0;	
 	
+	if(JOURNAL->getDataMode()==journalDataMode::ORDERED) {
+		return writeOrdered(buf,size,offset);
+	}
+	
 	const str dta(reinterpret_cast<const char *>(buf),size);
 	
 	auto je = JOURNAL->add(journalEntryType::write,bucketIndex_t(),INode()->myID,bucketIndex_t(),0u,offset,"",dta);
@@ -667,7 +757,151 @@ my_off_t file::write(const unsigned char * buf,my_size_t size, const my_off_t of
 	return writeInner(buf,size,offset,je);
 }
 
-my_off_t file::writeInner(const unsigned char * buf,my_size_t size, const my_off_t offset,shared_ptr<journalEntryWrapper> je) {
+/**
+ * Ordered data: the journal committer stores & syncs the buckets with the new chunks of every ordered write in its
+ * window once, then commits their entries (ext4 data=ordered). An entry holds the end of the write & per chunk in the
+ * range the new & the replaced chunk, each a bucketIndex_t & a tag of its digest. Replay points the file at the new
+ * hashes again, their refcounts were stored with the slots. A slot that no longer holds the tagged chunk was released
+ * by a later entry (revoked). The replaced chunk is released by replay only if the file still holds exactly that one.
+ * The hashes the write replaced are only released once the entry is on disk: until then the inode that is stored
+ * may still point at them. A crash before that leaks the new chunks at worst, it never frees a chunk in use.
+ * If the chunks could not be stored the entry is not journaled & the range is rolled back, the write fails.
+ */
+my_off_t file::writeOrdered(const unsigned char * buf,my_size_t size, const my_off_t offset) {
+	orderedWrite ordered;
+	const auto ret = writeInner(buf,size,offset,nullptr,&ordered);
+	if(ordered.after.empty()) {
+		return ret; //Failed before it changed anything.
+	}
+	shared_ptr<journalEntryWrapper> je;
+	try{
+		const str dta(reinterpret_cast<const char *>(ordered.refs.data()),ordered.refs.size()*sizeof(uint64_t));
+		je = JOURNAL->addOrdered(ordered.buckets,journalEntryType::writeref,bucketIndex_t(),INode()->myID,bucketIndex_t(),0u,offset,"",dta); //Waits until the chunks & the entry are synced.
+	} catch(std::exception & e) {
+		FS->srvERROR("file::write: ",path," is not journaled, rolling it back: ",e.what());
+		rollbackOrdered(offset,ordered);
+		return 0;
+	}
+	refCntDeltas released;
+	std::set<uint64_t> affected;
+	for(size_t a=0;a<ordered.before.size();a++) {
+		if(ordered.before[a]!=ordered.after[a]) {
+			released.emplace_back(ordered.before[a],-1);
+			affected.insert(ordered.before[a]->getBucketIndex().bucket());
+			affected.insert(ordered.after[a]->getBucketIndex().bucket());
+		}
+	}
+	hash::changeRefCnts(std::move(released));
+	for(auto b: affected) {
+		STOR->buckets->getBucket(b)->addChange(je);
+	}
+	STOR->metaBuckets->getBucket(INode()->myID.bucket())->addChange(je);
+	return ret;
+}
+
+void file::rollbackOrdered(const my_off_t offset,const orderedWrite & ordered) {
+	const my_off_t firstHash = offset / chunkSize;
+	refCntDeltas deltas;
+	lckunique l(_mut);
+	auto hashes = hashList.getRange(firstHash,ordered.after.size());
+	bool changed = false;
+	for(size_t a=0;a<ordered.after.size();a++) {
+		if(ordered.before[a]==ordered.after[a]) {
+			continue;
+		}
+		if(a<hashes.size() && hashes[a]==ordered.after[a]) {
+			hashes[a] = ordered.before[a];
+			deltas.emplace_back(ordered.after[a],-1);
+			changed = true;
+		} else {
+			deltas.emplace_back(ordered.before[a],-1); //A later write or truncate replaced it, as if this one had completed.
+		}
+	}
+	if(changed) {
+		changedSinceRest = true;
+		_ASSERT(hashList.updateRange(firstHash,hashes)==true);
+	}
+	hash::changeRefCnts(std::move(deltas));
+}
+
+void file::claimRefs(const str & refs) {
+	//The slots were stored before the entry, but their bucket may be missing from the stored list & handed out again.
+	const size_t num = refs.size()/(4*sizeof(uint64_t));
+	for(size_t a=0;a<num;a++) {
+		uint64_t ref;
+		std::memcpy(&ref,refs.data()+sizeof(uint64_t)*(1+a*4),sizeof(uint64_t));
+		const bucketIndex_t idx(ref);
+		if(idx!=fs::rootIndex) {
+			STOR->buckets->accounting->reserveBucket(idx.bucket());
+		}
+	}
+}
+
+my_err_t file::writeRefsInner(my_off_t offset,const str & refs,shared_ptr<journalEntryWrapper> je) {
+	if(refs.size()<sizeof(uint64_t) || refs.size()%(4*sizeof(uint64_t))!=sizeof(uint64_t)) {
+		return EE::io_error;
+	}
+	std::vector<uint64_t> R(refs.size()/sizeof(uint64_t));
+	std::memcpy(R.data(),refs.data(),refs.size());
+	const my_size_t end = R.front();
+	const my_off_t firstHash = offset / chunkSize;
+	const size_t num = (R.size()-1)/4;
+	
+	lckunique l(_mut);
+	auto & fileSize = INode()->size;
+	if(fileSize<end) {
+		fileSize = end;
+	}
+	auto numHashes = fileSize/chunkSize;
+	if(fileSize % chunkSize >0) {
+		++numHashes;
+	}
+	if(numHashes>hashList.getSize()) {
+		auto addedChunks = hashList.truncateAndReturn(numHashes,FS->zeroHash()).size();
+		FS->zeroHash()->incRefCnt(addedChunks);
+	}
+	auto hashes = hashList.getRange(firstHash,num);
+	if(hashes.size()!=num) {
+		return EE::io_error;
+	}
+	bool changed = false;
+	refCntDeltas deltas; //The slots hold the refcounts of the new chunks, not the release of the ones they replaced.
+	size_t revoked = 0;
+	const std::hash<const crypto::sha256sum> tag;
+	const auto zero = FS->zeroHash();
+	for(size_t a=0;a<num;a++) {
+		const uint64_t * ref = &R[a*4+1];
+		const bucketIndex_t idx(ref[0]);
+		auto target = idx==fs::rootIndex ? zero : STOR->buckets->getHash(idx);
+		if(!target || tag(target->getHashPrimitive())!=ref[1]) {
+			++revoked; //Freed after the entry, a later one has the range.
+			continue;
+		}
+		if(hashes[a]!=target) {
+			//Only the chunk the write replaced: a slot the stored inode points at may have been freed & reused since.
+			if(hashes[a]!=zero && hashes[a]->getBucketIndex().fullindex()==ref[2] && tag(hashes[a]->getHashPrimitive())==ref[3]) {
+				deltas.emplace_back(hashes[a],-1);
+			}
+			hashes[a] = target;
+			changed = true;
+		}
+	}
+	if(changed) {
+		changedSinceRest = true;
+		_ASSERT(hashList.updateRange(firstHash,hashes)==true);
+		hash::changeRefCnts(std::move(deltas));
+	}
+	if(revoked) {
+		FS->srvDEBUG("file::writeRefsInner: ",revoked," of ",num," chunks were released after the entry: ",path);
+	}
+	INode()->mtime = currentTime();
+	if(je) {
+		STOR->metaBuckets->getBucket(INode()->myID.bucket())->addChange(je);
+	}
+	return EE::ok;
+}
+
+my_off_t file::writeInner(const unsigned char * buf,my_size_t size, const my_off_t offset,shared_ptr<journalEntryWrapper> je,orderedWrite * ordered) {
 
 	//CLOG("t_file::write: ",path," ",size," ",offset);
 
@@ -715,46 +949,99 @@ my_off_t file::writeInner(const unsigned char * buf,my_size_t size, const my_off
 		
 		auto hashes = hashList.getRange(firstHash,numHashesInWrite);
 		_ASSERT(hashes.size()==numHashesInWrite);
+		if(ordered) {
+			ordered->before = hashes;
+		}
 		std::vector<shared_ptr<hash>> hashesToRemoveFromFile;
+		refCntDeltas added;
 		std::set<uint64_t> bucketsAffected;
-		for (auto & writeHash: hashes) {
+		//First build the new chunks of the whole range, so they can be hashed in one batch.
+		std::vector<shared_ptr<chunk>> newChunks;
+		std::vector<size_t> written; //Position in hashes of each new chunk.
+		newChunks.reserve(hashes.size());
+		written.reserve(hashes.size());
+		const auto zero = FS->zeroHash();
+		for (size_t a=0;a<hashes.size();a++) {
+			auto & writeHash = hashes[a];
 			_ASSERT(writeHash!=nullptr);
 			if(offset < myFileOffset+ chunkSize && size > 0) {
 				auto newOffset = std::max(offset - myFileOffset, (my_off_t)0);//Determine the offset to start the read from.
 				auto newSize = std::min(size,(my_size_t)chunkSize-newOffset);
 				//FS->srvMESSAGE("offset:",offset," size:",size," newOffset:",newOffset," newSize:",newSize);
 				_ASSERT(newSize<=size);
-				auto newHsh = writeHash->write(newOffset,newSize,&buf[offsetInBuf]);
+				const auto * input = &buf[offsetInBuf];
+				if(chunk::isZero(input,newSize) && (writeHash==zero || newSize==chunkSize || writeHash->data()->isZeroOutside(newOffset,newSize))) {
+					//The chunk ends up all zeros, which is the zero hash: no copy, no sha256 & no index lookup.
+					++(newSize==chunkSize ? STOR->stats.zeroChunksFull : STOR->stats.zeroChunksPartial);
+					if(writeHash!=zero) {
+						hashesToRemoveFromFile.push_back(writeHash);
+						added.emplace_back(zero,1);
+						bucketsAffected.insert(zero->getBucketIndex().bucket());
+						bucketsAffected.insert(writeHash->getBucketIndex().bucket());
+						writeHash = zero;
+					}
+				} else {
+					newChunks.push_back(writeHash->writeChunk(newOffset,newSize,input));
+					written.push_back(a);
+				}
 				offsetInBuf += newSize;
 				size -= newSize;
-				if(newHsh) {
-					hashesToRemoveFromFile.push_back(writeHash);
-					newHsh->incRefCnt();
-					bucketsAffected.insert(newHsh->getBucketIndex().bucket());
-					bucketsAffected.insert(writeHash->getBucketIndex().bucket());
-					writeHash = newHsh;
-				}
-				//_ASSERT(writeHash->getRefCnt()>0);
 			} else {
 				//FS->srvWARNING("???? offset < myFileOffset + chunkSize??",size," ",offset," ",myFileOffset);
 			}
 			myFileOffset += chunkSize;
 		}
+		const auto newSums = chunk::getHashes(newChunks);
+		for (size_t a=0;a<newChunks.size();a++) {
+			auto & writeHash = hashes[written[a]];
+			auto newHsh = writeHash->update(newSums[a],newChunks[a]);
+			if(newHsh) {
+				hashesToRemoveFromFile.push_back(writeHash);
+				added.emplace_back(newHsh,1);
+				bucketsAffected.insert(newHsh->getBucketIndex().bucket());
+				bucketsAffected.insert(writeHash->getBucketIndex().bucket());
+				writeHash = newHsh;
+			}
+			//_ASSERT(writeHash->getRefCnt()>0);
+		}
+		hash::changeRefCnts(std::move(added)); //Before the old hashes are released, which may be the same ones.
 		/*if(size!=0) {
 			FS->srvERROR("Size not 0: s:",size,",o:",offset,",nh:",numHashesInWrite);
 		}*/
 		_ASSERT(size==0);
 		if(hashesToRemoveFromFile.empty()==false) {
 			FS->srvDEBUG("file::write: updating ",hashesToRemoveFromFile.size()," hashes");
-			numHashWrites += hashesToRemoveFromFile.size(); //Keep track of hash writes to know when to rest the file
+			changedSinceRest = true;
 			_ASSERT(hashList.updateRange(firstHash,hashes)==true); //Update the hashes in this write with the new versions
-			for(auto i: hashesToRemoveFromFile) {
-				i->decRefCnt();
+			if(!ordered) {
+				refCntDeltas removed;
+				removed.reserve(hashesToRemoveFromFile.size());
+				for(auto i: hashesToRemoveFromFile) {
+					removed.emplace_back(i,-1);
+				}
+				hash::changeRefCnts(std::move(removed));
 			}
 			for(auto i:bucketsAffected) { //Store a reference to the journalEntry in the affected buckets
 				STOR->buckets->getBucket(i)->addChange(je);
 			}
 		}
+		if(ordered) {
+			//Still under the lock: the next write to the range may change it as soon as it is released.
+			const my_size_t inRange = (offset + originalSize + chunkSize - 1) / chunkSize - firstHash;
+			const std::hash<const crypto::sha256sum> tag;
+			ordered->after = hashes;
+			ordered->refs.reserve(inRange*4+1);
+			ordered->refs.push_back(offset + originalSize);
+			for(size_t a=0;a<inRange;a++) {
+				ordered->refs.push_back(hashes[a]->getBucketIndex().fullindex());
+				ordered->refs.push_back(tag(hashes[a]->getHashPrimitive()));
+				ordered->refs.push_back(ordered->before[a]->getBucketIndex().fullindex());
+				ordered->refs.push_back(tag(ordered->before[a]->getHashPrimitive()));
+				if(hashes[a]!=ordered->before[a] && hashes[a]!=zero) {
+					ordered->buckets.insert(hashes[a]->getBucketIndex().bucket());
+				}
+			}
+		}
 		INode()->mtime = currentTime();
 	} catch(std::exception & e) {
 		FS->srvERROR("file::write: ERROR: ",e.what());
@@ -765,11 +1052,9 @@ my_off_t file::writeInner(const unsigned char * buf,my_size_t size, const my_off
 		FS->srvWARNING("file::write: offsetInBuf!=originalSize (",offsetInBuf,",",originalSize,") :",path," originalSize:",originalSize," offset:",offset);
 	}
 	
-	if (numHashWrites.load() > (script::int_t)(chunksInBucket * 5)) {
-		numHashWrites.store(0);
-		if (rest()) {
-			FS->unloadBuckets();
-		}
+	if (STOR->cache.overDirtyBudget()) { //Too many chunks are waiting to be written, store the buckets.
+		rest();
+		FS->unloadBuckets();
 	}
 
 	return offsetInBuf;
@@ -806,6 +1091,13 @@ bool file::isFullDir() {
 	}
 	if(type()!=fileType::DIR) return false;
 
+	if(isHashedDir()) {
+		bool full = false;
+		if(!listNodes([&full](const str & name,uint64_t) { full = name.empty()==false && name.at(0)!='/'; return !full; })) {
+			return true;
+		}
+		return full;
+	}
 	auto directory = script::make_json();
 	if(!readDirectoryContent(directory)) {
 		return true;
@@ -830,27 +1122,51 @@ bool file::swapContent(const str & newContent,std::shared_ptr<journalEntryWrappe
 	
 	std::set<uint64_t> affectedBuckets;
 	std::vector<shared_ptr<hash>> newList;
+	std::vector<shared_ptr<chunk>> newChunks;
+	std::vector<size_t> written; //Position in newList of each new chunk, the others are zero chunks.
+	const auto zero = FS->zeroHash();
 	size_t offset = 0;
 	while(offset<newContent.size()) {
 		auto newSize=std::min((size_t)chunkSize,(size_t)(newContent.size()-offset));
-		auto newHsh = FS->zeroHash()->write(0,newSize,reinterpret_cast<const uint8_t *>(&newContent[offset]));
+		const auto * input = reinterpret_cast<const uint8_t *>(&newContent[offset]);
+		if(chunk::isZero(input,newSize)) {
+			++(newSize==chunkSize ? STOR->stats.zeroChunksFull : STOR->stats.zeroChunksPartial);
+			affectedBuckets.insert(zero->getBucketIndex().bucket());
+			newList.push_back(zero);
+		} else {
+			written.push_back(newList.size());
+			newList.push_back(nullptr);
+			newChunks.push_back(zero->writeChunk(0,newSize,input));
+		}
+		offset += newSize;
+	}
+	const auto newSums = chunk::getHashes(newChunks);
+	for(size_t a=0;a<newChunks.size();a++) {
+		auto newHsh = zero->update(newSums[a],newChunks[a]);
 		_ASSERT(newHsh!=nullptr);
 		affectedBuckets.insert(newHsh->getBucketIndex().bucket());
-		newHsh->incRefCnt();
-		newList.push_back(newHsh);
-		offset += newSize;
+		newList[written[a]] = newHsh;
 	}
+	refCntDeltas deltas;
+	deltas.reserve(newList.size());
+	for(auto & i: newList) {
+		deltas.emplace_back(i,1);
+	}
+	hash::changeRefCnts(deltas);
 	
 	hashList.swap(newList);
+	changedSinceRest = true;
 	
 	INode()->size = newContent.size();
 	INode()->mtime = currentTime();
 	INode()->ctime = INode()->mtime = currentTime();
 	
 	
+	deltas.clear();
 	for(auto & i: newList) {
-		i->decRefCnt();
+		deltas.emplace_back(i,-1);
 	}
+	hash::changeRefCnts(std::move(deltas));
 	
 	for(auto b: affectedBuckets) {
 		STOR->buckets->getBucket(b)->addChange(je);
@@ -860,7 +1176,7 @@ bool file::swapContent(const str & newContent,std::shared_ptr<journalEntryWrappe
 }
 
 
-//This puts the file + it's data to rest so that it gets stored to hard disk.
+//This puts the file + it's data to rest so that it gets stored to hard disk. Returns true if the content changed since the last rest.
 bool file::rest() {
 	if(!valid()) {
 		return false;
@@ -868,7 +1184,6 @@ bool file::rest() {
 	//No locking required as only calls are made to properly protected member functions (perhaps not?)
 	if (_type != specialFile::REGULAR) return false;
 	lckunique l(_mut); // This operation should not run in paralel. 
-	size_t num = 0;
 	size_t newMetaChunks = 0;
 	auto hashes = hashList.getAll();
 	if(hashes.empty()==false) {
@@ -882,9 +1197,6 @@ bool file::rest() {
 				FS->srvERROR("file::rest is writing a reference to deleted hash for: ",path,": ",H->getHashStr(),H->getBucketIndex());
 			}
 			_ASSERT(H->getRefCnt()>0);
-			if(H->rest()) {
-				++num;
-			}
 			//_ASSERT(H->getRefCnt()>0);
 			if(imax==inode::numctd) {
 				//We are loading from an inode
@@ -919,14 +1231,14 @@ bool file::rest() {
 		INode()->ctd[0] = 0;
 	}
 	
-	FS->srvDEBUG("file::rest ",num,"/",hashes.size()," hashes for ", path," with ",newMetaChunks," new metaChunks");
+	FS->srvDEBUG("file::rest ",hashes.size()," hashes for ", path," with ",newMetaChunks," new metaChunks");
 	
 	if(INode()->myID) {
 		FS->storeInode(metaChunk);
 	}
 	
 	
-	return num>0;
+	return changedSinceRest.exchange(false);
 }
 
 
@@ -1040,6 +1352,9 @@ bool file::readDirectoryContent(script::JSONPtr out) {
 	}
 	
 	if(type()==fileType::DIR) {
+		if(isHashedDir()) {
+			return listNodes([&out](const str & name,uint64_t id) { (*out)[name] = (script::int_t)id; return true; });
+		}
 		if(size()) {
 			str content;
 			content.resize(INode()->size);
@@ -1057,6 +1372,99 @@ bool file::readDirectoryContent(script::JSONPtr out) {
 	}
 	return true;
 }
+bool file::listNodes(const std::function<bool(const str & name,uint64_t id)> & fn) {
+	if(!valid() || type()!=fileType::DIR) {
+		return false;
+	}
+	lckshared l(_mut,std::defer_lock);
+	if(_mut.hasUniqueLock()==false) {
+		l.lock();
+	}
+	if(isHashedDir()) {
+		if(!dirBlocks(nullptr).forEach(fn)) {
+			FS->srvERROR("Failed to read directory:",path);
+			return false;
+		}
+		return true;
+	}
+	auto directory = script::make_json();
+	if(!readDirectoryContent(directory)) {
+		return false;
+	}
+	for(auto & it: *directory) {
+		if(!fn(it.first,(uint64_t)it.second.get<script::SLT::I>(0,1))) {
+			break;
+		}
+	}
+	return true;
+}
+
+bool file::isHashedDir(void) {
+	if(size()<chunkSize) {
+		return false;
+	}
+	str head;
+	head.resize(16);
+	return read(reinterpret_cast<uint8_t*>(&head[0]),head.size(),0)==(my_off_t)head.size() && hashedDirectory::isHashed(head);
+}
+
+hashedDirectory file::dirBlocks(shared_ptr<journalEntryWrapper> je) {
+	return hashedDirectory(
+		[this](uint64_t block,str & out) {
+			if((block+1)*chunkSize > size()) {
+				return false;
+			}
+			out.resize(chunkSize);
+			return read(reinterpret_cast<uint8_t*>(&out[0]),chunkSize,block*chunkSize)==(my_off_t)chunkSize;
+		},
+		[this,je](uint64_t block,const str & in) {
+			return writeInner(reinterpret_cast<const uint8_t*>(in.data()),in.size(),block*chunkSize,je)==(my_off_t)in.size();
+		});
+}
+
+bool file::migrateDirectory(script::JSONPtr in,shared_ptr<journalEntryWrapper> je) {
+	//Built in memory & swapped in as a whole, the way the JSON content was written.
+	std::vector<str> blocks;
+	hashedDirectory D(
+		[&blocks](uint64_t block,str & out) {
+			if(block>=blocks.size()) {
+				return false;
+			}
+			out = blocks[block];
+			return true;
+		},
+		[&blocks](uint64_t block,const str & data) {
+			if(block>=blocks.size()) {
+				blocks.resize(block+1,str(chunkSize,'\0'));
+			}
+			blocks[block] = data;
+			return true;
+		});
+	if(!D.create()) {
+		return false;
+	}
+	size_t n = 0;
+	for(auto & it: *in) {
+		if(D.insert(it.first,(uint64_t)it.second.get<script::SLT::I>(0,1))!=hashedDirectory::result::OK) {
+			FS->srvERROR("Failed to migrate directory:",path," at: ",it.first);
+			return false;
+		}
+		++n;
+	}
+	str content;
+	content.reserve(blocks.size()*chunkSize);
+	for(auto & b: blocks) {
+		content.append(b);
+	}
+	FS->srvDEBUG("Writing directory ",path," with ",n," entries as ",blocks.size()," blocks");
+	if(size()) {
+		++FS->directoriesMigrated;
+	}
+	_ASSERT(swapContent(content,je)==true);
+	rest();
+	return true;
+}
+
 bool file::writeDirectoryContent (script::JSONPtr in,std::shared_ptr<journalEntryWrapper> je) {
 	if(!valid()) {
 		return false;
@@ -1105,6 +1513,8 @@ my_err_t file::replayEntry(const journalEntry * entry, const str & name, const s
 		case journalEntryType::write:
 			return writeInner(_STRTOBYTESIZE(data),entry->offset,nullptr) == (my_off_t)entry->dataLength ? EE::ok : EE::io_error;
 			break;
+		case journalEntryType::writeref:
+			return writeRefsInner(entry->offset,data,je);
 		case journalEntryType::chmod:
 			return chmodInner(entry->mod,je);
 		case journalEntryType::chown:
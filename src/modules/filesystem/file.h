@@ -7,9 +7,11 @@
 //#include <sys/types.h>
 #include "types.h"
 #include "inode.h"
+#include "directory.h"
 #include "modules/script/JSON.h"
 #include "modules/util/atomic_shared_ptr_list.h"
 #include <atomic>
+#include <set>
 #undef ERROR
 #include "locks.h"
 #include "context.h"
@@ -21,6 +23,7 @@ namespace filesystem{
 	class hash;
 	class journalEntry;
 	class journalEntryWrapper;
+	class readAhead;
 	
 	typedef std::shared_ptr<file> filePtr;
 	
@@ -50,7 +53,7 @@ namespace filesystem{
 	class file {
 	private:
 		//friend class fs;
-		std::atomic_int numHashWrites,numHashReads;
+		std::atomic_bool changedSinceRest; //Content changed since the last rest()
 		script::JSONPtr extraMeta;
 		std::shared_ptr<chunk> metaChunk;
 		const str path;
@@ -68,10 +71,26 @@ namespace filesystem{
 		void loadHashes(void);
 		bool validate_ownership(const context * ctx,my_mode_t newMode);
 		inode * INode() const {return metaChunk->as<inode>();} 
-		my_off_t writeInner(const unsigned char * buf,my_size_t size,const my_off_t offset,shared_ptr<journalEntryWrapper> je);
+		/**
+		 * What writeInner hands an ordered write, all of it taken while it holds _mut.
+		 * The refcounts of the replaced hashes are left to the caller: released once the entry is on disk, or the
+		 * range is rolled back if it could not be journaled.
+		 */
+		struct orderedWrite {
+			std::vector<std::shared_ptr<hash>> before,after; //The range of the write in hashList.
+			std::vector<uint64_t> refs; //The writeref entry: end of the write, then per chunk the new & the replaced one (bucketIndex_t & digest tag).
+			std::set<uint64_t> buckets; //Buckets holding the new chunks, stored & synced before the entry.
+		};
+		my_off_t writeInner(const unsigned char * buf,my_size_t size,const my_off_t offset,shared_ptr<journalEntryWrapper> je,orderedWrite * ordered = nullptr);
+		my_off_t writeOrdered(const unsigned char * buf,my_size_t size,const my_off_t offset);
+		void rollbackOrdered(const my_off_t offset,const orderedWrite & ordered); //The write was not journaled: put back what it replaced.
+		my_err_t writeRefsInner(my_off_t offset,const str & refs,shared_ptr<journalEntryWrapper> je);
 		my_err_t chmodInner(my_mode_t mod,shared_ptr<journalEntryWrapper> je);
 		my_err_t chownInner(my_uid_t uid, my_gid_t gid,shared_ptr<journalEntryWrapper> je);
 		my_err_t truncateInner(my_off_t newSize,shared_ptr<journalEntryWrapper> je);
+		bool isHashedDir(void);
+		hashedDirectory dirBlocks(shared_ptr<journalEntryWrapper> je); //The directory content block by block.
+		bool migrateDirectory(script::JSONPtr in,shared_ptr<journalEntryWrapper> je); //Writes a JSON directory as hashedDirectory.
 	public:
 		file(specialFile intype);
 		file(std::shared_ptr<chunk> imeta, const str & ipath, const std::vector<permission> & ipathPerm);
@@ -85,11 +104,13 @@ namespace filesystem{
 
 		bool readDirectoryContent(script::JSONPtr out);
 		bool writeDirectoryContent(script::JSONPtr in,std::shared_ptr<journalEntryWrapper> je);
+		bool listNodes(const std::function<bool(const str & name,uint64_t id)> & fn); //Every entry of either directory format, until fn returns false.
 		
 		std::vector<bucketIndex_t> setDeletedAndReturnAllUsedInodes();
 		void storeMetaProperties(void);
 		void setMetaProperty(const str & propertyname,const std::set<uint64_t> & in);
 		void setMetaProperty(const str & propertyname,script::JSONPtr in);
+		void setMetaProperty(const str & propertyname,script::int_t in);
 		void setSpecialFile(const specialFile in) {_type = in;}
 		 
 		void addLink(void);
@@ -134,7 +155,8 @@ namespace filesystem{
 		
 		void loadStat(fileType * T,my_mode_t * M,my_off_t * S,my_gid_t * G,my_uid_t * U,timeHolder * at,timeHolder * mt,timeHolder * ct, my_ino_t * in);
 		my_err_t truncate(my_off_t newSize);
-		my_off_t read(unsigned char * buf,my_size_t size, const my_off_t offset);
+		my_off_t read(unsigned char * buf,my_size_t size, const my_off_t offset,readAhead * ra = nullptr);
+		void prefetch(uint64_t firstHash,uint64_t lastHash); //Load the chunks of these hashes in the background
 		my_off_t write(const unsigned char * buf,my_size_t size,const my_off_t offset);
 		bool rest(void);
 		bool validate_access(const context * ctx,access da,access dda=access::NONE,bool checkStickyOwner=false);
@@ -145,6 +167,7 @@ namespace filesystem{
 		my_err_t replayEntry(const journalEntry * entry, const str & name, const str & data,const context * ctx,shared_ptr<journalEntryWrapper> je);
 		
 		static void setFileDefaults(std::shared_ptr<chunk> meta,my_mode_t mod,const context * ctx=nullptr) ;
+		static void claimRefs(const str & refs); //The buckets a writeref entry points into stay in use, replay needs their slots.
 		//static void setDirMode(std::shared_ptr<chunk> meta,my_mode_t mode) ;
 		//static void setFileMode(std::shared_ptr<chunk> meta,my_mode_t mode, my_dev_t dev) ;
 		
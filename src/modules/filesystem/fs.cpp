@@ -11,6 +11,7 @@
 #include "main.h"
 #include "modules/util/str.h"
 #include "modules/crypto/sha256.h"
+#include "modules/crypto/sha256batch.h"
 
 #include "hash.h"
 #include "inode.h"
@@ -32,6 +33,7 @@
 #endif
 #include <thread>
 #include <algorithm>
+#include <cstring>
 #include "modules/util/files.h"
 
 using namespace filesystem;
@@ -91,7 +93,7 @@ fs::~fs() {
 	lckguard _lck2(actualWriting);
 	srvMESSAGE("Closing files");
 	if(root)root->rest();
-	pathInodeCache.clear();
+	dentries.clear();
 	inodeFileCache.clear();
 	for (auto& hh : openHandles) {
 		filePtr h = hh;
@@ -104,7 +106,7 @@ fs::~fs() {
 	}
 	root.reset();
 	if(up_and_running) {
-		storeMetadata();
+		storeMetadata(true);
 	}
 }
 
@@ -168,7 +170,7 @@ bool fs::initFileSystem(unique_ptr<crypto::protocolInterface> iprot,bool mustCre
 	
 	
 	
-	STOR->buckets->hashesIndex.insert(zeroSum,_zeroHash);
+	STOR->buckets->hashesIndex.insert(zeroSum,_zeroHash->getBucketIndex());
 	
 	auto metaInfo = script::make_json();
 	const bool foundFileSystem = (STOR->metaBuckets->getBucket(1)->getHash(0)!=nullptr);
@@ -241,7 +243,6 @@ bool fs::initFileSystem(unique_ptr<crypto::protocolInterface> iprot,bool mustCre
 
 	std::vector<permission> pPerm;
 	root = make_shared<file>(rootChunk,"/",pPerm);
-	pathInodeCache.insert("/",rootIndex);
 	inodeFileCache.insert(rootIndex,root);
 
 	
@@ -322,6 +323,23 @@ void fs::migrate(unique_ptr<crypto::protocolInterface> newProtocol) {
 
 }
 
+/**
+ * An entry that is replayed later may still find its ids in the pools, an earlier entry could be handed them
+ * (a directory block, a ctd). The inode of a mkobject was fetched before the crash & never stored.
+ */
+void fs::claimEntry(const journalEntry * entry,const str & payload) {
+	switch(entry->type) {
+		case journalEntryType::mkobject:
+			STOR->metaBuckets->accounting->reserve(entry->newNode);
+			break;
+		case journalEntryType::writeref:
+			file::claimRefs(payload.substr(entry->nameLength,entry->dataLength));
+			break;
+		default:
+			break;
+	}
+}
+
 my_err_t fs::replayEntry(const journalEntry * entry, const str & name, const str & data,const context * ctx,journalEntryPtr je) {
 	//Replay the things that i can do from FS, delegate to FILE if required! :)
 	switch(entry->type) {
@@ -365,9 +383,16 @@ my_err_t fs::replayEntry(const journalEntry * entry, const str & name, const str
 
 
 
-void fs::storeMetadata(void) {
+void fs::storeMetadata(bool unmount) {
 	try{
 		
+		if(root && unmount) {
+			//The index is written before the buckets, the root metadata that validates it is stored last.
+			const auto generation = STOR->buckets->getDedupGeneration() + 1;
+			if(STOR->buckets->storeDedupIndex(generation)) {
+				root->setMetaProperty("dedupGeneration", (script::int_t)generation);
+			}
+		}
 		if(root) {
 			srvDEBUG("Storing metaBucket & bucket list in root metaData");
 			{
@@ -386,7 +411,11 @@ void fs::storeMetadata(void) {
 			}
 			srvDEBUG("List storing done");
 		}
-		STOR->storeAllData();
+		{
+			lckunique _dirs(directoryWrites);
+			STOR->storeAllData();
+		}
+		JOURNAL->checkpoint();
 
 		srvDEBUG("end storeMetadata");
 		srvMESSAGE("Metadata stored");
@@ -456,31 +485,92 @@ filePtr fs::get(const char * filename, my_err_t * errcode,const fileHandle H) {
 			return handle;
 		}
 	}
-	{
-		auto itr = pathInodeCache.get(filename);
-		if(itr) {
-			auto F = inodeToFile(itr,filename,errcode);
-			if(F->valid()) {
-				return F;
-			} else {
-				if(pathInodeCache.erase(filename)!=1) {
-					srvERROR("Failed to clear ",filename," to inode cache");
+	//Walk the path one component at a time, a directory is only read when the dentry cache misses.
+	//The file of the directory is carried down while it is known, so a run of misses never resolves the path again.
+	const size_t len = strlen(filename);
+	uint64_t ino = (uint64_t)rootIndex, parent = 0;
+	bool isDir = true;
+	filePtr dir = root, parentFile;
+	size_t start = 0, nameStart = 0, nameLen = 0;
+	for(;;) {
+		while(start<len && filename[start]=='/') {
+			++start;
+		}
+		if(start==len) {
+			break;
+		}
+		size_t end = start;
+		while(end<len && filename[end]!='/') {
+			++end;
+		}
+		if(!isDir) {
+			if(errcode) { errcode[0] = EE::entity_not_found; };
+			return specialfile_error;
+		}
+		if(end-start>255) {
+			if(errcode) { errcode[0] = EE::name_too_long; };
+			return specialfile_error;
+		}
+		parent = ino;
+		nameStart = start;
+		nameLen = end-start;
+		parentFile = std::move(dir);
+		dir = nullptr;
+		switch(dentries.lookup(parent,filename+nameStart,nameLen,ino,isDir)) {
+			case dentryCache::result::POSITIVE:
+				break;
+			case dentryCache::result::NEGATIVE:
+				if(errcode) { errcode[0] = EE::entity_not_found; };
+				return specialfile_error;
+			case dentryCache::result::MISS:
+				if(parentFile==nullptr) {
+					my_err_t error = EE::ok;
+					parentFile = walkDirectory(parent,filename,nameStart,&error);
+					if(parentFile->valid()==false) {
+						if(errcode) { errcode[0] = error ? error : EE::entity_not_found; };
+						return specialfile_error;
+					}
 				}
-				pathInodeCache.insert("/",rootIndex);
-			}
+				if(auto nodeError = lookupComponent(parentFile,filename,nameStart,end,parent,ino,isDir,dir)) {
+					if(errcode) { errcode[0] = nodeError; };
+					return specialfile_error;
+				}
+				break;
 		}
+		start = end;
 	}
-
-	const str myFN = str(filename);
-	if(myFN.size()<=1) {
+	if(ino==(uint64_t)rootIndex) {
 		return root;
 	}
-	str childname=getChildPath(myFN);
-	str parentname=getParentPath(myFN);
-	if(childname.size()>255) {
-		if(errcode) { errcode[0] = EE::name_too_long; };
+	
+	auto F = dir ? dir : inodeFileCache.get(bucketIndex_t(ino));
+	if(F==nullptr) {
+		//Loaded with the permissions of the directories above it.
+		if(parentFile==nullptr) {
+			parentFile = walkDirectory(parent,filename,nameStart,errcode);
+		}
+		if(parentFile->valid()==false) {
+			return specialfile_error;
+		}
+		std::vector<permission> pPerm = parentFile->getPathPermissions();
+		pPerm.emplace_back(parentFile);
+		F = inodeToFile(bucketIndex_t(ino),filename,errcode,pPerm);
+	}
+	if(F->valid()==false) {
+		srvDEBUG("Cached entry ",filename," is no longer valid");
+		dentries.forget(parent,filename+nameStart,nameLen);
+		if(errcode) { errcode[0] = EE::entity_not_found; };
 		return specialfile_error;
 	}
+	return F;
+}
+
+filePtr fs::getDirectoryOf(const char * filename,size_t nameStart,my_err_t * errcode) {
+	size_t n = nameStart;
+	while(n>1 && filename[n-1]=='/') {
+		--n;
+	}
+	const str parentname = n>1 ? str(filename,n) : str("/");
 	auto parentFile = get(parentname.c_str(),errcode);
 	if(parentFile->valid()==false) {
 		srvDEBUG("Parentfile ",parentname," not valid");
@@ -492,26 +582,45 @@ filePtr fs::get(const char * filename, my_err_t * errcode,const fileHandle H) {
 		if(errcode) { errcode[0] = EE::entity_not_found; };
 		return specialfile_error;
 	}
-	
+	return parentFile;
+}
+
+filePtr fs::walkDirectory(uint64_t parent,const char * filename,size_t nameStart,my_err_t * errcode) {
+	auto parentFile = inodeFileCache.get(bucketIndex_t(parent));
+	if(parentFile!=nullptr && parentFile->valid() && parentFile->type()==fileType::DIR) {
+		return parentFile;
+	}
+	return getDirectoryOf(filename,nameStart,errcode); //Evicted, loading it needs the permissions of the path above.
+}
+
+my_err_t fs::lookupComponent(const filePtr & parentFile,const char * filename,size_t nameStart,size_t nameEnd,uint64_t parent,uint64_t & ino,bool & isDir,filePtr & child) {
+	my_err_t error = EE::ok;
+	const str childname(filename+nameStart,nameEnd-nameStart);
+	const auto seen = dentries.generation(parent); //Before the directory is read, so a change in between drops the result.
 	bucketIndex_t i;
 	auto nodeError = parentFile->hasNode(childname,nullptr,&i);
 	if(nodeError) {
-		srvDEBUG("Parentfile ",parentname," dir entry not found: ",childname);
-		if(errcode) { errcode[0] = nodeError; };
-		return specialfile_error;
+		srvDEBUG("Parentfile ",parentFile->getPath()," dir entry not found: ",childname);
+		if(nodeError==EE::entity_not_found) {
+			dentries.insert(parent,childname,0,false,seen);
+		}
+		return nodeError;
 	}
-	
-	
 	_ASSERT(i);
 	
-	pathInodeCache.insert(filename,i);
+	//The type decides if the walk may continue below it, so the node is loaded (& cached) here already.
+	const str childpath(filename,nameEnd);
 	std::vector<permission> pPerm = parentFile->getPathPermissions();
 	pPerm.emplace_back(parentFile);
-		
-	return inodeToFile(i,filename,errcode,pPerm);
-
-
-
+	auto F = inodeToFile(i,childpath.c_str(),&error,pPerm);
+	if(F->valid()==false) {
+		return error ? error : EE::entity_not_found;
+	}
+	ino = (uint64_t)i;
+	isDir = F->type()==fileType::DIR;
+	dentries.insert(parent,childname,ino,isDir,seen);
+	child = std::move(F);
+	return EE::ok;
 }
 
 
@@ -560,12 +669,20 @@ fileHandle fs::open(filePtr F) {
 	for(fileHandle a=1;a<openHandles.size();a++) {
 		filePtr expected = nullptr;
 		if(openHandles[a].compare_exchange_strong(expected,F)) {
+			readAheads[a].reset();
 			return a;
 		}
 	}
 	srvWARNING("fileHandles exhausted when requesting for: ",F->getPath());
 	return 0;
 }
+readAhead * fs::getReadAhead(const fileHandle H) {
+	if(H>0 && H < readAheads.size()) {
+		return &readAheads[H];
+	}
+	return nullptr;
+}
+
 void fs::close(filePtr F,fileHandle H) {
 	if(H>0 && H < openHandles.size()) {
 		if(openHandles[H].compare_exchange_strong(F,filePtr())) {
@@ -676,7 +793,8 @@ my_err_t fs::unlinkinner(const char * filename, const context * ctx,shared_ptr<j
 		}
 	}	
 	srvDEBUG("unlink 3 ",filename);
-	
+	const bool isDir = f->type()==fileType::DIR;
+	const uint64_t delIno = f->ino();
 	
 	auto ret = parent->removeNode(srcChildName,ctx,je);
 	if(ret==EE::ok) {
@@ -705,8 +823,9 @@ my_err_t fs::unlinkinner(const char * filename, const context * ctx,shared_ptr<j
 		}
 		
 		
-		if (pathInodeCache.erase(filename) != 1) {//This detach the file handle from the cache (calls from get will get return error handle)
-			srvERROR("unlink:", filename,":",f->ino(), " failed to erase cached path");
+		//removeNode left a negative entry for the name, entries below a removed directory would outlive its inode.
+		if(isDir) {
+			dentries.invalidateSubtree(delIno);
 		}
 		
 	
@@ -803,9 +922,6 @@ my_err_t fs::renamemoveinner(const char * source, const char * dest, const conte
 	
 	auto tv = currentTime();
 	srcfile->updateTimesWith(false,true,true,tv);
-	//srvDEBUG("erase cache:");
-	pathInodeCache.erase(source);
-	pathInodeCache.erase(dest);
 	return EE::ok;
 
 	//rename returns EACCES or EPERM if the file pointed at by the 'to' argument exists, 
@@ -931,14 +1047,14 @@ str fs::getStats() {
 	str C;	
 	uint64_t numBuckets = STOR->buckets->accounting->getBucketsInUse().size();
 	uint64_t numMetaBuckets = STOR->metaBuckets->accounting->getBucketsInUse().size();
-	uint64_t hashesInMem = 0;
 	std::map<str,int64_t> hashDistribution;
 	uint64_t numDedupKbs = 0;
-	auto hashesIndex = STOR->buckets->hashesIndex.list();
-	for(auto hsh: hashesIndex) {
-		if(hsh->hasData()) {
-			hashesInMem ++;
-		}
+	//Only the hashes that are in memory, loading all of them for the stats would take too long.
+	std::vector<hashPtr> hashesInMemory;
+	for(auto & b: STOR->buckets->loaded.list()) {
+		b->loadedHashes(hashesInMemory);
+	}
+	for(auto hsh: hashesInMemory) {
 		auto ref = hsh->getRefCnt();
 		if(ref==0 || ref == 1) {
 			hashDistribution[std::to_string(ref).c_str()]++;
@@ -986,15 +1102,35 @@ str fs::getStats() {
 	}
 
 	C+= BUILDSTRING("(Dsk) Buckets: ",numBuckets," * ",bucketSizeInKB,"KB == ",(numBuckets * bucketSizeInKB)/KB,"MB\n");
-	C+= BUILDSTRING("(Dsk) Hashes: ", STOR->buckets->hashesIndex.size()," * ",chunkSizeInKB,"KB == ",(STOR->buckets->hashesIndex.size()*chunkSizeInKB)/KB,"MB\n");
-	C+= BUILDSTRING("(Mem) Hashes: ",hashesInMem," * ",chunkSizeInKB,"KB == ",(hashesInMem*chunkSizeInKB)/KB,"MB\n");
+	const auto numHashes = STOR->buckets->numHashes();
+	C+= BUILDSTRING("(Dsk) Hashes: ", numHashes," * ",chunkSizeInKB,"KB == ",(numHashes*chunkSizeInKB)/KB,"MB\n");
+	const auto indexBytes = STOR->buckets->hashesIndex.memoryUsage();
+	const auto indexed = std::max<uint64_t>(STOR->buckets->hashesIndex.size(),1);
+	C+= BUILDSTRING("(Mem) Hash index: ",indexBytes/KB,"KB, ",indexBytes/indexed," bytes per hash\n");
+	C+= BUILDSTRING("Background index: ",STOR->buckets->pendingIndex()," buckets to go, dedup misses not waited for: ",STOR->buckets->missesWhileIndexing.load(),"\n");
+	C+= BUILDSTRING("(Mem) Hash objects: ",hash::instances.load()," (",hashesInMemory.size()," in data buckets)\n");
+	const auto cachedChunks = STOR->cache.size();
+	C+= BUILDSTRING("(Mem) Chunk cache: ",cachedChunks," * ",chunkSizeInKB,"KB == ",(cachedChunks*chunkSizeInKB)/KB,"MB of ",STOR->cache.getBudget()/(KB*KB),"MB\n");
+	C+= BUILDSTRING("(Mem) Chunks waiting to be written: ",STOR->cache.dirtyChunks.load(),"\n");
+	C+= BUILDSTRING("Chunk cache hits: ",STOR->cache.hits.load()," misses: ",STOR->cache.misses.load()," evictions: ",STOR->cache.evictions.load(),"\n");
+	C+= BUILDSTRING("Chunks prefetched: ",STOR->stats.chunksPrefetched.load(),"\n");
+	C+= BUILDSTRING("Dedup verification (",dedupVerifier::modeName(STOR->verifier.getMode()),"): backlog: ",STOR->verifier.backlogSize()," inline: ",STOR->verifier.verifiedInline.load(),
+		" background: ",STOR->verifier.verifiedAsync.load()," skipped: ",STOR->verifier.skipped.load()," collisions: ",STOR->verifier.collisions.load(),"\n");
+	C+= BUILDSTRING("Zero chunks written without hashing: ",STOR->stats.zeroChunksFull.load()," full, ",STOR->stats.zeroChunksPartial.load()," partial\n");
+	C+= BUILDSTRING("Bad bucket records: ",STOR->stats.badRecords.load(),"\n");
+	C+= BUILDSTRING("Packed chunks (",codecName(STOR->getCompression()),"): ",STOR->stats.packedIn.load()/KB,"KB encoded to ",STOR->stats.packedOut.load()/KB,"KB\n");
+	C+= BUILDSTRING("Bucket files open: ",STOR->io.numOpen()," opened: ",STOR->io.opened.load()," reused: ",STOR->io.reused.load()," synced: ",STOR->io.synced.load(),"\n");
 	C+= BUILDSTRING("(Dsk&Mem) Metabuckets: ",numMetaBuckets," * ",bucketSizeInKB,"KB == ",(numMetaBuckets * bucketSizeInKB)/KB,"MB\n");
-	C+= BUILDSTRING("De-duplication stats:\n");
+	C+= BUILDSTRING("De-duplication stats (hashes in memory):\n");
 	for(const auto &i:hashDistribution) {
 		C+= BUILDSTRING("Hashes with refcnt(",i.first,"): ",i.second,"\n");
 	}
 	C+= BUILDSTRING("About ~",numDedupKbs/KB,"MB de-duplicated.\n");
 	
+	C+= JOURNAL->getStats();
+	C+= BUILDSTRING("Directories (",hashedDirectories.load() ? "hashed" : "json","): migrated from JSON: ",directoriesMigrated.load(),"\n");
+	C+= dentries.getStats();
+	C+= BUILDSTRING("SHA-256: ",crypto::sha256batch::implementation(),"\n");
 	C+= BUILDSTRING("Writes:\n");
 	C+= BUILDSTRING("S  < chunk   :",_writeStats.at(0).load(),"\n");
 	C+= BUILDSTRING("S == chunk   :",_writeStats.at(1).load(),"\n");
@@ -1010,6 +1146,15 @@ str fs::getStats() {
 	C+= BUILDSTRING("S >= bucket  :",_readStats.at(4).load(),"\n");
 	
 	
+	C+= BUILDSTRING("Bucket writes:\n");
+	const uint64_t bytesWritten = STOR->stats.bytesWritten;
+	const uint64_t bytesFullRewrite = STOR->stats.bytesFullRewrite;
+	C+= BUILDSTRING("Chunk slots written: ",STOR->stats.slotsWritten.load(),"\n");
+	C+= BUILDSTRING("Written: ",bytesWritten/KB,"KB, full rewrites would be: ",bytesFullRewrite/KB,"KB\n");
+	if(bytesFullRewrite>0) {
+		C+= BUILDSTRING("Written/full rewrite: ",(bytesWritten*100)/bytesFullRewrite,"%\n");
+	}
+	
 	C+= BUILDSTRING("inodes: ",numINodes," ctd's:",numINodeCTD,"\n");
 	C+= BUILDSTRING("files: ",files,"\n");
 	C+= BUILDSTRING("dirs: ",dirs,"\n");
@@ -1052,7 +1197,7 @@ my_off_t fs::readMetadata(unsigned char* buf, my_size_t size, my_off_t offset) {
 std::pair<uint64_t,uint64_t> fs::getStatFS() {
 	//@todo: locking?
 	
-	return std::make_pair<uint64_t,uint64_t>((uint64_t)chunkSize, STOR->buckets->hashesIndex.size()+ STOR->metaBuckets->hashesIndex.size());
+	return std::make_pair<uint64_t,uint64_t>((uint64_t)chunkSize, STOR->buckets->numHashes()+ STOR->metaBuckets->numHashes());
 }
 
 str fs::getParentPath(const str & in) {
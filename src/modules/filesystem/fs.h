@@ -16,8 +16,10 @@
 #include "modules/util/protected_unordered_map.h"
 #include "locks.h"
 #include "file.h"
+#include "readahead.h"
 #include "hash.h"
 #include "context.h"
+#include "dentrycache.h"
 
 
 namespace filesystem{
@@ -47,13 +49,17 @@ namespace filesystem{
 		
 		static constexpr unsigned maxOpenFiles = 128;
 		locktype _mut;
-		util::protected_unordered_map<str,bucketIndex_t> pathInodeCache;
+		dentryCache dentries; //Path lookups, kept up to date by file::addNode & file::removeNode
 		util::protected_unordered_map<const bucketIndex_t,filePtr> inodeFileCache;
 		std::array<util::atomic_shared_ptr<file>,maxOpenFiles> openHandles;
+		std::array<readAhead,maxOpenFiles> readAheads; //Sequential read detection per open handle
 		
 		metaPtr mkobject(const char * filename,my_err_t & errorcode,const context * ctx,my_mode_t type, my_mode_t mod);
 		my_err_t unlinkinner(const char * filename, const context * ctx=nullptr,shared_ptr<journalEntryWrapper> je=nullptr);
 		my_err_t renamemoveinner(const char* source, const char* dest, const context* ctx, std::shared_ptr< filesystem::journalEntryWrapper > je);
+		filePtr getDirectoryOf(const char * filename,size_t nameStart,my_err_t * errcode); //The directory holding the component at nameStart.
+		filePtr walkDirectory(uint64_t parent,const char * filename,size_t nameStart,my_err_t * errcode); //Same, cached files first as the walk already has the inode.
+		my_err_t lookupComponent(const filePtr & parentFile,const char * filename,size_t nameStart,size_t nameEnd,uint64_t parent,uint64_t & ino,bool & isDir,filePtr & child); //Reads the directory after a dentry miss.
 		
 		
 		
@@ -61,10 +67,11 @@ namespace filesystem{
 
 
 		
-		void storeMetadata(void);
+		void storeMetadata(bool unmount = false); //At unmount the dedup index is written as well.
 		
 		locktype outstandingWrites;
 		locktype actualWriting;
+		locktypeshared directoryWrites; //Shared while a hashed directory changes its blocks, so storeAllData never stores half a split.
 	
 	
 		bool up_and_running = false;
@@ -78,6 +85,8 @@ namespace filesystem{
 		crypto::sha256sum zeroSum;
 		hashPtr _zeroHash;
 		std::array<std::atomic_uint64_t,5> _writeStats,_readStats;
+		std::atomic_bool hashedDirectories{false};
+		std::atomic_uint64_t directoriesMigrated{0};
 		static unsigned classifySize(my_size_t size) {
 			if(size<chunkSize) return 0;
 			if(size==chunkSize) return 1;
@@ -100,9 +109,12 @@ namespace filesystem{
 
 		
 		void migrate(unique_ptr<crypto::protocolInterface> newProtocol);
+		void setHashedDirectories(bool h) { hashedDirectories = h; } //Changed directories are written (& JSON ones migrated) as hashedDirectory, else as JSON. Opt in, older versions only read JSON.
+		bool getHashedDirectories(void) { return hashedDirectories.load(); }
 
 
 		my_err_t replayEntry(const journalEntry * entry, const str & name, const str & data,const context * ctx,shared_ptr<journalEntryWrapper> je);
+		void claimEntry(const journalEntry * entry,const str & payload); //Before any entry is replayed: the ids it puts things at leave the pools.
 		
 		str loadMetaDataFromINode(inode* node);
 		void storeMetaDataInINode(inode * rootNode,const str & input);
@@ -112,6 +124,7 @@ namespace filesystem{
 		
 		fileHandle open(filePtr F);
 		void close(filePtr F,fileHandle H);
+		readAhead * getReadAhead(const fileHandle H);
 
 		my_err_t _mkdir(const char * name,my_mode_t mode, const context * ctx=nullptr);
 		my_err_t mknod(const char * filename, my_mode_t mode, my_dev_t dev, const context * ctx=nullptr);
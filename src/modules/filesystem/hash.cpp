@@ -6,7 +6,7 @@
  * the incRefCnt will check the hash is not flagged for deletion
  * the decRefCnt will remove the hash from the storage layer.
  * 
- * the read and write operation will pull the associated chunk from the bucket.
+ * the read and write operation will pull the associated chunk from the bucket (and so through the chunk cache).
  * 
  * All operation will inform lower storage layer of changes so the lower layer knows when to write buckets.
  */
@@ -16,6 +16,7 @@
 #include "bucketaccounting.h"
 #include "storage.h"
 #include <mutex>
+#include <algorithm>
 using namespace filesystem;
 
 str bucketIndex_t::toString() const {
@@ -51,79 +52,146 @@ my_off_t hash::incRefCnt(my_off_t in) {
 	refcnt += in;
 	if(isFlags(FLAG_NOAUTOLOAD|FLAG_NOAUTOSTORE)==false) {
 		_ASSERT(isFlags(FLAG_DELETED)==false);//Never revide a dead hash!
-		STOR->buckets->getBucket(bucketIndex.bucket())->hashChanged();
+		STOR->buckets->getBucket(bucketIndex.bucket())->hashChanged(bucketIndex.index());
 	}
 	return refcnt;
 }
 
 my_off_t hash::decRefCnt(my_off_t in) {
+	if(isFlags(FLAG_NOAUTOLOAD)==false) {
+		STOR->buckets->ensureIndexed(bucketIndex.bucket());//A hash has to be indexed before it can be deleted.
+	}
 	refcnt -= in;
 	if(isFlags(FLAG_NOAUTOLOAD|FLAG_NOAUTOSTORE|FLAG_DELETED)==false) {
 		if (refcnt == 0) {
 			setFlags(FLAG_DELETED);
-			auto hsh = STOR->buckets->hashesIndex.get(_hsh);
-			_ASSERT(hsh.get()==this);
-			if (STOR->buckets->hashesIndex.erase(_hsh) == 1) {
+			if (STOR->buckets->dropHash(_hsh,this)) {
 				//srvDEBUG("Posting hash+bucket: ",in.toShortStr(),bucket.fullindex);
 				STOR->buckets->getBucket(bucketIndex.bucket())->clearHashAndChunk(bucketIndex.index());
 				STOR->buckets->accounting->post(bucketIndex);
 			} else {
 				STOR->srvERROR("Failed to delete hash ",_hsh.toShortStr(), " from global index");
 			}
-			clearData();
 		}
-		STOR->buckets->getBucket(bucketIndex.bucket())->hashChanged();
+		STOR->buckets->getBucket(bucketIndex.bucket())->hashChanged(bucketIndex.index());
 	}
 	return refcnt;
 }
 
+void hash::changeRefCnts(refCntDeltas deltas) {
+	//Order on bucket, then on object, so equal hashes can be merged & every bucket is handled in one go.
+	std::sort(deltas.begin(),deltas.end(),[](const refCntDeltas::value_type & a,const refCntDeltas::value_type & b) {
+		const uint64_t A = a.first->getBucketIndex().fullindex(),B = b.first->getBucketIndex().fullindex();
+		return A!=B ? A<B : a.first.get()<b.first.get();
+	});
+	size_t merged = 0;
+	for(auto & d: deltas) {
+		_ASSERT(d.first!=nullptr);
+		if(merged>0 && deltas[merged-1].first==d.first) {
+			deltas[merged-1].second += d.second;
+		} else {
+			if(&deltas[merged]!=&d) {
+				deltas[merged] = std::move(d);
+			}
+			++merged;
+		}
+	}
+	deltas.resize(merged);
+
+	std::vector<bucketIndex_t> freed;
+	for(size_t first=0,last=0;first<deltas.size();first=last) {
+		const auto id = deltas[first].first->getBucketIndex().bucket();
+		bool stored = false,decrements = false;
+		for(last=first;last<deltas.size() && deltas[last].first->getBucketIndex().bucket()==id;++last) {
+			auto & h = *deltas[last].first;
+			stored |= h.isFlags(FLAG_NOAUTOLOAD|FLAG_NOAUTOSTORE)==false;
+			decrements |= deltas[last].second<0 && h.isFlags(FLAG_NOAUTOLOAD)==false;
+		}
+		if(decrements) {
+			STOR->buckets->ensureIndexed(id);//A hash has to be indexed before it can be deleted.
+		}
+		bucket * B = stored ? STOR->buckets->getBucket(id) : nullptr;
+		std::vector<int64_t> cleared;
+		for(size_t a=first;a<last;a++) {
+			auto & h = *deltas[a].first;
+			const auto delta = deltas[a].second;
+			if(delta>0) {
+				h.refcnt += delta;
+				if(h.isFlags(FLAG_NOAUTOLOAD|FLAG_NOAUTOSTORE)==false) {
+					_ASSERT(h.isFlags(FLAG_DELETED)==false);//Never revide a dead hash!
+					B->hashChanged(h.bucketIndex.index());
+				}
+			} else if(delta<0) {
+				h.refcnt += delta;
+				if(h.isFlags(FLAG_NOAUTOLOAD|FLAG_NOAUTOSTORE|FLAG_DELETED)==false) {
+					if(h.refcnt==0) {
+						h.setFlags(FLAG_DELETED);
+						if(STOR->buckets->dropHash(h._hsh,&h)) {
+							cleared.push_back(h.bucketIndex.index());
+							freed.push_back(h.bucketIndex);
+						} else {
+							STOR->srvERROR("Failed to delete hash ",h._hsh.toShortStr(), " from global index");
+						}
+					}
+					B->hashChanged(h.bucketIndex.index());
+				}
+			}
+		}
+		if(!cleared.empty()) {
+			B->clearHashesAndChunks(cleared);
+		}
+	}
+	//The slots go back to the pool after all buckets are updated.
+	for(auto & f: freed) {
+		STOR->buckets->accounting->post(f);
+	}
+}
+
 bool hash::compareChunk(shared_ptr<chunk> c) {
-	auto d = data(true);
+	auto d = data();
 	_ASSERT(d!=nullptr);
 	return d->compareChunk(c);
 }
 
-std::shared_ptr<chunk> hash::data(bool load) {
-	std::shared_ptr<chunk> ret = _data;
-	if(ret==nullptr && isFlags(FLAG_NOAUTOLOAD)==false && load) {
-		ret = STOR->buckets->getChunk(bucketIndex);
-		_data = ret;
-	}
-	return ret;
-}
-bool hash::clearData() {
-	if(isFlags(FLAG_NOAUTOSTORE) == false) {
-		auto T = _data.exchange(std::shared_ptr<chunk>());
-		if(T!=nullptr) {
-			return true;
-		}
+std::shared_ptr<chunk> hash::data(void) {
+	if(isFlags(FLAG_NOAUTOLOAD)) {
+		return _data;
 	}
-	return false;
+	return STOR->buckets->getChunk(bucketIndex);
 }
-bool hash::hasData() { return _data.load()!=nullptr; }
 
 
-filesystem::hash::hash(const crypto::sha256sum & ihash, const bucketIndex_t ibucket, const script::int_t irefcnt, std::shared_ptr<chunk> idata, flagtype iflags): _hsh(ihash),bucketIndex(ibucket),refcnt(irefcnt), _data(idata) ,flags(iflags){
+std::atomic_int64_t hash::instances{0};
+
+filesystem::hash::hash(const crypto::sha256sum & ihash, const bucketIndex_t ibucket, const script::int_t irefcnt, std::shared_ptr<chunk> idata, flagtype iflags): _hsh(ihash),bucketIndex(ibucket),refcnt(irefcnt), _data((iflags & FLAG_NOAUTOLOAD) ? idata : nullptr) ,flags(iflags){
+	++instances;
 }
 
 hash::~hash() {
-	rest();
+	--instances;
 }
 
 
 
 void hash::read(my_off_t offset,my_size_t size,unsigned char * output) {
-	auto d = data(true);
+	auto d = data();
 	_ASSERT(d!=nullptr);
 	d->read(offset,size,output);
 }
 
 hashPtr hash::write(my_off_t offset,my_size_t size,const unsigned char * input) {
-	auto d = data(true);
+	auto newChunk = writeChunk(offset,size,input);
+	return update(newChunk->getHash(),newChunk);
+}
+
+std::shared_ptr<chunk> hash::writeChunk(my_off_t offset,my_size_t size,const unsigned char * input) {
+	auto d = data();
 	_ASSERT(d!=nullptr);
-	auto newChunk = d->write(offset,size,input);
-	//Hash the new chunk + compare to current hash: if same, return nullptr
-	auto newHash = newChunk->getHash();
+	return d->write(offset,size,input);
+}
+
+hashPtr hash::update(const crypto::sha256sum & newHash,std::shared_ptr<chunk> newChunk) {
+	//Compare to current hash: if same, return nullptr
 	if( _hsh==newHash) {
 		return nullptr;
 	}
@@ -132,8 +200,5 @@ hashPtr hash::write(my_off_t offset,my_size_t size,const unsigned char * input)
 	return STOR->newHash(newHash,newChunk);
 }
 
-bool hash::rest(void) {
-	return clearData();//Currently a clearData operation is exactly the same a "rest" operation
-}
 
 
@@ -9,6 +9,8 @@
 #include "types.h"
 #include <atomic>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace filesystem {
 	class chunk;
@@ -60,7 +62,7 @@ namespace filesystem {
 		const crypto::sha256sum _hsh;
 		const bucketIndex_t bucketIndex;
 		std::atomic<my_off_t> refcnt;		
-		util::atomic_shared_ptr<chunk> _data;
+		const std::shared_ptr<chunk> _data; //Only for hashes that are not stored in a bucket (FLAG_NOAUTOLOAD)
 		std::atomic<flagtype> flags;
 		void clearFlags(flagtype in);
 		void setFlags(flagtype in);
@@ -72,6 +74,7 @@ namespace filesystem {
 		static constexpr flagtype FLAG_DELETED     = 1 << 0;
 		static constexpr flagtype FLAG_NOAUTOSTORE = 1 << 1;
 		static constexpr flagtype FLAG_NOAUTOLOAD  = 1 << 2;
+		static std::atomic_int64_t instances; //Number of hash objects in memory
 
 		const crypto::sha256sum & getHashPrimitive() {return _hsh;};
 		script::str_t getHashStr() const { return _hsh.toShortStr(); };
@@ -79,13 +82,13 @@ namespace filesystem {
 		my_off_t getRefCnt();
 		my_off_t incRefCnt(my_off_t in=1);
 		my_off_t decRefCnt(my_off_t in=1);
+		//Applies many refcount changes at once: merged per hash, each bucket is looked up once & freed slots are handed back together.
+		static void changeRefCnts(std::vector<std::pair<std::shared_ptr<hash>,my_off_t>> deltas);
 		
 		
 		bool compareChunk(shared_ptr<chunk> c);
 		
-		std::shared_ptr<chunk> data(bool load=false);
-		bool clearData();
-		bool hasData();
+		std::shared_ptr<chunk> data(void);
 		
 		
 		hash(const crypto::sha256sum & ihash, const bucketIndex_t ibucket, const script::int_t irefcnt ,std::shared_ptr<chunk> idata, flagtype iflags = 0);
@@ -95,12 +98,15 @@ namespace filesystem {
 
 		void read(my_off_t offset,my_size_t size,unsigned char * output);
 		std::shared_ptr<hash> write(my_off_t offset,my_size_t size,const unsigned char * input);
-		bool rest(void);
+		//write in two steps, so callers can hash the new chunks of a whole range at once in between.
+		std::shared_ptr<chunk> writeChunk(my_off_t offset,my_size_t size,const unsigned char * input);
+		std::shared_ptr<hash> update(const crypto::sha256sum & newHash,std::shared_ptr<chunk> newChunk); //nullptr if the content did not change.
 		
 		//hash(const str & ihash, const script::int_t ibucket, const script::int_t iindex, const script::int_t irefcnt, std::shared_ptr<chunk> idata);
 
 	};
 	typedef std::shared_ptr<hash> hashPtr;
+	typedef std::vector<std::pair<hashPtr,my_off_t>> refCntDeltas;
 
 	
 }
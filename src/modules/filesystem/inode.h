@@ -52,7 +52,7 @@ namespace filesystem {
 	private:
 		inode_header header;
 	public:
-		constexpr static unsigned numctd = 495;
+		constexpr static unsigned numctd = (chunkSize-136)/sizeof(bucketIndex_t); //The fields before ctd take 136 bytes (495 for 4K chunks)
 		constexpr static uint32_t latestversion = 1;
 		constexpr static inode_type mytype = inode_type::NODE;
 		bucketIndex_t myID;        //Inode number (my own node ID) 
@@ -81,7 +81,7 @@ namespace filesystem {
 	private:
 		inode_header header;
 	public:
-		constexpr static unsigned numctd = 508;
+		constexpr static unsigned numctd = (chunkSize-32)/sizeof(bucketIndex_t); //The fields before ctd take 32 bytes (508 for 4K chunks)
 		constexpr static uint32_t latestversion = 1;
 		constexpr static inode_type mytype = inode_type::CTD;
 		bucketIndex_t myID;     //my own node ID
@@ -4,17 +4,92 @@
 #define FILESYSTEM_JOURNAL_CPP
 #include "journal.h"
 #include "storage.h"
+#include "bucket.h"
 #include "fs.h"
 #include "modules/util/files.h"
+#include "modules/util/threadpool.h"
 #include <algorithm>
 #include <filesystem>
 #include <thread>
 #include <fstream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
 
 using namespace filesystem;
 
+journalDurability filesystem::durabilityFromName(const str & name) {
+	if(name=="none") {
+		return journalDurability::NONE;
+	}
+	if(name=="batched") {
+		return journalDurability::BATCHED;
+	}
+	if(name=="sync") {
+		return journalDurability::SYNC;
+	}
+	throw std::invalid_argument(str("unknown journal mode "+name).c_str());
+}
+
+const char * filesystem::durabilityName(journalDurability d) {
+	switch(d) {
+		case journalDurability::NONE: return "none";
+		case journalDurability::BATCHED: return "batched";
+		case journalDurability::SYNC: return "sync";
+	}
+	return "unknown";
+}
+
+journalDataMode filesystem::dataModeFromName(const str & name) {
+	if(name=="journal") {
+		return journalDataMode::JOURNAL;
+	}
+	if(name=="ordered") {
+		return journalDataMode::ORDERED;
+	}
+	throw std::invalid_argument(str("unknown journal data mode "+name).c_str());
+}
+
+const char * filesystem::dataModeName(journalDataMode m) {
+	return m==journalDataMode::ORDERED ? "ordered" : "journal";
+}
+
+
+journalEntryWrapper::journalEntryWrapper(
+	const uint32_t iid,
+	const journalEntryType itype, 
+	const bucketIndex_t iparentNode,
+	const bucketIndex_t inewNode,
+	const bucketIndex_t inewParentNode,
+	const my_mode_t imod,
+	const my_off_t ioffset, 
+	const str & name, 
+	const str & data
+) : 
+	inner{iid,itype,iparentNode,inewNode,inewParentNode,imod,ioffset,name.size(),data.size()}
+	{
+	try{
+		JOURNAL->writeEntry(&inner,name,data);
+	} catch(std::exception & e) {
+		JOURNAL->endEntry(inner.id);
+		throw;
+	}
+}
 
 journalEntryWrapper::journalEntryWrapper(
+	const std::set<uint64_t> * ordered,
 	const uint32_t iid,
 	const journalEntryType itype, 
 	const bucketIndex_t iparentNode,
@@ -27,41 +102,205 @@ journalEntryWrapper::journalEntryWrapper(
 ) : 
 	inner{iid,itype,iparentNode,inewNode,inewParentNode,imod,ioffset,name.size(),data.size()}
 	{
-	file = JOURNAL->writeEntry(&inner,name,data);
-	_ASSERT(file!=nullptr);
+	try{
+		JOURNAL->writeEntry(&inner,name,data,ordered);
+	} catch(std::exception & e) {
+		JOURNAL->endEntry(inner.id);
+		throw;
+	}
 }
 
 journalEntryWrapper::~journalEntryWrapper() {
-	file->deleteEntry(&inner);
+	//The changes are in their buckets (bucket::addChange) by now, those keep the entry below the watermark until they are stored.
+	JOURNAL->endEntry(inner.id);
 }
 
 namespace filesystem {
+	const str segmentMagic("GDCJSEG1"); //Starts every segment that is in use, a retired segment starts with zeros.
+	
 	class journalFileImpl{
 		public:
+#ifndef _WIN32
+		int fd = -1;
+		uint64_t tailStart = 0; //Offset of the block that is written partly, the next write starts there.
+		str tail; //What that block holds so far.
+		char * buffer = nullptr; //Block aligned, as O_DIRECT needs.
+		size_t bufferSize = 0;
+#else
 		std::ofstream F;
+#endif
 		shared_ptr<crypto::streamInterface> cryptostream;
+
+#ifndef _WIN32
+		~journalFileImpl() {
+			free(buffer);
+		}
+
+		char * alignedBuffer(size_t size) {
+			if(size > bufferSize) {
+				free(buffer);
+				void * p = nullptr;
+				_ASSERT(posix_memalign(&p,journalBlockSize,size)==0);
+				buffer = static_cast<char*>(p);
+				bufferSize = size;
+			}
+			return buffer;
+		}
+
+		bool writeAt(const char * p,size_t size,uint64_t offset) {
+			while(size > 0) {
+				const auto n = ::pwrite(fd,p,size,offset);
+				if(n < 0) {
+					if(errno==EINTR) {
+						continue;
+					}
+					return false;
+				}
+				p += n;
+				size -= n;
+				offset += n;
+			}
+			return true;
+		}
+#endif
+
+		bool write(std::vector<str> & buffers) {
+#ifndef _WIN32
+			//Whole blocks only: the block that was written partly last time is written again with the new records behind it.
+			size_t size = tail.size();
+			for(auto & b: buffers) {
+				size += b.size();
+			}
+			const size_t padded = (size + journalBlockSize - 1) / journalBlockSize * journalBlockSize;
+			char * p = alignedBuffer(padded);
+			memcpy(p,tail.data(),tail.size());
+			size_t pos = tail.size();
+			for(auto & b: buffers) {
+				memcpy(p+pos,b.data(),b.size());
+				pos += b.size();
+			}
+			//Replay stops at the zeros, they do not decrypt.
+			memset(p+size,0,padded-size);
+			if(!writeAt(p,padded,tailStart)) {
+				return false;
+			}
+			const size_t full = size / journalBlockSize * journalBlockSize;
+			tail.assign(p+full,size-full);
+			tailStart += full;
+			return true;
+#else
+			for(auto & b: buffers) {
+				F.write(b.data(),b.size());
+			}
+			F.flush();
+			return F.good();
+#endif
+		}
+
+		bool sync(void) {
+#ifndef _WIN32
+			int ret;
+			do {
+#ifdef __APPLE__
+				ret = ::fsync(fd);
+#else
+				ret = ::fdatasync(fd);
+#endif
+			} while(ret!=0 && errno==EINTR);
+			return ret==0;
+#else
+			F.flush();
+			return F.good();
+#endif
+		}
+
+		bool invalidate(void) { //Zero the first block, so replay skips the segment. False when the file has to go instead.
+#ifndef _WIN32
+			char * p = alignedBuffer(journalBlockSize);
+			memset(p,0,journalBlockSize);
+			return writeAt(p,journalBlockSize,0) && sync();
+#else
+			return false;
+#endif
+		}
 	};
 };
 
 
-journalFile::journalFile(const str & ifilename) : filename(ifilename),entries(0), impl(std::make_unique<journalFileImpl>()) {
-	impl->F.open(filename.c_str(),std::ios::binary|std::ios::out|std::ios::app);
+journalFile::journalFile(const str & ifilename,bool fresh) : filename(ifilename), impl(std::make_unique<journalFileImpl>()) {
 	str header;
 	impl->cryptostream = STOR->prot()->startStreamWrite(STOR->prot()->getProtoEncryptionKey(),header);
-	JOURNAL->srvMESSAGE("creating log: ",filename);
-	impl->F.write(header.data(),header.size());
+	JOURNAL->srvMESSAGE(fresh ? "creating log: " : "reusing log: ",filename);
+#ifndef _WIN32
+	int flags = O_WRONLY|O_CREAT|O_CLOEXEC;
+#ifdef O_DIRECT
+	if(JOURNAL->getDirect()) {
+		flags |= O_DIRECT;
+	}
+#endif
+	do {
+		impl->fd = ::open(filename.c_str(),flags,0666);
+	} while(impl->fd < 0 && errno==EINTR);
+#ifdef O_DIRECT
+	if(impl->fd < 0 && errno==EINVAL && (flags & O_DIRECT)) {
+		JOURNAL->srvWARNING("O_DIRECT is not supported for ",filename,", journaling through the page cache");
+		JOURNAL->setDirect(false);
+		impl->fd = ::open(filename.c_str(),flags & ~O_DIRECT,0666);
+	}
+#endif
+	_ASSERT(impl->fd >= 0);
+#ifdef __linux__
+	if(fresh) {
+		//Allocated up front, so appends & their fdatasync do not change the size or the extents of the file.
+		const auto err = ::posix_fallocate(impl->fd,0,journalSegmentSize);
+		if(err!=0) {
+			JOURNAL->srvWARNING("Preallocating ",filename," failed: ",err);
+		}
+	}
+#endif
+#else
+	impl->F.open(filename.c_str(),std::ios::binary|std::ios::out|std::ios::trunc);
+#endif
+	std::vector<str> first{segmentMagic+header};
+	headerSize = used = first[0].size();
+	_ASSERT(impl->write(first));
+	if(fresh && JOURNAL->getDurability()!=journalDurability::NONE) {
+#ifndef _WIN32
+		//The new file has to survive a crash too, not only its content.
+		const auto dir = ::open(JOURNAL->path.c_str(),O_RDONLY|O_CLOEXEC);
+		if(dir >= 0) {
+			::fsync(dir);
+			::close(dir);
+		}
+#endif
+	}
 }
 
 journalFile::~journalFile() {
+	const bool reusable = retired && impl->invalidate();
+#ifndef _WIN32
+	if(impl->fd >= 0) {
+		::close(impl->fd);
+	}
+#else
 	if(impl->F.is_open()) {
 		impl->F.close();
 	}
-	JOURNAL->srvMESSAGE("removing log: ",filename);
-	_ASSERT(std::filesystem::remove(filename.c_str())==true);
+#endif
+	if(retired) {
+		JOURNAL->segmentRetired(filename,reusable);
+	} else {
+		JOURNAL->srvMESSAGE("keeping log: ",filename);
+	}
+}
+
+bool journalFile::fits(size_t payload) {
+	std::unique_lock<std::mutex> l(_mut);
+	const size_t size = impl->cryptostream->encryptionOverhead(sizeof(journalEntry)) + (payload ? impl->cryptostream->encryptionOverhead(payload) : 0);
+	return used==headerSize || used+size <= journalSegmentSize;
 }
 
-void journalFile::writeEntry(const journalEntry * entry,const str & name,const str & data) {
-	_ASSERT(impl->F.is_open());
+uint64_t journalFile::writeEntry(const journalEntry * entry,const str & name,const str & data,bool durable) {
 	const char * ep = reinterpret_cast<const char *>(entry);
 	str content(ep,sizeof(journalEntry));
 	_ASSERT(content.size()==sizeof(journalEntry));
@@ -69,147 +308,603 @@ void journalFile::writeEntry(const journalEntry * entry,const str & name,const s
 	datacontent.append(data);
 	_ASSERT(datacontent.size()==name.size()+data.size());
 	str encryptedContent;
+	std::unique_lock<std::mutex> l(_mut);
 	impl->cryptostream->message(content,encryptedContent);
 	if(datacontent.size()) {
 		str encryptedData;
 		impl->cryptostream->message(datacontent,encryptedData);
 		encryptedContent.append(encryptedData);
 	}
-	JOURNAL->srvDEBUG(entry->type==journalEntryType::close? "Removing": "Adding"," journal entry ",entry->id," size: ",encryptedContent.size()," log: ",filename);
-	impl->F.write(encryptedContent.data(),encryptedContent.size());
-	impl->F.flush();
-	++entries;
+	if(entry->type==journalEntryType::checkpoint) {
+		JOURNAL->srvDEBUG("Checkpoint at journal entry ",entry->offset," log: ",filename);
+	} else {
+		JOURNAL->srvDEBUG("Adding journal entry ",entry->id," size: ",encryptedContent.size()," log: ",filename);
+		maxId = std::max<uint64_t>(maxId,entry->id);
+		hasEntries = true;
+	}
+	JOURNAL->bytesQueued += encryptedContent.size();
+	used += encryptedContent.size();
+	pending.push_back(std::move(encryptedContent));
+	needSync = needSync || durable;
+	return ++queued;
 }
 
-void journalFile::deleteEntry(const journalEntry * entry) {
-	const journalEntry closeEntry{entry->id,journalEntryType::close,bucketIndex_t(),bucketIndex_t(),bucketIndex_t(),0,0,0,0};
-	writeEntry(&closeEntry,"","");
+void journalFile::commit(bool sync) {
+	std::unique_lock<std::mutex> w(_writeMut);
+	std::vector<str> batch;
+	uint64_t upto;
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		batch.swap(pending);
+		upto = queued;
+		sync = sync || needSync;
+		needSync = false;
+		if(batch.empty() && (!sync || synced>=upto)) {
+			return;
+		}
+	}
+	if(!batch.empty()) {
+		if(!impl->write(batch)) {
+			JOURNAL->srvERROR("Writing ",batch.size()," records to ",filename," failed");
+		}
+		++JOURNAL->commits;
+		JOURNAL->recordsWritten += batch.size();
+	}
+	if(sync) {
+		if(!impl->sync()) {
+			JOURNAL->srvERROR("Syncing ",filename," failed");
+		}
+		++JOURNAL->syncs;
+	}
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		if(sync) {
+			synced = upto;
+		}
+	}
+	_cv.notify_all();
 }
 
+void journalFile::waitFor(uint64_t record) {
+	std::unique_lock<std::mutex> l(_mut);
+	_cv.wait(l,[&]() { return synced>=record; });
+}
 
 
+shared_ptr<journalFile> journal::getJournalFile(size_t payload,bool & rotated) {
+	if(!current || !current->fits(payload)) {// if the segment is full, take a retired one or make a new one & return that.
+		str filename;
+		bool fresh = false;
+		{
+			std::unique_lock<std::mutex> l(_freeMut);
+			if(freeSegments.empty()) {
+				filename = BUILDSTRING(path,"/segment.",nextSegment++);
+				++segmentFiles;
+				fresh = true;
+			} else {
+				filename = freeSegments.back();
+				freeSegments.pop_back();
+			}
+		}
+		current = std::make_shared<journalFile>(filename,fresh);
+		segments.push_back(current);
+		rotated = true;
+	}
+	return current;
+}
 
-shared_ptr<journalFile> journal::getJournalFile() {
-	static thread_local std::weak_ptr<journalFile> jf;
-	
-	if(auto myFile = jf.lock()) {
-		if(myFile->getEntries() > 1024) {// if too many entries for file, make new file & return that.
-			size_t nextid = nextJournalEntry.fetch_add(1);
-			const str filename = BUILDSTRING(STOR->getPath(),"journal/.",nextid);
-			myFile = std::make_shared<journalFile>(filename);
-			jf = myFile;
+void journal::segmentRetired(const str & filename,bool reusable) {
+	std::unique_lock<std::mutex> l(_freeMut);
+	if(reusable && segmentFiles <= journalRingSegments) {
+		srvDEBUG("retiring log: ",filename);
+		freeSegments.push_back(filename);
+	} else {
+		//More segments than the ring holds were needed for a while.
+		srvMESSAGE("removing log: ",filename);
+		std::filesystem::remove(filename.c_str());
+		--segmentFiles;
+	}
+}
+
+uint32_t journal::beginEntry(void) {
+	std::unique_lock<std::mutex> l(_inflightMut);
+	const auto id = nextJournalEntry.fetch_add(1);
+	inflight.insert(id);
+	return id;
+}
+
+void journal::endEntry(uint32_t id) {
+	std::unique_lock<std::mutex> l(_inflightMut);
+	inflight.erase(id);
+}
+
+uint64_t journal::watermark(void) {
+	uint64_t ret;
+	{
+		//Entries that start after this get a higher id.
+		std::unique_lock<std::mutex> l(_inflightMut);
+		ret = inflight.empty() ? nextJournalEntry.load() : *inflight.begin();
+	}
+	ret = std::min(ret,STOR->buckets->oldestJournalEntry());
+	return std::min(ret,STOR->metaBuckets->oldestJournalEntry());
+}
+
+void journal::checkpoint(void) {
+	const auto W = watermark();
+	{
+		std::unique_lock<std::mutex> l(_fileMut);
+		if(W<=lastCheckpoint) {
+			return;
 		}
-		
-		return myFile;
 	}
-	size_t id = nextJournalEntry.fetch_add(1);
-	
-	const str filename = BUILDSTRING(STOR->getPath(),"journal/.",id);
-	
-	auto ret = std::make_shared<journalFile>(filename);
-	
-	jf = ret;
-	
-	return ret;
+	//The bucket files below W are written, not synced. The entries stay in the journal until they are.
+	if(STOR->io.sync()==false) {
+		srvERROR("Failed to sync the bucket files, the journal keeps their entries");
+		return;
+	}
+	shared_ptr<journalFile> F;
+	std::vector<shared_ptr<journalFile>> retiredFiles; //Zeroing their first block happens outside the lock.
+	{
+		std::unique_lock<std::mutex> l(_fileMut);
+		if(W<=lastCheckpoint) {
+			return;
+		}
+		lastCheckpoint = W;
+		for(auto it = segments.begin();it!=segments.end();) {
+			if((*it)->coveredBy(W)) {
+				if(*it==current) {
+					current = nullptr;
+				}
+				(*it)->retire();
+				retiredFiles.push_back(*it);
+				it = segments.erase(it);
+				++segmentsRetired;
+			} else {
+				++it;
+			}
+		}
+		//Replay skips the entries below W that are still in the files that are left.
+		F = current;
+		if(F) {
+			const journalEntry cp{0,journalEntryType::checkpoint,bucketIndex_t(),bucketIndex_t(),bucketIndex_t(),0,(my_off_t)W,0,0};
+			F->writeEntry(&cp,"","",false);
+		}
+	}
+	++checkpoints;
+	if(F) {
+		requestCommit(F);
+	}
 }
 
+void journal::writeEntry(const journalEntry * entry,const str & name,const str & data,const std::set<uint64_t> * orderedBuckets) {
+	const auto start = std::chrono::steady_clock::now();
+	if(orderedBuckets) {
+		//Synced in every durability mode: the write releases the hashes it replaced once the entry is on disk.
+		orderedEntry o{entry,name,data,*orderedBuckets};
+		{
+			std::unique_lock<std::mutex> l(_commitMut);
+			if(!stopping) {
+				ordered.push_back(&o);
+				_commitCv.notify_one();
+				_orderedCv.wait(l,[&o]() { return o.done; });
+			}
+		}
+		if(!o.done) {
+			commitOrdered({&o});
+		}
+		latency[(unsigned)journalDurability::BATCHED].add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count());
+		if(!o.ok) {
+			throw std::runtime_error("the buckets of an ordered entry could not be stored");
+		}
+		return;
+	}
+	const auto mode = durability.load();
+	bool rotated = false;
+	shared_ptr<journalFile> F;
+	uint64_t record;
+	{
+		std::unique_lock<std::mutex> l(_fileMut);
+		F = getJournalFile(name.size()+data.size(),rotated);
+		record = F->writeEntry(entry,name,data,mode!=journalDurability::NONE);
+	}
+	if(mode==journalDurability::SYNC) {
+		F->commit(true);
+	} else {
+		requestCommit(F);
+		if(mode==journalDurability::BATCHED) {
+			F->waitFor(record);
+		}
+	}
+	latency[(unsigned)mode].add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count());
+	if(rotated) {
+		checkpoint();
+	}
+}
 
-shared_ptr<journalFile> journal::writeEntry(const journalEntry * entry,const str & name,const str & data) {
-	auto F = getJournalFile();
-	
-	F->writeEntry(entry,name,data);
-	
-	return F;
+void journal::requestCommit(shared_ptr<journalFile> f) {
+	{
+		std::unique_lock<std::mutex> l(_commitMut);
+		if(!stopping) {
+			if(std::find(toCommit.begin(),toCommit.end(),f)==toCommit.end()) {
+				toCommit.push_back(std::move(f));
+				_commitCv.notify_one();
+			}
+			return;
+		}
+	}
+	f->commit(false);
 }
 
-void journal::tryReplay(void) {
-	auto ptr = make_unique<filesystem::context>(); 
-	std::vector<str> files;
-	str completeJournal;
-	for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) { 
-		const str p = str(entry.path().generic_string().c_str());
-		str encryptedJournal = util::getSystemString(p);
-		str header = encryptedJournal.substr(0,STOR->prot()->streamHeaderSize());
-		auto cryptostream = STOR->prot()->startStreamRead(STOR->prot()->getProtoEncryptionKey(),header);
-		size_t offset = STOR->prot()->streamHeaderSize();
-		auto entryEncSize = cryptostream->encryptionOverhead(sizeof(journalEntry));
-		while(offset<encryptedJournal.size()) {
-			str entryEnc(&encryptedJournal[offset],entryEncSize);
-			str entry;
-			cryptostream->message(entryEnc,entry);
-			_ASSERT(entry.size()==sizeof(journalEntry));
-			completeJournal.append(entry);
-			auto e = reinterpret_cast<const journalEntry *>(&entry[0]);
-			offset+=entryEncSize;
-			if(e->dataLength + e->nameLength) {
-				auto dataEncSize = cryptostream->encryptionOverhead(e->nameLength+e->dataLength);
-				str dataEnc(&encryptedJournal[offset],dataEncSize);
-				str data;
-				cryptostream->message(dataEnc,data);
-				completeJournal.append(data);
-				offset+=dataEncSize;
+void journal::runCommitter(void) {
+	for(;;) {
+		std::deque<shared_ptr<journalFile>> batch;
+		std::deque<orderedEntry*> orderedBatch;
+		{
+			std::unique_lock<std::mutex> l(_commitMut);
+			_commitCv.wait(l,[this]() { return stopping || !toCommit.empty() || !ordered.empty(); });
+			if(toCommit.empty() && ordered.empty()) {
+				return;
 			}
+			batch.swap(toCommit);
+			orderedBatch.swap(ordered);
 		}
-		files.push_back(p);
+		if(!orderedBatch.empty()) {
+			commitOrdered(orderedBatch);
+		}
+		//Everything queued while the previous commit was busy goes out in one write (& fdatasync) per file.
+		for(auto & f: batch) {
+			f->commit(false);
+		}
+	}
+}
+
+/**
+ * The ordered writes of one window: every bucket they wrote is stored & synced once, then their entries are queued
+ * & committed. Nothing of them reaches the journal if a bucket fails, the writers roll back.
+ */
+void journal::commitOrdered(const std::deque<orderedEntry*> & batch) {
+	std::set<uint64_t> buckets;
+	for(auto * o: batch) {
+		buckets.insert(o->buckets.begin(),o->buckets.end());
+	}
+	bool ok = true;
+	try{
+		std::vector<str> files;
+		files.reserve(buckets.size()*2);
+		for(auto b: buckets) {
+			for(auto & f: STOR->buckets->getBucket(b)->storeOrdered()) {
+				files.push_back(f);
+			}
+		}
+		ok = STOR->io.sync(files);
+	} catch(std::exception & e) {
+		srvERROR("Storing the buckets of ordered entries failed: ",e.what());
+		ok = false;
+	}
+	bool rotated = false;
+	std::vector<shared_ptr<journalFile>> files;
+	if(ok) {
+		std::unique_lock<std::mutex> l(_fileMut);
+		for(auto * o: batch) {
+			auto F = getJournalFile(o->name.size()+o->data.size(),rotated);
+			F->writeEntry(o->entry,o->name,o->data,true);
+			if(std::find(files.begin(),files.end(),F)==files.end()) {
+				files.push_back(F);
+			}
+		}
+	} else {
+		srvERROR("The buckets of ",batch.size()," ordered entries are not on disk, they are not journaled");
+		orderedFailed += batch.size();
+	}
+	for(auto & F: files) {
+		F->commit(true);
+	}
+	++orderedWindows;
+	orderedEntries += batch.size();
+	orderedBucketsSynced += buckets.size();
+	{
+		std::unique_lock<std::mutex> l(_commitMut);
+		for(auto * o: batch) {
+			o->ok = ok;
+			o->done = true;
+		}
+	}
+	_orderedCv.notify_all();
+	if(rotated) {
+		checkpoint();
+	}
+}
+
+str journal::getStats(void) {
+	str ret = BUILDSTRING("Journal (",durabilityName(durability.load()),", data: ",dataModeName(dataMode.load()),"): bytes: ",bytesQueued.load()," records: ",recordsWritten.load()," commits: ",commits.load()," fdatasyncs: ",syncs.load(),"\n");
+	{
+		std::unique_lock<std::mutex> l(_fileMut);
+		ret += BUILDSTRING("Journal checkpoint: ",lastCheckpoint," files: ",segments.size()," checkpoints: ",checkpoints.load()," files retired: ",segmentsRetired.load(),"\n");
 	}
-	struct _item{
-		size_t offset,size;
+	{
+		std::unique_lock<std::mutex> l(_freeMut);
+		ret += BUILDSTRING("Journal segments: ",segmentFiles," free: ",freeSegments.size()," of ",journalSegmentSize," bytes, direct I/O: ",direct.load() ? "yes" : "no","\n");
+	}
+	if(orderedWindows.load()) {
+		ret += BUILDSTRING("Journal ordered data: entries: ",orderedEntries.load()," windows: ",orderedWindows.load()," buckets synced: ",orderedBucketsSynced.load()," failed: ",orderedFailed.load(),"\n");
+	}
+	for(unsigned a=0;a<latency.size();a++) {
+		if(latency[a].count()) {
+			ret += BUILDSTRING("Journal latency (",durabilityName(journalDurability(a)),"): ",latency[a].toString(),"\n");
+		}
+	}
+	return ret;
+}
+
+namespace {
+	/**
+	 * Reads a journal file record by record, so replay holds one record at a time instead of the whole journal.
+	 */
+	class journalReader{
+		private:
+		std::ifstream F;
+		shared_ptr<crypto::streamInterface> cryptostream;
+		size_t entryEncSize = 0;
+		bool torn = false;
+		
+		bool readRecord(size_t size,str & out) {
+			str enc(size,'\0');
+			F.read(&enc[0],size);
+			if(size_t(F.gcount())!=size) {
+				return false;
+			}
+			cryptostream->message(enc,out);
+			bytes += size;
+			return true;
+		}
+		public:
+		str header,payload; //The decrypted journalEntry & its name followed by its data.
+		uint64_t bytes = 0;
+		
+		bool inUse = true; //A segment that is retired or was never used holds no records.
+		
+		journalReader(const str & filename,bool segment) {
+			F.open(filename.c_str(),std::ios::binary|std::ios::in);
+			if(segment) {
+				str magic(segmentMagic.size(),'\0');
+				F.read(&magic[0],magic.size());
+				inUse = size_t(F.gcount())==magic.size() && magic==segmentMagic;
+				if(!inUse) {
+					return;
+				}
+			}
+			str streamHeader(STOR->prot()->streamHeaderSize(),'\0');
+			F.read(&streamHeader[0],streamHeader.size());
+			if(size_t(F.gcount())!=streamHeader.size()) {
+				torn = true;
+				return;
+			}
+			cryptostream = STOR->prot()->startStreamRead(STOR->prot()->getProtoEncryptionKey(),streamHeader);
+			entryEncSize = cryptostream->encryptionOverhead(sizeof(journalEntry));
+			bytes = F.tellg();
+		}
+		
+		const journalEntry * entry() const { return reinterpret_cast<const journalEntry *>(header.data()); }
+		bool isTorn(void) const { return torn; } //The file ends halfway a record, for a segment that is where its records end.
+		
+		bool next(void) {
+			if(!inUse || torn || F.peek()==std::char_traits<char>::eof()) {
+				return false;
+			}
+			try{
+				payload.clear();
+				if(readRecord(entryEncSize,header) && header.size()==sizeof(journalEntry)) {
+					const size_t len = entry()->nameLength + entry()->dataLength;
+					if(len==0 || (readRecord(cryptostream->encryptionOverhead(len),payload) && payload.size()==len)) {
+						return true;
+					}
+				}
+			} catch(std::exception &) {
+				//Zeros or records of an earlier use of the segment, they do not decrypt with this stream.
+			}
+			torn = true;
+			return false;
+		}
 	};
-	//make damn sure the entries are in order before replay!
-	std::map<uint64_t,_item> items;
-	size_t offset = 0;
 	
-	while(offset<completeJournal.size()) {
-		auto entry = reinterpret_cast<const journalEntry *>(&completeJournal[offset]);
-		switch(entry->type) {
-			case journalEntryType::close:
-				items.erase(entry->id);
-				break;
-			case journalEntryType::mkobject:
+	bool isSegment(const str & filename) {
+		return std::filesystem::path(filename.c_str()).filename().generic_string().rfind("segment.",0)==0;
+	}
+	
+	bool touchesOneInode(journalEntryType t) {
+		switch(t) {
 			case journalEntryType::write:
-			case journalEntryType::unlink:
-			case journalEntryType::renamemove:
 			case journalEntryType::chown:
 			case journalEntryType::chmod:
 			case journalEntryType::truncate:
-				items[entry->id].offset = offset;
-				items[entry->id].size = sizeof(journalEntry)+entry->nameLength+entry->dataLength;
-				break;
+			case journalEntryType::writeref:
+				return true;
 			default:
-				throw std::logic_error("corrupted journal");
-				break;
+				return false;
 		}
-		offset+= sizeof(journalEntry)+entry->nameLength+entry->dataLength;
 	}
+}
+
+void journal::tryReplay(void) {
+	const auto start = std::chrono::steady_clock::now();
+	auto ptr = make_unique<filesystem::context>(); 
 	
-	//Items should be a sorted list of journal items. @todo: when the id wraps around this could cause problems.	
-	if(items.empty()==false) {
-		srvWARNING(items.size()," journal entries found. Replaying...");
+	//First pass: only the position of every entry & the ids it claims, the payloads are decrypted & dropped.
+	struct liveRef{
+		uint64_t id;
+		uint32_t file,ordinal;
+	};
+	std::vector<str> files;
+	std::vector<bool> inUse;
+	std::vector<liveRef> refs;
+	std::vector<uint64_t> closed;
+	uint64_t checkpointed = 0, bytes = 0;
+	for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) { 
+		const str p = str(entry.path().generic_string().c_str());
+		journalReader R(p,isSegment(p));
+		uint32_t ordinal = 0;
+		for(;R.next();++ordinal) {
+			const auto e = R.entry();
+			switch(e->type) {
+				case journalEntryType::close:
+					closed.push_back(e->id);
+					break;
+				case journalEntryType::checkpoint:
+					checkpointed = std::max<uint64_t>(checkpointed,e->offset);
+					break;
+				case journalEntryType::mkobject:
+				case journalEntryType::write:
+				case journalEntryType::unlink:
+				case journalEntryType::renamemove:
+				case journalEntryType::chown:
+				case journalEntryType::chmod:
+				case journalEntryType::truncate:
+				case journalEntryType::writeref:
+					refs.push_back({e->id,uint32_t(files.size()),ordinal});
+					FS->claimEntry(e,R.payload);
+					break;
+				default:
+					throw std::logic_error("corrupted journal");
+					break;
+			}
+		}
+		if(R.isTorn() && !isSegment(p)) {
+			srvWARNING("Journal ",p," ends in an incomplete record after ",ordinal," records");
+		}
+		bytes += R.bytes;
+		files.push_back(p);
+		inUse.push_back(R.inUse);
 	}
 	
-	for(auto & i: items) {
-		str content(&completeJournal[i.second.offset],i.second.size);
-		if(content.size()>=sizeof(journalEntry)) {
-			auto entry = reinterpret_cast<const journalEntry *>(content.data());
-			if(content.size()>= sizeof(journalEntry)+entry->nameLength+entry->dataLength) {
-				
-				str name(content.data()+sizeof(journalEntry),entry->nameLength);
-				str data(content.data()+sizeof(journalEntry)+entry->nameLength,entry->dataLength);
-				
-				auto e = FS->replayEntry(entry,name,data,ptr.get(),nullptr);
-				if(e) {
-					srvERROR("Journal entry ",i.first," replay failed with error: ",e.operator int());
+	//make damn sure the entries are in order before replay! Everything below the last checkpoint is stored already.
+	//@todo: when the id wraps around this could cause problems.
+	std::sort(closed.begin(),closed.end());
+	std::sort(refs.begin(),refs.end(),[](const liveRef & a,const liveRef & b) { return a.id < b.id; });
+	refs.erase(std::remove_if(refs.begin(),refs.end(),[&](const liveRef & r) {
+		return r.id < checkpointed || std::binary_search(closed.begin(),closed.end(),r.id);
+	}),refs.end());
+	closed = std::vector<uint64_t>();
+	
+	if(refs.empty()==false) {
+		srvWARNING(refs.size()," journal entries found. Replaying...");
+		
+		//Second pass: the files in the order of their oldest live entry, keeping only the live entries until their turn.
+		std::vector<std::vector<uint32_t>> wanted(files.size());
+		std::vector<uint32_t> order;
+		for(auto & r: refs) {
+			if(wanted[r.file].empty()) {
+				order.push_back(r.file);
+			}
+			wanted[r.file].push_back(r.ordinal);
+		}
+		for(auto & w: wanted) {
+			std::sort(w.begin(),w.end());
+		}
+		
+		struct loadedEntry{
+			str header,payload;
+			const journalEntry * entry() const { return reinterpret_cast<const journalEntry *>(header.data()); }
+		};
+		std::atomic_uint64_t replayed{0},failed{0};
+		auto replayOne = [&](const loadedEntry & l) {
+			auto entry = l.entry();
+			str name(l.payload.data(),entry->nameLength);
+			str data(l.payload.data()+entry->nameLength,entry->dataLength);
+			auto e = FS->replayEntry(entry,name,data,ptr.get(),nullptr);
+			if(e) {
+				++failed;
+				srvERROR("Journal entry ",entry->id," replay failed with error: ",e.operator int());
+			} else {
+				++replayed;
+				srvDEBUG("Replayed journal entry ",entry->id);
+			}
+		};
+		
+		//Entries that change one inode only run in parallel per inode, every other entry is a barrier.
+		util::threadPool pool(util::threadPool::defaultThreads());
+		std::unordered_map<uint64_t,std::vector<const loadedEntry *>> perInode;
+		auto flush = [&]() {
+			util::threadPool::taskGroup G;
+			for(auto & i: perInode) {
+				pool.post([&replayOne,list = std::move(i.second)]() {
+					for(auto l: list) {
+						replayOne(*l);
+					}
+				},&G);
+			}
+			G.wait();
+			perInode.clear();
+		};
+		
+		std::unordered_map<uint64_t,loadedEntry> ready;
+		size_t done = 0;
+		uint64_t maxHeld = 0;
+		for(auto f: order) {
+			journalReader R(files[f],isSegment(files[f]));
+			uint32_t ordinal = 0;
+			for(auto w = wanted[f].begin();w!=wanted[f].end() && R.next();++ordinal) {
+				if(ordinal==*w) {
+					const auto id = R.entry()->id;
+					ready[id] = loadedEntry{std::move(R.header),std::move(R.payload)};
+					++w;
+				}
+			}
+			uint64_t held = 0;
+			for(auto & r: ready) {
+				held += r.second.header.size() + r.second.payload.size();
+			}
+			maxHeld = std::max(maxHeld,held);
+			
+			size_t upto = done;
+			while(upto<refs.size() && ready.count(refs[upto].id)) {
+				++upto;
+			}
+			for(size_t a=done;a<upto;a++) {
+				const auto & l = ready[refs[a].id];
+				if(touchesOneInode(l.entry()->type)) {
+					perInode[l.entry()->newNode.fullindex()].push_back(&l);
 				} else {
-					srvMESSAGE("Replayed journal entry ",i.first);
+					flush();
+					replayOne(l);
 				}
 			}
-		} else {
-			srvERROR("Journal entry failed to load: ",i.first);
+			flush();
+			for(;done<upto;done++) {
+				ready.erase(refs[done].id);
+			}
 		}
+		if(done<refs.size()) {
+			srvERROR(refs.size()-done," journal entries could not be read again, not replayed");
+		}
+		srvWARNING("Replayed ",replayed.load()," journal entries (",failed.load()," failed) from ",files.size()," files, ",bytes," bytes in ",
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count(),"ms using ",pool.size()," threads, at most ",maxHeld," bytes held");
 	}
 	
-	for(auto & f:files) {
-		std::filesystem::remove(f);
+	//Segments join the ring, journal files of older versions are removed.
+	for(size_t a=0;a<files.size();a++) {
+		const auto & f = files[a];
+		if(isSegment(f)) {
+			bool reusable = !inUse[a];
+#ifndef _WIN32
+			if(!reusable) {
+				journalFileImpl I;
+				I.fd = ::open(f.c_str(),O_WRONLY|O_CLOEXEC);
+				reusable = I.fd >= 0 && I.invalidate();
+				if(I.fd >= 0) {
+					::close(I.fd);
+				}
+			}
+#endif
+			const str n = std::filesystem::path(f.c_str()).extension().generic_string().substr(1).c_str();
+			{
+				std::unique_lock<std::mutex> l(_freeMut);
+				nextSegment = std::max<uint64_t>(nextSegment,std::strtoull(n.c_str(),nullptr,10)+1);
+				++segmentFiles;
+			}
+			segmentRetired(f,reusable);
+		} else {
+			std::filesystem::remove(f);
+		}
 	}
 	
 }
@@ -219,10 +914,21 @@ journal::journal():service("JOURNAL"), nextJournalEntry(0) {
 	
 	util::MKDIR(path);
 	srvMESSAGE("journaling directory: ",path);
-	
+	committer = std::thread([this]() { runCommitter(); });
 }
 
 
 journal::~journal() {
-
+	{
+		std::unique_lock<std::mutex> l(_commitMut);
+		stopping = true;
+		_commitCv.notify_all();
+	}
+	if(committer.joinable()) {
+		committer.join();
+	}
+	//Files that are not retired by the last checkpoint stay for the replay at the next mount.
+	std::unique_lock<std::mutex> l(_fileMut);
+	current = nullptr;
+	segments.clear();
 }
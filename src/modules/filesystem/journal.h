@@ -8,7 +8,13 @@
 #include "hash.h"
 #include <atomic>
 #include <set>
+#include <array>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include "modules/services/serviceHandler.h"
+#include "modules/util/histogram.h"
 
 namespace filesystem {
 
@@ -16,16 +22,39 @@ namespace filesystem {
 	using services::service;
 
 	enum class journalEntryType : uint32_t {
-		close=0x10,
+		close=0x10, //Only in journals of older versions, replay still understands them.
+		checkpoint=0x11, //Every entry below offset is on disk in its buckets.
 		mkobject=0x20,
 		write=0x30,
 		unlink=0x40,
 		renamemove=0x50,
 		chmod=0x60, 
 		chown=0x70, 
-		truncate=0x80 
+		truncate=0x80,
+		writeref=0x90 //Ordered data: the chunks are already in their buckets, the entry only holds where.
 	};
 	class journalFile;
+
+	/**
+	 * When an operation returns, relative to its journal entry reaching the disk (--journal none|batched|sync).
+	 * NONE: queued for the committer, written soon after without fdatasync.
+	 * BATCHED: the operation waits for the committer, which writes & fdatasyncs everything queued in one go (group commit).
+	 * SYNC: the operation writes & fdatasyncs its own entry.
+	 */
+	enum class journalDurability : unsigned { NONE=0, BATCHED=1, SYNC=2 };
+	journalDurability durabilityFromName(const str & name);
+	const char * durabilityName(journalDurability d);
+
+	/**
+	 * What the journal holds of a write (--journal_data journal|ordered).
+	 * JOURNAL: the data itself, the chunks are stored later with their buckets, so every byte is written twice.
+	 * ORDERED: the chunks are stored in their bucket slots & synced first, the journal only holds their bucketIndex_t's.
+	 * The committer stores & syncs the buckets of all ordered writes in its window once, then commits their entries.
+	 * Every write waits for that (also with --journal none), so it suits large writes.
+	 */
+	enum class journalDataMode : unsigned { JOURNAL=0, ORDERED=1 };
+	journalDataMode dataModeFromName(const str & name);
+	const char * dataModeName(journalDataMode m);
 	
 	
 	class journalEntry{
@@ -46,35 +75,56 @@ namespace filesystem {
 		private:
 		friend class journal;
 	    const journalEntry inner;
-	    shared_ptr<journalFile> file;
 		public:
 		
 		const journalEntry * entry() { return &inner; }
 
 		journalEntryWrapper(const uint32_t iid,const journalEntryType itype, const bucketIndex_t iparentNode,const bucketIndex_t inewNode,const bucketIndex_t inewParentNode,const my_mode_t imod, const my_off_t ioffset, const str & name="", const str & data="");
+		//ordered: the buckets the entry points into, stored & synced before it. Throws if they could not be.
+		journalEntryWrapper(const std::set<uint64_t> * ordered,const uint32_t iid,const journalEntryType itype, const bucketIndex_t iparentNode,const bucketIndex_t inewNode,const bucketIndex_t inewParentNode,const my_mode_t imod, const my_off_t ioffset, const str & name="", const str & data="");
 		~journalEntryWrapper();		
 	};
 	
 	typedef std::shared_ptr<journalEntryWrapper> journalEntryPtr;
 	
 	
+	constexpr size_t journalBlockSize = 4096; //Appends are written in whole blocks, as O_DIRECT needs.
+	constexpr size_t journalSegmentSize = 16*1024*1024; //Preallocated size of a segment file.
+	constexpr size_t journalRingSegments = 4; //Retired segments are kept for reuse up to this many files.
+
 	class journalFileImpl;
-	class journalFile{
+	/**
+	 * A journal segment shared by all threads. Entries are encrypted in the order they are queued (the stream cipher
+	 * depends on it) & written in that order by commit(). Records are numbered, so waiters know when theirs is on disk.
+	 * The file starts with a magic & the stream header, a retired segment gets its first block zeroed & is reused.
+	 */
+	class journalFile {
 		private:
 		const str filename;
-		unsigned entries;
+		uint64_t used = 0; //Bytes queued, the header included.
+		uint64_t headerSize = 0;
+		std::atomic<uint64_t> maxId{0}; //Highest entry id in this file, only valid if hasEntries.
+		std::atomic_bool hasEntries{false},retired{false};
 		unique_ptr<journalFileImpl> impl;
+		std::mutex _mut; //Protects the cipher, the queue & the counters.
+		std::condition_variable _cv;
+		std::mutex _writeMut; //One commit at a time, so records reach the file in order.
+		std::vector<str> pending; //Encrypted records, not written yet.
+		uint64_t queued = 0, synced = 0; //Record numbers.
+		bool needSync = false; //A waiter needs the pending records fdatasynced, checkpoint records alone do not.
 		public:
 		
-		journalFile(const str & ifilename);
+		journalFile(const str & ifilename,bool fresh); //fresh: the file is new & gets preallocated, else it is a retired segment.
 		~journalFile();
 
-		unsigned getEntries() { return entries; }
-		
-		void writeEntry(const journalEntry * entry,const str & name,const str & data);
-		void deleteEntry(const journalEntry * entry);
+		bool fits(size_t payload); //A record with payload bytes of name & data fits in the segment, an empty segment takes any record.
+		bool coveredBy(uint64_t watermark) { return !hasEntries || maxId < watermark; } //Nothing in this file needs a replay.
+		void retire() { retired = true; } //The segment goes back to the ring when the last reference is gone.
 		
+		uint64_t writeEntry(const journalEntry * entry,const str & name,const str & data,bool durable); //Queues the entry, returns its record number.
 		
+		void commit(bool sync); //Writes the queued records in one writev & fdatasyncs them if needed (or sync is set).
+		void waitFor(uint64_t record); //Until the record is written & synced.
 	};
 	
 /**
@@ -84,13 +134,56 @@ private:
 	std::atomic_uint32_t nextJournalEntry;
 	str path;
 	friend class journalEntryWrapper;
-	shared_ptr<journalFile> getJournalFile();
-	shared_ptr<journalFile> writeEntry(const journalEntry * entry,const str & name,const str & data);
-	
-	
-	
+	friend class journalFile;
+	std::mutex _fileMut; //Protects current & segments, held while an entry is queued so a checkpoint never retires its file halfway.
+	shared_ptr<journalFile> current;
+	std::deque<shared_ptr<journalFile>> segments; //Files that are not retired yet, oldest first.
+	shared_ptr<journalFile> getJournalFile(size_t payload,bool & rotated);
+	void writeEntry(const journalEntry * entry,const str & name,const str & data,const std::set<uint64_t> * ordered = nullptr);
+
+	//Entries that are being journaled or applied, their changes are not in any bucket yet.
+	std::mutex _inflightMut;
+	std::set<uint64_t> inflight;
+	uint32_t beginEntry(void);
+	void endEntry(uint32_t id);
+	uint64_t lastCheckpoint = 0;
+
+	//The ring of segment files (journal/segment.N)
+	std::mutex _freeMut;
+	std::vector<str> freeSegments;
+	uint64_t nextSegment = 0;
+	size_t segmentFiles = 0;
+	std::atomic_bool direct{false};
+	void segmentRetired(const str & filename,bool reusable);
+
+	//The group committer
+	std::atomic<journalDurability> durability{journalDurability::BATCHED};
+	std::atomic<journalDataMode> dataMode{journalDataMode::JOURNAL};
+	std::mutex _commitMut;
+	std::condition_variable _commitCv;
+	std::deque<shared_ptr<journalFile>> toCommit;
+	bool stopping = false;
+	std::thread committer;
+	void requestCommit(shared_ptr<journalFile> f);
+	void runCommitter(void);
+	
+	//Ordered entries wait for the committer to store & sync their buckets, only then they are queued.
+	struct orderedEntry {
+		const journalEntry * entry;
+		const str & name;
+		const str & data;
+		const std::set<uint64_t> & buckets;
+		bool done = false, ok = false;
+	};
+	std::deque<orderedEntry*> ordered;
+	std::condition_variable _orderedCv;
+	void commitOrdered(const std::deque<orderedEntry*> & batch);
 	
 public:
+	std::atomic_uint64_t commits{0},syncs{0},recordsWritten{0},bytesQueued{0},checkpoints{0},segmentsRetired{0};
+	std::atomic_uint64_t orderedWindows{0},orderedEntries{0},orderedBucketsSynced{0},orderedFailed{0};
+	std::array<util::latencyHistogram,3> latency; //Per durability mode, from the start of an entry until the operation may continue.
+
 	/**
 	 * Default constructor
 	 */
@@ -103,10 +196,28 @@ public:
 	
 	template<class ...Args>
 	journalEntryPtr add(Args... args) {
-		return  make_shared<journalEntryWrapper>(nextJournalEntry.fetch_add(1),args...);
+		return  make_shared<journalEntryWrapper>(beginEntry(),args...);
+	}
+	
+	template<class ...Args>
+	journalEntryPtr addOrdered(const std::set<uint64_t> & buckets,Args... args) {
+		return  make_shared<journalEntryWrapper>(&buckets,beginEntry(),args...);
 	}
 	
 	void tryReplay(void);
+	/**
+	 * Entries below the watermark are stored in their buckets: journal segments holding only such entries are retired
+	 * & a checkpoint record tells replay to skip the rest of them. Called on rotation & after the buckets are stored.
+	 */
+	void checkpoint(void);
+	uint64_t watermark(void); //Lowest entry id that may still need a replay.
+	void setDurability(journalDurability d) { durability = d; }
+	journalDurability getDurability(void) { return durability.load(); }
+	void setDataMode(journalDataMode m) { dataMode = m; }
+	journalDataMode getDataMode(void) { return dataMode.load(); }
+	void setDirect(bool d) { direct = d; } //Write segments with O_DIRECT, where the platform & the filesystem allow it.
+	bool getDirect(void) { return direct.load(); }
+	str getStats(void);
 	
 	srvSTATICDEFAULTNEWINSTANCE( journal );
 };
@@ -0,0 +1,41 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "readahead.h"
+#include <algorithm>
+
+using namespace filesystem;
+
+void readAhead::reset(void) {
+	std::unique_lock<std::mutex> l(_mut);
+	nextOffset = 0;
+	window = 0;
+	prefetchedUntil = 0;
+}
+
+std::pair<uint64_t,uint64_t> readAhead::access(my_off_t offset,my_size_t size) {
+	std::unique_lock<std::mutex> l(_mut);
+	const uint64_t lastChunk = (offset + size + chunkSize - 1) / chunkSize; //First chunk after this read
+	const bool sequential = offset == nextOffset && size > 0;
+	nextOffset = offset + size;
+	if(!sequential) {
+		window = 0;
+		prefetchedUntil = lastChunk;
+		return {0,0};
+	}
+	if(window == 0) {
+		//Start with a small window, a few times the size of the read.
+		window = std::min(std::max(minWindow, 2 * ((size + chunkSize - 1) / chunkSize)), maxWindow);
+	} else if(lastChunk + window / 2 < prefetchedUntil) {
+		//Still enough in flight.
+		return {0,0};
+	} else {
+		window = std::min(window * 2, maxWindow);
+	}
+	const uint64_t first = std::max(prefetchedUntil, lastChunk);
+	prefetchedUntil = lastChunk + window;
+	if(first >= prefetchedUntil) {
+		return {0,0};
+	}
+	return {first,prefetchedUntil};
+}
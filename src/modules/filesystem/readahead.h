@@ -0,0 +1,35 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef FILESYSTEM_READAHEAD_H
+#define FILESYSTEM_READAHEAD_H
+
+#include "chunk.h"
+#include <mutex>
+#include <utility>
+
+namespace filesystem {
+
+	/**
+	 * Sequential read detection for one open file handle.
+	 *
+	 * Works like the kernel readahead: the first sequential read opens a small window, every time the reader
+	 * has consumed half of what was prefetched the window doubles (up to maxWindow) and the next part is requested.
+	 * A read that does not continue where the previous one stopped closes the window again.
+	 */
+	class readAhead {
+	private:
+		std::mutex _mut;
+		my_off_t nextOffset = 0; //Where the next read starts if the access is sequential
+		uint64_t window = 0; //In chunks, 0 == not sequential
+		uint64_t prefetchedUntil = 0; //First chunk index that was not requested yet
+	public:
+		static constexpr uint64_t minWindow = 4;
+		static constexpr uint64_t maxWindow = chunksInBucket * 4;
+
+		void reset(void);
+		std::pair<uint64_t,uint64_t> access(my_off_t offset,my_size_t size); //Returns the chunk range [first,last) to prefetch.
+	};
+}
+
+#endif // FILESYSTEM_READAHEAD_H
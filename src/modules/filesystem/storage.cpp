@@ -17,6 +17,7 @@
 #include "bucket.h"
 #include "bucketaccounting.h"
 #include "modules/util/files.h"
+#include <algorithm>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -36,35 +37,31 @@ bucketInfo::bucketInfo(crypto::protocolInterface* p, bool isMeta) {
 	clear();
 
 }
+bucketInfo::~bucketInfo() {
+	if (indexer.joinable()) {
+		indexer.join();
+	}
+}
+
 void bucketInfo::clear(void) {
+	if (indexer.joinable()) {
+		indexer.join();
+	}
 	const bool msg = hashesIndex.size() > 0 || loaded.size() > 0;
 	
 	if (msg) {
 		STOR->srvMESSAGE("Clearing ", meta ? "meta" : "", " hashes");
 	}
-	auto hl = hashesIndex.list();
-	for (auto& i : hl) {
-		if (i) {
-			i->rest();
-		}
-	}
-
 	hashesIndex.clear();//@todo: potential deadlock, perhaps use shared_recursive mutex?
+	persisted.clear();
 
 	if (msg) {
 		STOR->srvMESSAGE("Clearing ", meta ? "meta" : "", " buckets");
 	}
-	auto l = loaded.list();
-	//for()
-	for (auto& i : l) {
-		for (my_size_t a = 0; a < chunksInBucket; a++) {
-			auto hsh = i->getHash(a);
-			if (hsh) {
-				hsh->rest();
-			}
-		}
+	loaded.clear();
+	if (!meta) {
+		STOR->cache.clear();
 	}
-	loaded.clear();//@todo: deadlock: this will try to rest the hashes, the hashes will
 
 	if (msg) {
 		STOR->srvMESSAGE("Cleared ", meta ? "meta" : "", " hashes & buckets");
@@ -77,52 +74,58 @@ void bucketInfo::createNewBucket(uint64_t id) {
 	FS->srvDEBUG("Adding ", meta ? "meta" : "", " bucket ", id);
 	//Nothing to see/do here
 }
-void bucketInfo::loadHashesFromBucket(uint64_t id, std::vector<bucketIndex_t>& postList, uint64_t& numLoaded) {
+void bucketInfo::loadHashesFromBucket(uint64_t id, loadBatch& out) {
 	try {
 
 		//srvMESSAGE("loading hashes from ",fn);
 		auto* hb = getBucket(id);
 		_ASSERT(hb != nullptr);
 
-		//unsigned numInner  = 0;
 		for (unsigned a = 0; a < chunksInBucket; a++) {
 			auto hsh = hb->getHash(a);
 			const bucketIndex_t b{ id,a };
 			if (hsh != nullptr) {
-
-				//++numInner;
 				if (meta == false) {
-					hashesIndex.insert(hsh->getHashPrimitive(), hsh);
 					_ASSERT(b == hsh->getBucketIndex());
 					_ASSERT(hsh->getRefCnt() > 0);
-					++numLoaded;
+					out.hashes.push_back(dedupIndex::makeEntry(hsh->getHashPrimitive(), b));
+					++out.numLoaded;
 				}
 				else {
-					auto chunk = hb->getChunk(a);
+					shared_ptr<chunk> chunk;
+					try {
+						chunk = hb->getChunk(a);
+					}
+					catch (std::exception& e) {
+						//A torn record: keep the slot out of use.
+						FS->srvERROR("Failed to load meta chunk ", b, ": ", e.what());
+						continue;
+					}
 					_ASSERT(chunk != nullptr);
 					if (chunk->as<inode_header_only>()->header.type == inode_type::NONE) {
-						postList.push_back(b);
+						out.postList.push_back(b);
 					}
 					else {
-						++numLoaded;
+						++out.numLoaded;
 					}
-					//if(meta) {_ASSERT(hb->getChunk(a)!=nullptr);}
-
 				}
 			}
+			else if (hb->badSlot(a)) {
+				//Neither indexed nor posted as free.
+			}
 			else {
 				if (!(b == fs::rootIndex && meta == false)) {
-					postList.push_back(b);
+					out.postList.push_back(b);
 				}
 			}
 		}
 
-		//srvMESSAGE("loading ",numInner," hashes from ",id);
-		//for all hashes 
-		//for()
-
 		//the hashes table gets filled with empty, invalid hashes: these should be deleted.
 
+		if (meta == false) {
+			hb->unloadHashes();//Only the index is kept, hash objects are loaded again when they are used.
+		}
+
 	}
 	catch (std::exception & e) {
 		FS->srvERROR("Failed to load hashes for ", meta ? "meta" : "", " bucket:", id, ": ", e.what());
@@ -134,6 +137,16 @@ void bucketInfo::removeBucket(uint64_t id) {
 	loaded.erase(id);
 }
 
+uint64_t bucketInfo::oldestJournalEntry(void) {
+	uint64_t ret = noJournalEntry;
+	for (auto& b : loaded.list()) {
+		if (b) {
+			ret = std::min(ret, b->oldestJournalEntry());
+		}
+	}
+	return ret;
+}
+
 bucket* bucketInfo::getBucket(uint64_t id) {
 
 	_ASSERT(protocol != nullptr);
@@ -141,8 +154,14 @@ bucket* bucketInfo::getBucket(uint64_t id) {
 	if (it) {
 		return it.get();
 	}
+	//Buckets are loaded on demand from several threads, only one of them may create the bucket.
+	lckguard l(_mut);
+	it = loaded.get(id);
+	if (it) {
+		return it.get();
+	}
 	auto fn = STOR->getBucketFilename(id, meta, protocol);
-	loaded.insert(id, std::make_shared<bucket>(fn, meta ? protocol->getProtoEncryptionKey() : protocol->getEncryptionKey(), protocol));
+	loaded.insert(id, std::make_shared<bucket>(fn, id, meta == false, meta ? protocol->getProtoEncryptionKey() : protocol->getEncryptionKey(), protocol));
 
 	auto* ret = loaded.get(id).get();
 	_ASSERT(ret != nullptr);
@@ -158,7 +177,11 @@ shared_ptr<hash> bucketInfo::getHash(const bucketIndex_t& index) {
 }
 
 void filesystem::bucketInfo::loadBuckets(script::JSONPtr metaInfo,const str & name) {
-	auto start = std::chrono::high_resolution_clock::now();
+	typedef std::chrono::high_resolution_clock clock;
+	auto elapsed = [](clock::time_point from) {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - from).count();
+	};
+	auto start = clock::now();
 	uint64_t numLoaded = 0;
 	std::set<uint64_t> initList;
 	std::vector<bucketIndex_t> postList;
@@ -168,21 +191,274 @@ void filesystem::bucketInfo::loadBuckets(script::JSONPtr metaInfo,const str & na
 	auto* ptr = &metaInfo->get<I>(name, 0, l);
 	for (uint64_t a = 0; a < l; ++a) {
 		initList.insert(ptr[a]);
-		loadHashesFromBucket(ptr[a],postList,numLoaded);
 	}
+	int64_t readTime = 0, mergeTime = 0;
+	auto phase = clock::now();
+	const bool fromIndex = !meta && loadFromDedupIndex(metaInfo, initList, postList, numLoaded);
+	if (!meta && !fromIndex && STOR->getLazyIndex()) {
+		//Free slots are posted as the buckets are indexed.
+		accounting = make_unique<bucketaccounting>(initList, this);
+		startIndexing(std::vector<uint64_t>(ptr, ptr + l));
+		STOR->srvMESSAGE("Indexing ", l, " ", name, " in the background");
+		return;
+	}
+	if (!fromIndex) {
+		//Buckets are read & decrypted on the write-back pool (idle during mount), one batch per bucket.
+		std::vector<loadBatch> batches(l);
+		{
+			util::threadPool::taskGroup G;
+			auto* pool = STOR->writebackPool();
+			for (uint64_t a = 0; a < l; ++a) {
+				pool->post([this, id = (uint64_t)ptr[a], batch = &batches[a]]() {
+					loadHashesFromBucket(id, *batch);
+				}, &G);
+			}
+			G.wait();
+		}
+		readTime = elapsed(phase);
+		phase = clock::now();
+		//Merged in the order of the bucket list, so the result does not depend on the scheduling of the workers.
+		for (auto& batch : batches) {
+			for (auto& r : batch.hashes) {
+				if (!hashesIndex.insertIfAbsent(r)) {
+					unindexedCopies = true; //Stored twice during an earlier background build.
+				}
+			}
+			postList.insert(postList.end(), batch.postList.begin(), batch.postList.end());
+			numLoaded += batch.numLoaded;
+		}
+		mergeTime = elapsed(phase);
+	} else {
+		readTime = elapsed(phase);
+	}
+	phase = clock::now();
 	accounting = make_unique<bucketaccounting>(initList, this);
 	while (postList.empty() == false) {
 		accounting->post(postList.back());
 		postList.pop_back();
 	}
-	auto finish = std::chrono::high_resolution_clock::now();
-	auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(finish - start);
-	STOR->srvMESSAGE("Loaded ", numLoaded, " items from ", loaded.size()," ", name, " in ", milliseconds.count(),"ms");
+	const auto accountingTime = elapsed(phase);
+	STOR->srvMESSAGE("Loaded ", numLoaded, " items from ", loaded.size()," ", name, " in ", elapsed(start),"ms",
+		" (read: ", readTime, "ms, index: ", mergeTime, "ms, accounting: ", accountingTime, "ms)");
+
+}
+
+void filesystem::bucketInfo::startIndexing(std::vector<uint64_t> ids) {
+	{
+		std::unique_lock<std::mutex> l(_indexMut);
+		for (auto id : ids) {
+			unindexed[id] = false;
+		}
+		indexing = !unindexed.empty();
+	}
+	indexer = std::thread([this, ids = std::move(ids)]() {
+		auto start = std::chrono::high_resolution_clock::now();
+		{
+			util::threadPool::taskGroup G;
+			auto* pool = STOR->writebackPool();
+			for (auto id : ids) {
+				pool->post([this, id]() {
+					ensureIndexed(id);
+				}, &G);
+			}
+			G.wait(false);
+		}
+		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+		STOR->srvMESSAGE("Indexed ", hashesIndex.size(), " hashes from ", ids.size(), " buckets in the background in ", milliseconds.count(), "ms");
+	});
+}
+
+void filesystem::bucketInfo::ensureIndexed(uint64_t id) {
+	if (!indexing.load()) {
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> l(_indexMut);
+		auto it = unindexed.find(id);
+		if (it == unindexed.end()) {
+			return;
+		}
+		if (it->second) {
+			//Another thread is loading it.
+			_indexCv.wait(l, [&]() { return unindexed.count(id) == 0; });
+			return;
+		}
+		it->second = true;
+	}
+	loadBatch batch;
+	loadHashesFromBucket(id, batch);
+	for (auto& r : batch.hashes) {
+		//A copy written in the mean time may be indexed already, either one will do.
+		if (!hashesIndex.insertIfAbsent(r)) {
+			unindexedCopies = true;
+		}
+	}
+	for (auto& b : batch.postList) {
+		accounting->post(b);
+	}
+	{
+		std::unique_lock<std::mutex> l(_indexMut);
+		unindexed.erase(id);
+		if (unindexed.empty()) {
+			indexing = false;
+		}
+	}
+	_indexCv.notify_all();
+}
+
+bool filesystem::bucketInfo::indexPending(void) {
+	uint64_t id = 0;
+	{
+		std::unique_lock<std::mutex> l(_indexMut);
+		auto it = std::find_if(unindexed.begin(), unindexed.end(), [](const std::pair<const uint64_t, bool>& u) { return !u.second; });
+		if (it == unindexed.end()) {
+			return false;
+		}
+		id = it->first;
+	}
+	ensureIndexed(id);
+	return true;
+}
+
+size_t filesystem::bucketInfo::pendingIndex(void) {
+	std::unique_lock<std::mutex> l(_indexMut);
+	return unindexed.size();
+}
+
+void filesystem::bucketInfo::waitForIndex(void) {
+	if (!indexing.load()) {
+		return;
+	}
+	std::unique_lock<std::mutex> l(_indexMut);
+	_indexCv.wait(l, [&]() { return unindexed.empty(); });
+}
+
+bool filesystem::bucketInfo::loadFromDedupIndex(script::JSONPtr metaInfo, const std::set<uint64_t>& initList, std::vector<bucketIndex_t>& postList, uint64_t& numLoaded) {
+	if (metaInfo->hasProperty("dedupGeneration")) {
+		script::int_t generation = (*metaInfo)["dedupGeneration"];
+		dedupGeneration = generation;
+	}
+	const str fn = STOR->getPath() + dedupIndex::filename;
+	if (!util::fileExists(fn)) {
+		if (dedupGeneration > 0) {
+			STOR->srvWARNING("No dedup index, filesystem was not unmounted cleanly: loading all buckets");
+		}
+		return false;
+	}
+	bool ok = dedupGeneration > 0 && persisted.load(fn, dedupGeneration, protocol);
+	//Removed in any case: after a crash the index would not match the buckets anymore.
+	try {
+		STOR->io.remove(fn);
+	}
+	catch (std::exception& e) {
+		STOR->srvERROR("Failed to remove dedup index ", fn, ": ", e.what());
+		ok = false;
+	}
+	if (!ok) {
+		persisted.clear();
+		return false;
+	}
 
+	//Every slot that is not in the index is free.
+	const auto used = persisted.locations();
+	for (auto loc : used) {
+		if (initList.count(bucketIndex_t(loc).bucket()) == 0) {
+			STOR->srvERROR("Dedup index refers to unknown bucket ", bucketIndex_t(loc), ": loading all buckets");
+			persisted.clear();
+			return false;
+		}
+	}
+	for (auto id : initList) {
+		for (unsigned a = 0; a < chunksInBucket; a++) {
+			const bucketIndex_t b{ id,a };
+			if (!(b == fs::rootIndex) && !std::binary_search(used.begin(), used.end(), b.fullindex())) {
+				postList.push_back(b);
+			}
+		}
+	}
+	numLoaded = used.size();
+	return true;
 }
 
+std::shared_ptr<hash> filesystem::bucketInfo::findHash(const crypto::sha256sum& in) {
+	auto loc = hashesIndex.get(in);
+	if (!loc && indexing.load()) {
+		//Any bucket that is not indexed yet could hold this hash. Waiting for all of them would stall every write
+		//of new data until the build is done: help with one bucket & otherwise accept the miss, the data is then
+		//stored a second time.
+		if (indexPending()) {
+			loc = hashesIndex.get(in);
+		}
+		if (!loc && indexing.load()) {
+			unindexedCopies = true;
+			++missesWhileIndexing;
+		}
+	}
+	const bool fromDisk = !loc;
+	if (fromDisk) {
+		loc = persisted.find(in);
+		if (!loc) {
+			return nullptr;
+		}
+	}
+	auto ret = getHash(loc);
+	if (ret == nullptr || !(ret->getHashPrimitive() == in)) {
+		//Also when the hash is deleted while we look it up.
+		STOR->srvWARNING("Index entry ", in.toShortStr(), " does not match bucket ", loc);
+		if (fromDisk) {
+			persisted.forget(in, loc);
+		}
+		return nullptr;
+	}
+	if (fromDisk) {
+		hashesIndex.insert(in, loc);
+		persisted.resolved(in);
+	}
+	return ret;
+}
+
+bool filesystem::bucketInfo::dropHash(const crypto::sha256sum& in, hash* h) {
+	auto loc = hashesIndex.get(in);
+	//A second copy stored during the background build (see findHash) is not in the index, the other one may be.
+	if (loc) {
+		if (loc == h->getBucketIndex()) {
+			return hashesIndex.erase(in) == 1;
+		}
+		_ASSERT(unindexedCopies.load());
+		return true;
+	}
+	return persisted.forget(in, h->getBucketIndex()) || unindexedCopies.load();
+}
+
+uint64_t filesystem::bucketInfo::numHashes(void) {
+	return hashesIndex.size() + persisted.numUnresolved();
+}
 
-filesystem::storage::storage() : service("STORAGE") {
+bool filesystem::bucketInfo::storeDedupIndex(uint64_t generation) {
+	_ASSERT(meta == false);
+	waitForIndex();
+	if (unindexedCopies.load()) {
+		//Their slots are in use but not in the index, a mount from it would hand them out as free.
+		STOR->srvMESSAGE("Not writing the dedup index: some hashes are stored twice, the next mount loads all buckets");
+		return false;
+	}
+	std::vector<dedupIndex::entry> entries;
+	persisted.collect(entries);
+	for (auto& r : hashesIndex.list()) {
+		//The zero hash is not stored in a bucket.
+		if (bucketIndex_t(r.location) != fs::rootIndex) {
+			entries.push_back(r);
+		}
+	}
+	if (!dedupIndex::store(STOR->getPath() + dedupIndex::filename, generation, entries, protocol)) {
+		return false;
+	}
+	dedupGeneration = generation;
+	return true;
+}
+
+
+filesystem::storage::storage() : service("STORAGE"), cache(chunkCache::defaultBudget) {
 	std::array<char, 4096> wdpath;
 #ifdef _WIN32
 	_path = _getcwd(wdpath.data(), (int)wdpath.size());
@@ -196,6 +472,7 @@ filesystem::storage::storage() : service("STORAGE") {
 }
 
 filesystem::storage::~storage() {
+	verifier.stop();
 	if (buckets)buckets->clear();
 	if (metaBuckets)metaBuckets->clear();
 
@@ -220,17 +497,22 @@ void filesystem::storage::migrate(unique_ptr<crypto::protocolInterface> iprot) {
 	for (auto& bb : metaBuckets->loaded.clone()) {
 		srvMESSAGE("Converting meta bucket ", bb.first);
 		auto newFn = getBucketFilename(bb.first, true, iprot.get());
-		auto newBucket = std::make_unique<bucket>(newFn, iprot->getProtoEncryptionKey(), iprot.get());
+		auto newBucket = std::make_unique<bucket>(newFn, bb.first, false, iprot->getProtoEncryptionKey(), iprot.get());
 		bb.second->migrateTo(newBucket.get());
 		newBucket->store();
 		bb.second->del();
 		bb.second = std::move(newBucket);
 		metaBuckets->loaded.insert(bb.first, bb.second);
 	}
+	//Data buckets are loaded on demand after a mount from the dedup index.
+	buckets->waitForIndex();
+	for (auto id : buckets->accounting->getBucketsInUse()) {
+		buckets->getBucket(id);
+	}
 	for (auto& bb : buckets->loaded.clone()) {
 		srvMESSAGE("Converting bucket ", bb.first);
 		auto newFn = getBucketFilename(bb.first, false, iprot.get());
-		auto newBucket = std::make_unique<bucket>(newFn, iprot->getEncryptionKey(), iprot.get());
+		auto newBucket = std::make_unique<bucket>(newFn, bb.first, true, iprot->getEncryptionKey(), iprot.get());
 		bb.second->migrateTo(newBucket.get());
 		newBucket->store();
 		bb.second->del();
@@ -239,6 +521,8 @@ void filesystem::storage::migrate(unique_ptr<crypto::protocolInterface> iprot) {
 	}
 
 	protocol = std::move(iprot);
+	bucketFilenames.clear();
+	metaBucketFilenames.clear();
 
 }
 
@@ -263,19 +547,58 @@ bool filesystem::storage::initStorage(unique_ptr<crypto::protocolInterface> ipro
 	return true;
 }
 
+void filesystem::storage::setWritebackThreads(unsigned threads) {
+	lckguard l(_writebackMut);
+	writebackThreads = threads;
+	writeback.reset();
+}
+
+util::threadPool* filesystem::storage::writebackPool() {
+	lckguard l(_writebackMut);
+	if (!writeback) {
+		writeback = std::make_unique<util::threadPool>(writebackThreads);
+		srvDEBUG("Started ", writebackThreads, " write-back threads");
+	}
+	return writeback.get();
+}
+
 void filesystem::storage::storeAllData() {
-	srvDEBUG("storing metaBucket data");
-	auto mbl = metaBuckets->loaded.list();
-	for (auto& i : mbl) {
-		if (i) {
-			i->store();//store operation will keep everything in memory but stores a copy to dsk by default
+	auto* pool = writebackPool();
+	//Data buckets first, then the meta buckets that refer to them, and the bucket with the root inode last.
+	//Every phase is a barrier, so metadata is only written after the data it describes. That is the order of the
+	//writes, not of their arrival on disk: nothing is synced here, until then a crash is covered by the journal.
+	{
+		srvDEBUG("storing & clearing bucket data");
+		util::threadPool::taskGroup G;
+		for (auto& i : buckets->loaded.list()) {
+			pool->post([i]() {
+				i->store(true);//store(true) operation will clear cache and stores a copy to dsk.
+				i->unloadHashes();
+			}, &G);
 		}
+		G.wait();
 	}
-
-	srvDEBUG("storing & clearing bucket data");
-	auto bl = buckets->loaded.list();
-	for (auto& i : bl) {
-		i->store(true);//store(true) operation will clear cache and stores a copy to dsk.
+	shared_ptr<bucket> rootBucket;
+	{
+		srvDEBUG("storing metaBucket data");
+		util::threadPool::taskGroup G;
+		for (auto& i : metaBuckets->loaded.clone()) {
+			if (!i.second) {
+				continue;
+			}
+			if (i.first == fs::rootIndex.bucket()) {
+				rootBucket = i.second;
+				continue;
+			}
+			pool->post([b = i.second]() {
+				b->store();//store operation will keep everything in memory but stores a copy to dsk by default
+			}, &G);
+		}
+		G.wait();
+	}
+	if (rootBucket) {
+		srvDEBUG("storing root metaBucket");
+		rootBucket->store();
 	}
 }
 
@@ -292,11 +615,9 @@ std::shared_ptr<hash> storage::getHash(const bucketIndex_t& in) {
 std::shared_ptr<hash> storage::newHash(const crypto::sha256sum& in, std::shared_ptr<chunk> c) {
 	//should check if this hash already exists in the filesystem:
 	{
-		auto it = buckets->hashesIndex.get(in);
+		auto it = buckets->findHash(in);
 		if (it) {
-			if (!it->compareChunk(c)) {
-				srvERROR("HASH COLLISION in hash: ", in.toShortStr());
-			}
+			verifier.verify(it, c);
 			return it;
 		}
 	}
@@ -309,19 +630,52 @@ std::shared_ptr<hash> storage::newHash(const crypto::sha256sum& in, std::shared_
 		//Put both hash and chunk into storage (instead of on hash rest!)
 		buckets->getBucket(bucket.bucket())->putHashAndChunk(bucket.index(), newHash, c);
 
-		buckets->hashesIndex.insert(in, newHash);
+		buckets->hashesIndex.insert(in, bucket);
 		//return the new hash object
 		return newHash;
 	}
 }
 
 
+void storage::storeGeometry(script::JSONPtr config) {
+	(*config)["chunksize"] = chunkSize;
+	(*config)["chunksinbucket"] = chunksInBucket;
+}
+
+bool storage::checkGeometry(script::JSONPtr config) {
+	//Filesystems created before the geometry was stored use 4K chunks in buckets of 256.
+	script::int_t size = 4096, inBucket = 256;
+	if (config->hasProperty("chunksize")) {
+		size = (*config)["chunksize"];
+	}
+	if (config->hasProperty("chunksinbucket")) {
+		inBucket = (*config)["chunksinbucket"];
+	}
+	if (size != chunkSize || inBucket != chunksInBucket) {
+		srvERROR("Filesystem uses ", size, " byte chunks in buckets of ", inBucket, ", this build uses ", chunkSize, " byte chunks in buckets of ", chunksInBucket);
+		return false;
+	}
+	return true;
+}
+
 str storage::getBucketFilename(int64_t id, bool metaBucket, crypto::protocolInterface* prot) {
 	_ASSERT(prot != nullptr);
+	auto& cache = metaBucket ? metaBucketFilenames : bucketFilenames;
+	const bool cacheable = prot == protocol.get();
+	if (cacheable) {
+		auto fn = cache.get(id);
+		if (fn.empty() == false) {
+			return fn;
+		}
+	}
 	str hsh = metaBucket ? prot->getMetaBucketFileName(id) : prot->getBucketFileName(id);
-	util::MKDIR(_path + "dta");
-	util::MKDIR(_path + "dta/" + hsh.substr(0, 2));
-	return _path + "dta/" + hsh.substr(0, 2) + "/" + hsh;
+	io.makeDir(_path + "dta");
+	io.makeDir(_path + "dta/" + hsh.substr(0, 2));
+	str fn = _path + "dta/" + hsh.substr(0, 2) + "/" + hsh;
+	if (cacheable) {
+		cache.insert(id, fn);
+	}
+	return fn;
 }
 
 
@@ -7,7 +7,16 @@
 #include "modules/services/serviceHandler.h"
 #include "modules/util/protected_unordered_map.h"
 #include "locks.h"
+#include "modules/util/threadpool.h"
+#include "chunkcache.h"
+#include "bucketio.h"
+#include "compression.h"
+#include "dedupindex.h"
+#include "compactindex.h"
+#include "dedupverifier.h"
 #include <set>
+#include <condition_variable>
+#include <thread>
 #include "hash.h"
 #include "hash.h"
 
@@ -22,16 +31,35 @@ namespace filesystem {
 
 	class bucketInfo {
 	private:
-		void loadHashesFromBucket(uint64_t id, std::vector<bucketIndex_t>& postList, uint64_t &numLoaded);
+		struct loadBatch {
+			std::vector<compactIndex::record> hashes;
+			std::vector<bucketIndex_t> postList;
+			uint64_t numLoaded = 0;
+		};
+		void loadHashesFromBucket(uint64_t id, loadBatch& out); //Called from several threads at once during mount.
+		bool loadFromDedupIndex(script::JSONPtr metaInfo, const std::set<uint64_t>& initList, std::vector<bucketIndex_t>& postList, uint64_t& numLoaded);
 		bool meta = false;
 		locktype _mut;
 		crypto::protocolInterface* protocol;
+		dedupIndex persisted; //Hashes of data buckets that are not loaded yet
+		uint64_t dedupGeneration = 0;
+
+		//Background build of the hashesIndex (lazy index mode): buckets that are not indexed yet, true while being loaded.
+		std::mutex _indexMut;
+		std::condition_variable _indexCv;
+		std::unordered_map<uint64_t, bool> unindexed;
+		std::atomic_bool indexing{ false };
+		std::atomic_bool unindexedCopies{ false }; //A dedup miss during the build may have stored a second copy of a hash.
+		std::thread indexer;
+		void startIndexing(std::vector<uint64_t> ids);
+		bool indexPending(void); //Indexes one bucket the background build did not start on yet, false if there is none.
 	public:
 		bucketInfo(crypto::protocolInterface* p, bool isMeta);
+		~bucketInfo();
 		
 		unique_ptr<bucketaccounting> accounting;
 		util::protected_unordered_map<uint64_t, shared_ptr<bucket>> loaded;
-		util::protected_unordered_map<const crypto::sha256sum, std::shared_ptr<hash>> hashesIndex;
+		compactIndex hashesIndex; //Data buckets only, meta buckets are not deduplicated.
 
 		void clear(void);
 		void createNewBucket(uint64_t id);
@@ -41,13 +69,45 @@ namespace filesystem {
 		shared_ptr<hash> getHash(const bucketIndex_t& index);
 
 		void loadBuckets(script::JSONPtr metaInfo,const str & name);
+
+		std::shared_ptr<hash> findHash(const crypto::sha256sum& in); //From the hashesIndex or the dedup index, nullptr if unknown.
+		bool dropHash(const crypto::sha256sum& in, hash* h); //Remove a deleted hash from the indexes.
+		uint64_t numHashes(void);
+
+		void ensureIndexed(uint64_t id); //The hashes of the bucket are in the hashesIndex, loads them now if needed.
+		void waitForIndex(void); //Until the background build of the hashesIndex is done.
+		size_t pendingIndex(void); //Buckets the background build still has to index.
+		std::atomic_uint64_t missesWhileIndexing{ 0 }; //Dedup misses that did not wait for the whole build.
+
+		uint64_t getDedupGeneration(void) { return dedupGeneration; }
+		bool storeDedupIndex(uint64_t generation); //Only valid when all buckets are stored and nothing changes anymore.
+		uint64_t oldestJournalEntry(void); //Of the loaded buckets, noJournalEntry when they are all stored.
 	};
 
 
+	/**
+	 * Counters for the bytes written to bucket files, to see the write amplification of storing buckets.
+	 */
+	struct storageStats {
+		std::atomic_uint64_t slotsWritten{0};
+		std::atomic_uint64_t bytesWritten{0};
+		std::atomic_uint64_t bytesFullRewrite{0}; //Bytes a rewrite of the complete files would have written.
+		std::atomic_uint64_t chunksPrefetched{0};
+		std::atomic_uint64_t packedIn{0},packedOut{0}; //Chunk bytes before & after encoding for packed bucket files.
+		std::atomic_uint64_t zeroChunksFull{0},zeroChunksPartial{0}; //Writes that left a chunk all zero, mapped to the zero hash without hashing.
+		std::atomic_uint64_t badRecords{0}; //Chunk or hash records that failed to open, only their own slot is affected.
+	};
+
 	class storage : public service {
 	private:
 		str _path;
 		unique_ptr<crypto::protocolInterface> protocol;
+		unsigned writebackThreads = util::threadPool::defaultThreads();
+		unique_ptr<util::threadPool> writeback;
+		std::atomic<chunkCodec> compression{chunkCodec::NONE};
+		std::atomic_bool lazyIndex{false};
+		locktype _writebackMut;
+		util::protected_unordered_map<int64_t, str> bucketFilenames, metaBucketFilenames; //For the current protocol
 
 	public:
 		srvSTATICDEFAULTNEWINSTANCE(storage);
@@ -57,7 +117,11 @@ namespace filesystem {
 
 		crypto::protocolInterface* prot();
 
+		bucketIO io; //Declared before the buckets, which use it until they are destroyed.
 		unique_ptr<bucketInfo> metaBuckets, buckets;
+		storageStats stats;
+		chunkCache cache; //Decrypted chunks of data buckets
+		dedupVerifier verifier; //Checks dedup hits byte for byte, inline or in the background (--verify_dedup)
 
 		void setPath(const char* ipath);
 		const str& getPath();
@@ -66,7 +130,13 @@ namespace filesystem {
 
 		bool initStorage(unique_ptr<crypto::protocolInterface> iprot);
 
-		void storeAllData();
+		void setWritebackThreads(unsigned threads);
+		void setCompression(chunkCodec codec) { compression = codec; } //Codec for new bucket files, packed files stay packed.
+		chunkCodec getCompression() { return compression.load(); }
+		void setLazyIndex(bool lazy) { lazyIndex = lazy; } //Build the data hashesIndex in the background after mount.
+		bool getLazyIndex() { return lazyIndex.load(); }
+		util::threadPool* writebackPool(); //Bounded pool for encrypting & writing buckets.
+		void storeAllData(); //Stores data buckets, then meta buckets, then the root meta bucket. Returns when all are written.
 
 		std::shared_ptr<hash> getHash(const bucketIndex_t& id);
 		std::shared_ptr<hash> newHash(const crypto::sha256sum& in, std::shared_ptr<chunk> c);
@@ -74,6 +144,9 @@ namespace filesystem {
 
 		str getBucketFilename(int64_t id, bool metaBucket, crypto::protocolInterface* prot);
 
+		static void storeGeometry(script::JSONPtr config); //Record the chunk geometry of this build in the filesystem config.
+		bool checkGeometry(script::JSONPtr config); //False if the filesystem was created with another chunk geometry.
+
 
 	};
 }
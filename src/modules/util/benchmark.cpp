@@ -0,0 +1,145 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "benchmark.h"
+#include "main.h"
+#include "protected_unordered_map.h"
+#include "modules/crypto/sha256batch.h"
+#include "modules/filesystem/chunk.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using namespace util;
+
+namespace {
+	double secondsSince(const std::chrono::steady_clock::time_point & start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	}
+
+	str fixed(double value,const char * format = "%.2f") {
+		char buf[32];
+		snprintf(buf,sizeof(buf),format,value);
+		return buf;
+	}
+
+	/**
+	 * Millions of operations per second of threads working on one map: 80% get, 10% insert, 10% erase,
+	 * on random keys out of 64K with shared_ptr values, like loaded & inodeFileCache see them.
+	 */
+	template<size_t SHARDS> double mapOpsPerSecond(unsigned threads) {
+		constexpr uint64_t keys = 1 << 16;
+		constexpr uint64_t opsPerThread = 1 << 20;
+		protected_unordered_map<uint64_t,std::shared_ptr<uint64_t>,std::shared_mutex,SHARDS> map;
+		std::vector<std::shared_ptr<uint64_t>> values(keys);
+		for(uint64_t k=0;k<keys;k++) {
+			values[k] = std::make_shared<uint64_t>(k);
+			if(k%2==0) {
+				map.insert(k,values[k]);
+			}
+		}
+
+		std::vector<std::thread> workers;
+		const auto start = std::chrono::steady_clock::now();
+		for(unsigned t=0;t<threads;t++) {
+			workers.emplace_back([&,t]() {
+				uint64_t x = 0x9e3779b97f4a7c15ULL*(t+1);
+				for(uint64_t op=0;op<opsPerThread;op++) {
+					x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+					const uint64_t key = (x >> 8) % keys;
+					switch(x % 10) {
+						case 8:	map.insert(key,values[key]); break;
+						case 9:	map.erase(key); break;
+						default: map.get(key);
+					}
+				}
+			});
+		}
+		for(auto & w: workers) {
+			w.join();
+		}
+		return double(threads)*opsPerThread/secondsSince(start)/1e6;
+	}
+
+	void benchMap(void) {
+		constexpr size_t shards = 32;
+		const unsigned cores = std::max(std::thread::hardware_concurrency(),1u);
+		CLOG("protected_unordered_map, ",cores," cores, Mops/s (80% get, 10% insert, 10% erase on 64K keys):");
+		for(unsigned threads = 1;threads <= std::max(16u,cores);threads *= 2) {
+			const double single = mapOpsPerSecond<1>(threads);
+			const double sharded = mapOpsPerSecond<shards>(threads);
+			CLOG("  threads: ",threads," single lock: ",fixed(single)," sharded(",shards,"): ",fixed(sharded)," speedup: ",fixed(sharded/single),"x");
+		}
+	}
+
+	/**
+	 * GB/s of one SHA-256 kernel on batches of count chunks, each in its own buffer like file::writeInner hands them
+	 * to chunk::getHashes (a 128K FUSE write is a batch of 32 4K chunks). The buffers cycle through 16MB.
+	 */
+	double shaGigabytesPerSecond(void (*kernel)(const unsigned char * const *,size_t,size_t,unsigned char *),size_t count) {
+		constexpr size_t bytes = size_t(256) << 20;
+		const size_t chunks = (size_t(16) << 20)/filesystem::chunkSize;
+		std::vector<std::vector<unsigned char>> data(chunks,std::vector<unsigned char>(filesystem::chunkSize));
+		uint64_t x = 0x9e3779b97f4a7c15ULL;
+		for(auto & d: data) {
+			for(auto & c: d) {
+				x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+				c = x;
+			}
+		}
+		std::vector<const unsigned char *> in(count);
+		std::vector<unsigned char> out(32*count);
+		const size_t batches = bytes/(filesystem::chunkSize*count);
+		size_t next = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for(size_t b=0;b<batches;b++) {
+			for(auto & i: in) {
+				i = data[next].data();
+				next = (next+1) % chunks;
+			}
+			kernel(in.data(),filesystem::chunkSize,count,out.data());
+		}
+		return double(batches*count*filesystem::chunkSize)/secondsSince(start)/1e9;
+	}
+
+	void benchSha(void) {
+		namespace sha = crypto::sha256batch;
+		struct kernel {
+			const char * name;
+			void (*fn)(const unsigned char * const *,size_t,size_t,unsigned char *);
+			bool supported;
+		};
+		const std::vector<kernel> kernels = {
+			{"scalar",sha::hashScalar,true},
+			{"sha-ni",sha::hashShaNi,sha::haveShaNi()},
+			{"avx2",sha::hashAvx2,sha::haveAvx2()},
+		};
+		CLOG("sha256batch, GB/s on ",filesystem::chunkSize," byte chunks, active kernel: ",sha::implementation());
+		for(auto & k: kernels) {
+			if(!k.supported) {
+				CLOG("  ",k.name,": not supported by this CPU");
+				continue;
+			}
+			str line = BUILDSTRING("  ",k.name,":");
+			for(size_t count: {1,8,32}) {
+				line += BUILDSTRING(" batch of ",count,": ",fixed(shaGigabytesPerSecond(k.fn,count)));
+			}
+			CLOG(line);
+		}
+	}
+}
+
+int util::runBenchmark(const str & name) {
+	if(name=="map") {
+		benchMap();
+		return EXIT_SUCCESS;
+	}
+	if(name=="sha") {
+		benchSha();
+		return EXIT_SUCCESS;
+	}
+	CLOG("Unknown benchmark ",name,", expected: map or sha");
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,21 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef UTIL_BENCHMARK_H
+#define UTIL_BENCHMARK_H
+
+#include "types.h"
+
+namespace util {
+
+	/**
+	 * Microbenchmarks behind --bench, they print their results to the console & do not touch a filesystem.
+	 *
+	 * map: get/insert/erase on protected_unordered_map, sharded against a single shard (the single lock map it
+	 *      replaced), from 1, 2, 4 ... threads up to 16 or the number of cores, whichever is more.
+	 * sha: every SHA-256 kernel the CPU supports (scalar, SHA-NI, AVX2) on batches of 1, 8 & 32 chunks.
+	 */
+	int runBenchmark(const str & name); //EXIT_SUCCESS, or EXIT_FAILURE for an unknown name.
+}
+
+#endif // UTIL_BENCHMARK_H
@@ -36,12 +36,20 @@ bool openfile(T& F, const str& fname, T2 mod) {
 	return F.is_open();
 }
 
-str util::getSystemString(const str & fname,uint64_t offset) {
+str util::getSystemString(const str & fname,uint64_t offset,uint64_t size) {
 	std::ifstream F;
 	if(openfile(F,fname,std::ios::binary|std::ios::in)) {
 		if(offset) {
 			F.seekg(offset);
 		}
+		if(size) {
+			//Read exactly size bytes, a short read returns what could be read.
+			str ret;
+			ret.resize(size);
+			F.read(&ret[0],size);
+			ret.resize(F.gcount());
+			return ret;
+		}
 		return str(std::istreambuf_iterator<char>(F),std::istreambuf_iterator<char>());
 	}
 	return "";
@@ -64,3 +72,22 @@ bool util::putSystemString(const str & fname, const str & content) {
 	}
 	return false;
 }
+
+bool util::patchSystemString(const str & fname, const std::vector<std::pair<uint64_t,str>> & parts) {
+	std::fstream F;
+	try{
+		if(openfile(F, fname, std::ios::binary|std::ios::in|std::ios::out)) {
+			for(const auto & part: parts) {
+				F.seekp(part.first);
+				F.write(part.second.data(),part.second.size());
+			}
+			F.close();
+			return F.good();
+		} else {
+			CLOG("Failed to open file ",fname, " for patching" );
+		}
+	} catch(std::exception & e) {
+		CLOG("Failed to patch file ",fname, " error: ",e.what());
+	}
+	return false;
+}
@@ -4,6 +4,7 @@
 #ifndef UTIL_FILES_H
 #define UTIL_FILES_H
 #include "main.h"
+#include <vector>
 
 namespace util {
 
@@ -12,8 +13,9 @@ namespace util {
 	 */
 	bool MKDIR(const str & path);
 	bool fileExists(const str & name, size_t * size=nullptr);
-	str getSystemString(const str & path, uint64_t offset = 0);
+	str getSystemString(const str & path, uint64_t offset = 0, uint64_t size = 0);
 	bool putSystemString(const str & path,const str & content);
+	bool patchSystemString(const str & path,const std::vector<std::pair<uint64_t,str>> & parts); //Overwrite parts of an existing file in place.
 
 }
 
@@ -0,0 +1,51 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "histogram.h"
+#include "buildstring.h"
+#include <algorithm>
+
+using namespace util;
+
+latencyHistogram::latencyHistogram() {
+	for(auto & b: buckets) {
+		b = 0;
+	}
+}
+
+void latencyHistogram::add(uint64_t microseconds) {
+	unsigned b = 0;
+	while(b+1<numBuckets && (microseconds >> b)>0) {
+		++b;
+	}
+	++buckets[b];
+	++total;
+	sum += microseconds;
+}
+
+uint64_t latencyHistogram::percentile(unsigned p) {
+	const uint64_t n = total.load();
+	if(n==0) {
+		return 0;
+	}
+	const uint64_t rank = (n*p+99)/100;
+	uint64_t seen = 0;
+	for(unsigned b=0;b<numBuckets;b++) {
+		seen += buckets[b].load();
+		if(seen>=rank) {
+			return uint64_t(1) << b;
+		}
+	}
+	return uint64_t(1) << (numBuckets-1);
+}
+
+str latencyHistogram::toString(void) {
+	const uint64_t n = std::max<uint64_t>(total.load(),1);
+	str ret = BUILDSTRING("n: ",total.load()," avg: ",sum.load()/n,"us p50: <",percentile(50),"us p99: <",percentile(99),"us |");
+	for(unsigned b=0;b<numBuckets;b++) {
+		if(const auto c = buckets[b].load()) {
+			ret += BUILDSTRING(" <",uint64_t(1) << b,"us:",c);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,32 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef UTIL_HISTOGRAM_H
+#define UTIL_HISTOGRAM_H
+
+#include "types.h"
+#include <array>
+#include <atomic>
+
+namespace util {
+
+	/**
+	 * Lock free latency histogram with power of two buckets: bucket n counts samples below 2^n microseconds.
+	 */
+	class latencyHistogram final{
+	private:
+		static constexpr unsigned numBuckets = 32;
+		std::array<std::atomic_uint64_t,numBuckets> buckets;
+		std::atomic_uint64_t total{0},sum{0};
+	public:
+		latencyHistogram();
+		latencyHistogram(const latencyHistogram&) = delete;
+
+		void add(uint64_t microseconds);
+		uint64_t count(void) { return total.load(); }
+		uint64_t percentile(unsigned p); //Upper bound in microseconds of the bucket holding the p-th percentile.
+		str toString(void); //"n: N avg: Xus p50: <Yus p99: <Zus | <1us:N <2us:N ..." with only the buckets that have samples.
+	};
+}
+
+#endif // UTIL_HISTOGRAM_H
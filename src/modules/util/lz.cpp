@@ -0,0 +1,177 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "lz.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+using namespace util;
+
+namespace {
+	constexpr size_t minMatch = 4;
+	constexpr size_t lastLiterals = 5; //The last bytes of a block are always literals
+	constexpr size_t matchLimit = 12;  //A match can not start in the last bytes of a block
+	constexpr size_t maxOffset = 65535;
+	constexpr unsigned hashLog = 12;
+
+	inline uint32_t read32(const uint8_t * p) {
+		uint32_t ret;
+		std::memcpy(&ret,p,sizeof(ret));
+		return ret;
+	}
+
+	inline uint32_t hash32(uint32_t v) {
+		return (v * 2654435761U) >> (32-hashLog);
+	}
+
+	class writer {
+	private:
+		uint8_t * out;
+		size_t pos = 0,capacity;
+	public:
+		bool overflow = false;
+		writer(uint8_t * iout,size_t icapacity) : out(iout),capacity(icapacity) {}
+		size_t size() const { return pos; }
+		uint8_t * reserve(size_t n) {
+			if(overflow || pos+n > capacity) {
+				overflow = true;
+				return nullptr;
+			}
+			auto * ret = out+pos;
+			pos += n;
+			return ret;
+		}
+		void length(size_t len) { //Length continuation bytes, after the 15 in the token
+			for(;len>=255;len-=255) {
+				if(auto * p = reserve(1)) { *p = 255; }
+			}
+			if(auto * p = reserve(1)) { *p = (uint8_t)len; }
+		}
+		void sequence(const uint8_t * literals,size_t numLiterals,size_t offset,size_t matchLength) {
+			auto * token = reserve(1);
+			if(!token) {
+				return;
+			}
+			*token = (uint8_t)(std::min<size_t>(numLiterals,15) << 4);
+			if(numLiterals>=15) {
+				length(numLiterals-15);
+			}
+			auto * p = reserve(numLiterals);
+			if(p && numLiterals) {
+				std::memcpy(p,literals,numLiterals);
+			}
+			if(matchLength==0) {
+				return;//Last sequence
+			}
+			if((p = reserve(2))) {
+				p[0] = (uint8_t)(offset & 0xFF);
+				p[1] = (uint8_t)(offset >> 8);
+			}
+			matchLength -= minMatch;
+			*token |= (uint8_t)std::min<size_t>(matchLength,15);
+			if(matchLength>=15) {
+				length(matchLength-15);
+			}
+		}
+	};
+
+	size_t readLength(const uint8_t * in,size_t inSize,size_t & ip) {
+		size_t ret = 0;
+		uint8_t b;
+		do {
+			if(ip>=inSize) {
+				throw std::out_of_range("lz::decompress: truncated input");
+			}
+			b = in[ip++];
+			ret += b;
+		} while(b==255);
+		return ret;
+	}
+}
+
+size_t util::lz::compress(const uint8_t * in,size_t inSize,uint8_t * out,size_t outCapacity) {
+	writer W(out,outCapacity);
+	size_t anchor = 0;
+	if(inSize > matchLimit) {
+		std::array<uint32_t,1<<hashLog> table; //Position+1 of the last occurrence of a hash, 0 == none
+		table.fill(0);
+		const size_t limit = inSize - matchLimit;
+		size_t ip = 0;
+		while(ip < limit) {
+			const uint32_t seq = read32(in+ip);
+			auto & slot = table[hash32(seq)];
+			const size_t ref = slot;
+			slot = (uint32_t)(ip+1);
+			if(ref==0 || ip-(ref-1) > maxOffset || read32(in+ref-1)!=seq) {
+				++ip;
+				continue;
+			}
+			size_t match = ref-1;
+			//Extend the match backwards into the pending literals, then forwards.
+			while(ip>anchor && match>0 && in[ip-1]==in[match-1]) {
+				--ip;
+				--match;
+			}
+			size_t len = minMatch;
+			while(ip+len < inSize-lastLiterals && in[ip+len]==in[match+len]) {
+				++len;
+			}
+			W.sequence(in+anchor,ip-anchor,ip-match,len);
+			if(W.overflow) {
+				return 0;
+			}
+			ip += len;
+			anchor = ip;
+		}
+	}
+	W.sequence(in+anchor,inSize-anchor,0,0);
+	return W.overflow ? 0 : W.size();
+}
+
+size_t util::lz::decompress(const uint8_t * in,size_t inSize,uint8_t * out,size_t outCapacity) {
+	size_t ip = 0,op = 0;
+	while(ip < inSize) {
+		const uint8_t token = in[ip++];
+		size_t numLiterals = token >> 4;
+		if(numLiterals==15) {
+			numLiterals += readLength(in,inSize,ip);
+		}
+		if(numLiterals > inSize-ip || numLiterals > outCapacity-op) {
+			throw std::out_of_range("lz::decompress: literals out of range");
+		}
+		if(numLiterals) {
+			std::memcpy(out+op,in+ip,numLiterals);
+		}
+		ip += numLiterals;
+		op += numLiterals;
+		if(ip==inSize) {
+			break;//The last sequence has no match
+		}
+		if(inSize-ip < 2) {
+			throw std::out_of_range("lz::decompress: truncated input");
+		}
+		const size_t offset = in[ip] | (size_t(in[ip+1]) << 8);
+		ip += 2;
+		size_t matchLength = token & 15;
+		if(matchLength==15) {
+			matchLength += readLength(in,inSize,ip);
+		}
+		matchLength += minMatch;
+		if(offset==0 || offset > op || matchLength > outCapacity-op) {
+			throw std::out_of_range("lz::decompress: match out of range");
+		}
+		const uint8_t * from = out+op-offset;
+		if(offset >= matchLength) {
+			std::memcpy(out+op,from,matchLength);
+		} else {
+			//Byte by byte: the match overlaps the bytes it produces.
+			for(size_t a=0;a<matchLength;a++) {
+				out[op+a] = from[a];
+			}
+		}
+		op += matchLength;
+	}
+	return op;
+}
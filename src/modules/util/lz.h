@@ -0,0 +1,20 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef UTIL_LZ_H
+#define UTIL_LZ_H
+#include "types.h"
+
+namespace util {
+
+	/**
+	 * Small LZ77 block codec, using the LZ4 block format (token, literals, 16 bit offset, match length).
+	 * Meant for blocks of up to 64KB, the compressor keeps a single hash table on the stack.
+	 */
+	namespace lz {
+		size_t compress(const uint8_t * in,size_t inSize,uint8_t * out,size_t outCapacity); //Returns 0 if the result does not fit in outCapacity.
+		size_t decompress(const uint8_t * in,size_t inSize,uint8_t * out,size_t outCapacity); //Throws std::out_of_range on corrupt input.
+	}
+}
+
+#endif // UTIL_LZ_H
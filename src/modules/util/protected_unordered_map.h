@@ -3,72 +3,103 @@
 // license that can be found in the LICENSE file.
 /**
  * Implements a basic map with locking.
+ *
+ * The keys are spread over SHARDS maps, each with its own lock, so threads working on different keys
+ * rarely wait on each other. Operations on a single key lock a single shard, list/clone/clear visit
+ * the shards one after the other (so they are not a snapshot of the whole map at one moment).
  **/
 
 #ifndef UTIL_PROTECTED_UNORDERED_MAP_H
 #define UTIL_PROTECTED_UNORDERED_MAP_H
 
 #include <unordered_map>
+#include <mutex>
 #include <shared_mutex>
 #include <atomic>
+#include <array>
+#include <vector>
 
 namespace util {
-	template<typename K,typename T,typename MUTEX=std::shared_mutex>
+	template<typename K,typename T,typename MUTEX=std::shared_mutex,size_t SHARDS=32>
 	class protected_unordered_map final {
 	private:
-		std::unordered_map<K, T> _map;
-		MUTEX _mut;
+		struct alignas(64) shard {
+			std::unordered_map<K, T> _map;
+			MUTEX _mut;
+		};
+		std::array<shard,SHARDS> _shards;
 		std::atomic<size_t> _size;
+
+		shard & shardOf(const K& key) {
+			//Mix the hash first: hashes like bucketIndex_t keep their entropy in a few bits.
+			uint64_t h = std::hash<K>{}(key);
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			return _shards[h % SHARDS];
+		}
 	public:
 		protected_unordered_map() {
 			_size = 0;
-			_map.clear();
 		}
 		protected_unordered_map(const protected_unordered_map&) = delete;
 
 
 		T get(const K& key) {
-			std::shared_lock<MUTEX> l(_mut);
-			auto it = _map.find(key);
-			if (it != _map.end()) {
+			auto & s = shardOf(key);
+			std::shared_lock<MUTEX> l(s._mut);
+			auto it = s._map.find(key);
+			if (it != s._map.end()) {
 				return it->second;
 			}
 			return T();
 		}
 
 		void insert(const K& key, T value) {
-			std::unique_lock<MUTEX> l(_mut);
-			_map[key] = value;
-			_size = _map.size();
+			auto & s = shardOf(key);
+			std::unique_lock<MUTEX> l(s._mut);
+			if (s._map.insert_or_assign(key, std::move(value)).second) {
+				++_size;
+			}
 		}
 
 		size_t erase(const K& key) {
-			std::unique_lock<MUTEX> l(_mut);
-			auto ret = _map.erase(key);
-			_size = _map.size();
+			auto & s = shardOf(key);
+			std::unique_lock<MUTEX> l(s._mut);
+			auto ret = s._map.erase(key);
+			_size -= ret;
 			return ret;
 		}
 
 		void clear() {
-			std::unique_lock<MUTEX> l(_mut);
-			_map.clear();
-			_size = 0;
+			for (auto & s : _shards) {
+				std::unique_lock<MUTEX> l(s._mut);
+				_size -= s._map.size();
+				s._map.clear();
+			}
 		}
 
 		size_t size() { return _size.load(); }
 
 		std::vector<T> list() {
-			std::shared_lock<MUTEX> l(_mut);
 			std::vector<T> ret;
-			for (auto& i : _map) {
-				ret.push_back(i.second);
+			ret.reserve(size());
+			for (auto & s : _shards) {
+				std::shared_lock<MUTEX> l(s._mut);
+				for (auto& i : s._map) {
+					ret.push_back(i.second);
+				}
 			}
 			return ret;
 		}
-		
+
 		std::unordered_map<K,T> clone() {
-			std::shared_lock<MUTEX> l(_mut);
-			std::unordered_map<K,T> ret = _map;
+			std::unordered_map<K,T> ret;
+			ret.reserve(size());
+			for (auto & s : _shards) {
+				std::shared_lock<MUTEX> l(s._mut);
+				ret.insert(s._map.begin(), s._map.end());
+			}
 			return ret;
 		}
 
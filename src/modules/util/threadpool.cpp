@@ -0,0 +1,126 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#include "threadpool.h"
+#include "main.h"
+
+using namespace util;
+
+void threadPool::taskGroup::done(std::exception_ptr e) {
+	std::unique_lock<std::mutex> l(_mut);
+	if(e && !error) {
+		error = std::move(e);
+	}
+	_ASSERT(pending>0);
+	if(--pending==0) {
+		_cv.notify_all();
+	}
+}
+
+void threadPool::taskGroup::wait(bool rethrow) {
+	std::unique_lock<std::mutex> l(_mut);
+	_cv.wait(l,[this](){ return pending==0; });
+	if(rethrow && error) {
+		auto e = error;
+		error = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+threadPool::threadPool(unsigned threads,size_t imaxQueue) : maxQueue(imaxQueue ? imaxQueue : 4 * std::max(threads,1u)) {
+	for(unsigned a=0;a<threads;a++) {
+		workers.emplace_back([this](){ worker(); });
+	}
+}
+
+threadPool::~threadPool() {
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		stopping = true;
+	}
+	_workAvailable.notify_all();
+	_spaceAvailable.notify_all();
+	for(auto & t: workers) {
+		t.join();//Workers drain the queue before they stop.
+	}
+}
+
+unsigned threadPool::defaultThreads(void) {
+	return std::max(std::thread::hardware_concurrency(),1u);
+}
+
+void threadPool::run(queued & q) {
+	std::exception_ptr e;
+	try{
+		q.fn();
+	} catch(...) {
+		e = std::current_exception();
+		if(!q.group) {
+			CLOG("Uncaught exception in threadPool task");
+		}
+	}
+	if(q.group) {
+		q.group->done(std::move(e));
+	}
+}
+
+void threadPool::worker(void) {
+	while(1) {
+		queued q;
+		{
+			std::unique_lock<std::mutex> l(_mut);
+			_workAvailable.wait(l,[this](){ return stopping || queue.empty()==false; });
+			if(queue.empty()) {
+				return;
+			}
+			q = std::move(queue.front());
+			queue.pop_front();
+		}
+		_spaceAvailable.notify_one();
+		run(q);
+	}
+}
+
+bool threadPool::enqueue(task_t & fn,taskGroup * group,bool block) {
+	if(group) {
+		std::unique_lock<std::mutex> l(group->_mut);
+		group->pending++;
+	}
+	if(workers.empty()) {
+		queued q{std::move(fn),group};
+		run(q);
+		return true;
+	}
+	{
+		std::unique_lock<std::mutex> l(_mut);
+		if(block) {
+			_spaceAvailable.wait(l,[this](){ return stopping || queue.size()<maxQueue; });
+		}
+		if(stopping==false && queue.size()<maxQueue) {
+			queue.push_back(queued{std::move(fn),group});
+			l.unlock();
+			_workAvailable.notify_one();
+			return true;
+		}
+	}
+	if(group) {
+		group->done(nullptr); //Notifies, a wait() may have started in the mean time.
+	}
+	return false;
+}
+
+void threadPool::post(task_t fn,taskGroup * group) {
+	if(enqueue(fn,group,true)==false) {
+		//Pool is shutting down, run it here.
+		if(group) {
+			std::unique_lock<std::mutex> l(group->_mut);
+			group->pending++;
+		}
+		queued q{std::move(fn),group};
+		run(q);
+	}
+}
+
+bool threadPool::tryPost(task_t fn,taskGroup * group) {
+	return enqueue(fn,group,false);
+}
@@ -0,0 +1,72 @@
+// Copyright 2018 Menne Kamminga <kamminga DOT m AT gmail DOT com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+#ifndef UTIL_THREADPOOL_H
+#define UTIL_THREADPOOL_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <deque>
+
+namespace util {
+
+	/**
+	 * A fixed number of worker threads with a bounded task queue.
+	 *
+	 * post() blocks while the queue is full, tryPost() returns false instead.
+	 * Tasks can be added to a taskGroup, taskGroup::wait() is a barrier for all tasks in that group.
+	 * A pool with 0 threads runs every task on the calling thread.
+	 * Never wait() on a group from inside one of the pool's own tasks.
+	 */
+	class threadPool final{
+	public:
+		class taskGroup final{
+			friend class threadPool;
+		private:
+			std::mutex _mut;
+			std::condition_variable _cv;
+			unsigned pending = 0;
+			std::exception_ptr error;
+			void done(std::exception_ptr e);
+		public:
+			taskGroup() {}
+			taskGroup(const taskGroup&) = delete;
+			~taskGroup() { wait(false); }
+
+			void wait(bool rethrow = true); //Wait for all tasks of the group, rethrows the first exception of a task.
+		};
+		typedef std::function<void()> task_t;
+	private:
+		struct queued{
+			task_t fn;
+			taskGroup * group;
+		};
+		std::mutex _mut;
+		std::condition_variable _workAvailable,_spaceAvailable;
+		std::deque<queued> queue;
+		std::vector<std::thread> workers;
+		const size_t maxQueue;
+		bool stopping = false;
+		void worker(void);
+		static void run(queued & q);
+		bool enqueue(task_t & fn,taskGroup * group,bool block);
+	public:
+		threadPool(unsigned threads,size_t imaxQueue = 0); //maxQueue==0 : 4 tasks per thread
+		threadPool(const threadPool&) = delete;
+		~threadPool();
+
+		void post(task_t fn,taskGroup * group = nullptr);
+		bool tryPost(task_t fn,taskGroup * group = nullptr);
+		unsigned size() const { return workers.size(); }
+
+		static unsigned defaultThreads(void);
+	};
+
+}
+
+#endif // UTIL_THREADPOOL_H